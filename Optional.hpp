@@ -88,6 +88,24 @@ public:
         }
     }
 
+    /**
+     * @brief Apply the given function to this Option's value, if it
+     * is present, to obtain a new optional value.
+     * This version of `map` works with plain function pointers that
+     * take the value by reference.
+     *
+     * @param f The function to apply.
+     * @return The new value.
+     */
+    template <typename B>
+    Optional<B> map(B (*f)(const T &)) {
+        if(empty) {
+            return Optional<B>::None();
+        } else {
+            return Optional<B>::Just(f(x));
+        }
+    }
+
     /**
      * @brief Apply the given function to this Option's value, if it
      * is present, to obtain a new optional value.
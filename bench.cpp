@@ -0,0 +1,548 @@
+#include "interp.hpp"
+#include "compact.hpp"
+#include "compress.hpp"
+#include "frame.hpp"
+#include "journal.hpp"
+#include "packed.hpp"
+#include "schema.hpp"
+#include "sexp-json.hpp"
+#include "sexp-view.hpp"
+#include "scheduler.hpp"
+#include "static-commands.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <thread>
+#include <vector>
+
+#include <unistd.h>
+
+typedef std::chrono::steady_clock Clock;
+
+static double to_ms(Clock::duration d) {
+    return std::chrono::duration<double, std::milli>(d).count();
+}
+
+// Benchmark command: busy-wait for the given number of microseconds
+std::string work(std::list<std::string> args) {
+    int us = args.empty() ? 1000 : std::stoi(args.front());
+    Clock::time_point until = Clock::now() + std::chrono::microseconds(us);
+    while(Clock::now() < until) {
+    }
+    return "done";
+}
+
+// Saturate the scheduler with housekeeping batches and measure how long
+// safe-mode commands take to complete in the meantime.
+void bench_scheduler() {
+    CommandSet commands;
+    commands["work"] = work;
+    Scheduler scheduler(commands, 2);
+
+    // Each batch is ~8ms of work split into 2ms nodes
+    Sexp batch = parse("(work 2000 (work 2000) (work 2000) (work 2000) )").get();
+    std::vector<std::future<Optional<std::string>>> background;
+    for(int i = 0; i < 500; ++i) {
+        background.push_back(scheduler.submit(batch, Priority::Housekeeping));
+    }
+
+    Sexp ping = parse("(work 10)").get();
+    std::vector<double> latencies;
+    for(int i = 0; i < 100; ++i) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        Clock::time_point start = Clock::now();
+        scheduler.submit(ping, Priority::SafeMode).wait();
+        latencies.push_back(to_ms(Clock::now() - start));
+    }
+    QueueStats housekeeping = scheduler.stats(Priority::Housekeeping);
+    QueueStats safe = scheduler.stats(Priority::SafeMode);
+
+    std::sort(latencies.begin(), latencies.end());
+    std::cout << "scheduler: safe-mode latency under saturation (ms): "
+              << "p50 " << latencies[latencies.size() / 2]
+              << ", p99 " << latencies[latencies.size() * 99 / 100]
+              << ", max " << latencies.back() << std::endl;
+    std::cout << "scheduler: safe-mode mean wait " << to_ms(safe.mean_wait())
+              << "ms, max wait " << to_ms(safe.max_wait) << "ms" << std::endl;
+    std::cout << "scheduler: housekeeping depth " << housekeeping.depth
+              << ", mean wait " << to_ms(housekeeping.mean_wait())
+              << "ms" << std::endl;
+
+    for(auto &f : background) {
+        f.wait();
+    }
+}
+
+// Benchmark command: sum integer arguments in place
+std::string sum(std::span<const ArgView> args) {
+    long long total = 0;
+    for(const ArgView &arg : args) {
+        total += arg.integer;
+    }
+    return std::to_string(total);
+}
+
+// Compare evaluating the same small commands through a CommandSet and a
+// StaticCommandSet with the same commands
+void bench_dispatch() {
+    typedef StaticCommandSet<Cmd<"work", &work>, Cmd<"sum", &sum>> Static;
+    CommandSet dynamic = Static::to_command_set();
+    Static fixed;
+    Sexp s = parse("(sum 1 (sum 2 3) (sum 4 (sum 5 6)))").get();
+    const int runs = 1000000;
+
+    Clock::time_point start = Clock::now();
+    for(int i = 0; i < runs; ++i) {
+        interp_with(s, dynamic);
+    }
+    double dynamic_ms = to_ms(Clock::now() - start);
+    start = Clock::now();
+    for(int i = 0; i < runs; ++i) {
+        interp_with(s, fixed);
+    }
+    double static_ms = to_ms(Clock::now() - start);
+    std::cout << "dispatch: CommandSet " << dynamic_ms * 1e6 / runs
+              << "ns, StaticCommandSet " << static_ms * 1e6 / runs
+              << "ns per evaluation" << std::endl;
+}
+
+// Measure how fast a ground plan is checked against command schemas
+void bench_schema() {
+    CommandSet commands;
+    commands["work"] = Command(work).with_schema(
+        Schema{{ArgSchema::integer("us", 0, 1000000)}});
+    commands["sum"] = Command(sum).with_schema(
+        Schema{{ArgSchema::integer("n")}, true});
+    PlanChecker checker(commands);
+    std::vector<Sexp> plan;
+    for(int i = 0; i < 100000; ++i) {
+        plan.push_back(parse("(sum 1 (work " + std::to_string(i)
+                             + ") (sum 2 3 (work 10)))").get());
+    }
+
+    Clock::time_point start = Clock::now();
+    std::vector<Diagnostic> found = checker.check_plan(plan);
+    double ms = to_ms(Clock::now() - start);
+    std::cout << "schema: checked " << plan.size() << " commands in " << ms
+              << "ms (" << plan.size() / ms * 1000 << " commands/s, "
+              << found.size() << " diagnostics)" << std::endl;
+}
+
+// A plan of typical commands: short names, small numbers and modes, with
+// some nesting
+std::vector<Sexp> typical_plan(size_t n) {
+    const char *templates[] = {
+        "(set-mode safe)",
+        "(adcs-point %d 45 -30)",
+        "(radio-tx %d (concat beacon- %d))",
+        "(camera-capture %d (add %d 250) hi-res)",
+        "(log-level debug)",
+        "(heater-set %d (add %d 5))",
+    };
+    std::vector<Sexp> plan;
+    for(size_t i = 0; i < n; ++i) {
+        char cmd[128];
+        int x = (int)(i * 37 % 1000);
+        snprintf(cmd, sizeof(cmd), templates[i % 6], x, x + 1);
+        plan.push_back(parse(cmd).get());
+    }
+    return plan;
+}
+
+// Compare the size and speed of the cereal-compatible and compact formats
+void bench_compact() {
+    std::vector<Sexp> plan = typical_plan(100000);
+    std::vector<std::string> cereal_frames;
+    std::vector<std::string> compact_frames;
+    size_t cereal_bytes = 0;
+    size_t compact_bytes = 0;
+
+    Clock::time_point start = Clock::now();
+    for(const Sexp &s : plan) {
+        cereal_frames.push_back(serialize(s));
+        cereal_bytes += cereal_frames.back().size();
+    }
+    double cereal_encode = to_ms(Clock::now() - start);
+    start = Clock::now();
+    for(const Sexp &s : plan) {
+        compact_frames.push_back(serialize_compact(s));
+        compact_bytes += compact_frames.back().size();
+    }
+    double compact_encode = to_ms(Clock::now() - start);
+    start = Clock::now();
+    for(const std::string &frame : cereal_frames) {
+        deserialize(frame);
+    }
+    double cereal_decode = to_ms(Clock::now() - start);
+    start = Clock::now();
+    for(const std::string &frame : compact_frames) {
+        deserialize_compact(frame);
+    }
+    double compact_decode = to_ms(Clock::now() - start);
+    start = Clock::now();
+    size_t nodes = 0;
+    for(const std::string &frame : compact_frames) {
+        nodes += SexpView(frame).nodes();
+    }
+    double view_decode = to_ms(Clock::now() - start);
+
+    std::cout << "compact: " << plan.size() << " commands, cereal "
+              << cereal_bytes << " bytes, compact " << compact_bytes
+              << " bytes (" << 100.0 * compact_bytes / cereal_bytes << "%)"
+              << std::endl;
+    // The same plan with a dictionary of its command names and modes
+    CommandSet names;
+    const char *commands[] = {"set-mode", "adcs-point", "radio-tx", "concat",
+                              "camera-capture", "add", "log-level",
+                              "heater-set"};
+    for(const char *name : commands) {
+        names[name] = work;
+    }
+    Dictionary dictionary(names, {"safe", "hi-res", "debug"});
+    size_t dictionary_bytes = 0;
+    start = Clock::now();
+    for(const Sexp &s : plan) {
+        dictionary_bytes += serialize_compact(s, dictionary).size();
+    }
+    double dictionary_encode = to_ms(Clock::now() - start);
+
+    size_t packed_bytes = 0;
+    std::vector<std::string> frames = pack_plan(plan, 256);
+    for(const std::string &frame : frames) {
+        packed_bytes += frame.size();
+    }
+
+    std::cout << "compact: packed into " << frames.size()
+              << " frames of up to 256 bytes, " << packed_bytes << " bytes ("
+              << 100.0 * packed_bytes / cereal_bytes << "%)" << std::endl;
+    std::cout << "compact: with dictionary " << dictionary_bytes << " bytes ("
+              << 100.0 * dictionary_bytes / cereal_bytes << "%), encode "
+              << plan.size() / dictionary_encode / 1000 << " Mcommands/s"
+              << std::endl;
+    std::cout << "compact: encode " << plan.size() / cereal_encode / 1000
+              << " vs " << plan.size() / compact_encode / 1000
+              << " Mcommands/s, decode " << plan.size() / cereal_decode / 1000
+              << " vs " << plan.size() / compact_decode / 1000
+              << " Mcommands/s (cereal vs compact)" << std::endl;
+    std::cout << "compact: checking frames into views "
+              << plan.size() / view_decode / 1000 << " Mcommands/s ("
+              << nodes << " nodes)" << std::endl;
+}
+
+// Compare serialize, which returns a new string, with serialize_into a
+// reused frame buffer
+void bench_serialize_into() {
+    std::vector<Sexp> plan = typical_plan(100000);
+    std::vector<std::byte> frame(1024);
+    size_t bytes = 0;
+
+    // The original path: a cereal archive into a stream, copied out
+    Clock::time_point start = Clock::now();
+    for(const Sexp &s : plan) {
+        std::stringstream stream;
+        {
+            cereal::BinaryOutputArchive archive(stream);
+            archive(s);
+        }
+        bytes += stream.str().size();
+    }
+    double cereal_ms = to_ms(Clock::now() - start);
+    start = Clock::now();
+    for(const Sexp &s : plan) {
+        size_t size = serialized_size(s);
+        if(size > frame.size()) {
+            frame.resize(size);
+        }
+        bytes -= serialize_into(s, std::span<std::byte>(frame.data(), size));
+    }
+    double into_ms = to_ms(Clock::now() - start);
+    std::cout << "serialize: " << plan.size() / cereal_ms / 1000
+              << " Mcommands/s through a cereal stream, "
+              << plan.size() / into_ms / 1000
+              << " Mcommands/s into a reused buffer"
+              << (bytes ? " (mismatch!)" : "") << std::endl;
+}
+
+// The cost of journaling every command, and of finding records again
+void bench_journal() {
+    std::string dir = (std::filesystem::temp_directory_path()
+                       / ("bench-journal-" + std::to_string(getpid())))
+        .string();
+    std::filesystem::remove_all(dir);
+    std::vector<Sexp> plan = typical_plan(200000);
+    CommandSet commands;
+    const char *names[] = {"set-mode", "adcs-point", "radio-tx", "concat",
+                           "camera-capture", "add", "log-level",
+                           "heater-set"};
+    for(const char *name : names) {
+        commands[name] = [](std::list<std::string>) {
+            return std::string("ok");
+        };
+    }
+    Interpreter plain = make_interpreter(commands);
+    Clock::time_point start = Clock::now();
+    for(const Sexp &s : plan) {
+        plain(s);
+    }
+    double plain_ms = to_ms(Clock::now() - start);
+
+    double journaled_ms;
+    double flush_ms;
+    {
+        Journal journal(dir);
+        Interpreter interp = journaled(make_interpreter(commands), journal);
+        start = Clock::now();
+        for(const Sexp &s : plan) {
+            interp(s);
+        }
+        journaled_ms = to_ms(Clock::now() - start);
+        start = Clock::now();
+        journal.flush();
+        flush_ms = to_ms(Clock::now() - start);
+    }
+
+    start = Clock::now();
+    JournalReader reader(dir);
+    double open_ms = to_ms(Clock::now() - start);
+    JournalEntry entry;
+    start = Clock::now();
+    for(uint64_t seq = 0; seq < reader.size(); seq += 97) {
+        reader.seek(seq);
+        reader.next(entry);
+    }
+    double seek_ms = to_ms(Clock::now() - start);
+    std::filesystem::remove_all(dir);
+
+    std::cout << "journal: " << plan.size() << " commands, "
+              << plain_ms * 1000000 / plan.size() << "ns each, "
+              << journaled_ms * 1000000 / plan.size()
+              << "ns journaled, final flush " << flush_ms << "ms"
+              << std::endl;
+    std::cout << "journal: indexed " << reader.size() << " records in "
+              << open_ms << "ms, seek and read "
+              << seek_ms * 1000000 / (reader.size() / 97 + 1) << "ns"
+              << std::endl;
+}
+
+// Compare frame sizes with and without packing arguments by their schemas
+void bench_packed() {
+    std::vector<Sexp> plan = typical_plan(100000);
+    CommandSet commands;
+    commands["set-mode"] = Command(work).with_schema(Schema{{
+        ArgSchema::one_of("mode", {"safe", "normal", "science"})}});
+    commands["adcs-point"] = Command(work).with_schema(Schema{{
+        ArgSchema::number("roll", -180, 180),
+        ArgSchema::number("pitch", -90, 90),
+        ArgSchema::number("yaw", -180, 180)}});
+    commands["log-level"] = Command(work).with_schema(Schema{{
+        ArgSchema::one_of("level", {"debug", "info", "warn", "error"})}});
+    commands["heater-set"] = Command(work).with_schema(Schema{{
+        ArgSchema::integer("zone", 0, 1023),
+        ArgSchema::integer("watts")}});
+    ArgPacker packer(commands);
+
+    size_t cereal_bytes = 0;
+    size_t compact_bytes = 0;
+    size_t packed_bytes = 0;
+    size_t packed = 0;
+    std::vector<std::string> frames;
+    Clock::time_point start = Clock::now();
+    for(const Sexp &s : plan) {
+        frames.push_back(packer.pack(s));
+    }
+    double pack_ms = to_ms(Clock::now() - start);
+    for(size_t i = 0; i < plan.size(); ++i) {
+        cereal_bytes += serialize(plan[i]).size();
+        compact_bytes += serialize_compact(plan[i]).size();
+        packed_bytes += frames[i].size();
+        packed += packer.packs(plan[i]);
+    }
+    start = Clock::now();
+    for(const std::string &frame : frames) {
+        packer.unpack(frame);
+    }
+    double unpack_ms = to_ms(Clock::now() - start);
+
+    std::cout << "packed: " << packed << " of " << plan.size()
+              << " commands packed, " << (double)packed_bytes / plan.size()
+              << " bytes/command vs " << (double)compact_bytes / plan.size()
+              << " compact and " << (double)cereal_bytes / plan.size()
+              << " cereal" << std::endl;
+    std::cout << "packed: pack " << plan.size() / pack_ms / 1000
+              << " Mcommands/s, unpack " << plan.size() / unpack_ms / 1000
+              << " Mcommands/s" << std::endl;
+}
+
+// Compare deserialize with deserialize_bounded on valid frames, and time
+// how fast corrupted ones are rejected
+void bench_bounded() {
+    std::vector<Sexp> plan = typical_plan(200000);
+    std::vector<std::string> frames;
+    for(const Sexp &s : plan) {
+        frames.push_back(serialize(s));
+    }
+    Clock::time_point start = Clock::now();
+    for(const std::string &frame : frames) {
+        deserialize(frame);
+    }
+    double plain_ms = to_ms(Clock::now() - start);
+    start = Clock::now();
+    for(const std::string &frame : frames) {
+        deserialize_bounded(frame);
+    }
+    double bounded_ms = to_ms(Clock::now() - start);
+
+    // Give every command's list an element count of about 2^40
+    for(std::string &frame : frames) {
+        frame[9 + 5] = 1;
+    }
+    size_t rejected = 0;
+    start = Clock::now();
+    for(const std::string &frame : frames) {
+        try {
+            deserialize_bounded(frame);
+        } catch(const cereal::Exception &e) {
+            rejected++;
+        }
+    }
+    double reject_ms = to_ms(Clock::now() - start);
+    std::cout << "bounded: decode " << plan.size() / plain_ms / 1000
+              << " vs " << plan.size() / bounded_ms / 1000
+              << " Mcommands/s (deserialize vs bounded), rejected "
+              << rejected << " corrupted frames at "
+              << rejected / reject_ms / 1000 << " Mframes/s" << std::endl;
+}
+
+// Train a compression dictionary on the first tenth of a corpus of
+// commands and measure it on the rest
+void bench_corpus(const char *name, const std::vector<Sexp> &commands) {
+    std::vector<std::string> training;
+    std::vector<std::string> frames;
+    for(size_t i = 0; i < commands.size(); ++i) {
+        (i < commands.size() / 10 ? training : frames)
+            .push_back(serialize_compact(commands[i]));
+    }
+    Clock::time_point start = Clock::now();
+    LzDictionary dictionary = LzDictionary::train(training);
+    double train_ms = to_ms(Clock::now() - start);
+
+    size_t plain_bytes = 0;
+    size_t cereal_bytes = 0;
+    std::vector<std::string> compressed;
+    size_t compressed_bytes = 0;
+    for(size_t i = 0; i < frames.size(); ++i) {
+        plain_bytes += frames[i].size();
+        cereal_bytes += serialize(commands[commands.size() / 10 + i]).size();
+        compressed.push_back(compress(frames[i], dictionary));
+        compressed_bytes += compressed.back().size();
+    }
+
+    start = Clock::now();
+    for(const std::string &frame : compressed) {
+        decompress(frame, dictionary);
+    }
+    double decompress_ms = to_ms(Clock::now() - start);
+    start = Clock::now();
+    for(const std::string &frame : frames) {
+        deserialize_compact(frame);
+    }
+    double decode_ms = to_ms(Clock::now() - start);
+
+    std::cout << "compress: " << name << " corpus, " << frames.size()
+              << " frames, " << dictionary.bytes().size()
+              << " byte dictionary trained in " << train_ms << "ms"
+              << std::endl;
+    std::cout << "compress: " << name << " " << compressed_bytes
+              << " bytes compressed, " << plain_bytes << " compact ("
+              << (double)plain_bytes / compressed_bytes << "x), "
+              << cereal_bytes << " cereal ("
+              << (double)cereal_bytes / compressed_bytes << "x)" << std::endl;
+    std::cout << "compress: " << name << " decompress "
+              << plain_bytes / decompress_ms / 1000 << " MB/s, decode "
+              << plain_bytes / decode_ms / 1000 << " MB/s" << std::endl;
+}
+
+// Compression on the synthetic plan and, if given, a file of recorded
+// commands, one per line
+void bench_compress(const char *recorded) {
+    bench_corpus("synthetic", typical_plan(20000));
+    if(!recorded) {
+        std::cout << "compress: no recorded corpus given" << std::endl;
+        return;
+    }
+    std::ifstream in(recorded);
+    std::vector<Sexp> commands;
+    std::string line;
+    while(std::getline(in, line)) {
+        Optional<Sexp> command = parse(line);
+        if(!command.isEmpty()) {
+            commands.push_back(command.get());
+        }
+    }
+    bench_corpus("recorded", commands);
+}
+
+// Stream a large plan out to JSON and back in
+void bench_json() {
+    std::vector<Sexp> plan = typical_plan(500000);
+    std::stringstream json;
+    Clock::time_point start = Clock::now();
+    {
+        JsonPlanWriter writer(json);
+        for(const Sexp &s : plan) {
+            writer.add(s);
+        }
+    }
+    double write_ms = to_ms(Clock::now() - start);
+    size_t bytes = json.str().size();
+
+    start = Clock::now();
+    size_t nodes = 0;
+    size_t commands = read_json_plan(json, [&nodes](Sexp &&s) {
+        nodes += s.elements.size();
+    });
+    double read_ms = to_ms(Clock::now() - start);
+    std::cout << "json: " << commands << " commands, " << bytes / 1000000.0
+              << " MB, write " << bytes / write_ms / 1000 << " MB/s, read "
+              << bytes / read_ms / 1000 << " MB/s" << std::endl;
+}
+
+int main(int argc, char *argv[]) {
+    const char *only = argc > 1 ? argv[1] : nullptr;
+    if(!only || strcmp(only, "scheduler") == 0) {
+        bench_scheduler();
+    }
+    if(!only || strcmp(only, "dispatch") == 0) {
+        bench_dispatch();
+    }
+    if(!only || strcmp(only, "schema") == 0) {
+        bench_schema();
+    }
+    if(!only || strcmp(only, "compact") == 0) {
+        bench_compact();
+    }
+    if(!only || strcmp(only, "serialize") == 0) {
+        bench_serialize_into();
+    }
+    if(!only || strcmp(only, "compress") == 0) {
+        bench_compress(argc > 2 ? argv[2] : nullptr);
+    }
+    if(!only || strcmp(only, "journal") == 0) {
+        bench_journal();
+    }
+    if(!only || strcmp(only, "packed") == 0) {
+        bench_packed();
+    }
+    if(!only || strcmp(only, "bounded") == 0) {
+        bench_bounded();
+    }
+    if(!only || strcmp(only, "json") == 0) {
+        bench_json();
+    }
+    return 0;
+}
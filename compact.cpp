@@ -0,0 +1,192 @@
+#include "compact.hpp"
+
+#include <iterator>
+#include <utility>
+#include <vector>
+
+void put_compact_tag(std::string &out, unsigned char kind, uint64_t length) {
+    if(length < compact::LENGTH_MASK) {
+        out.push_back((char)(kind | length));
+        return;
+    }
+    out.push_back((char)(kind | compact::LENGTH_MASK));
+    length -= compact::LENGTH_MASK;
+    while(length >= 0x80) {
+        out.push_back((char)(0x80 | (length & 0x7F)));
+        length >>= 7;
+    }
+    out.push_back((char)length);
+}
+
+// The special forms, which every dictionary starts with
+static const char *FORMS[] = {"let", "set!", "defmacro", "alias", "at"};
+
+Dictionary::Dictionary(const CommandSet &commands,
+                       std::vector<std::string> symbols) {
+    std::vector<std::string> all(std::begin(FORMS), std::end(FORMS));
+    for(const auto &command : commands) {
+        all.push_back(command.first);
+    }
+    all.insert(all.end(), symbols.begin(), symbols.end());
+
+    // FNV-1a over the entries in order
+    uint32_t hash = 2166136261u;
+    for(const std::string &symbol : all) {
+        if(codes.count(symbol)) {
+            continue;
+        }
+        codes[symbol] = entries.size();
+        entries.push_back(symbol);
+        for(char c : symbol) {
+            hash = (hash ^ (unsigned char)c) * 16777619u;
+        }
+        // Separate the entries
+        hash = (hash ^ 0xFF) * 16777619u;
+    }
+    ver = hash;
+}
+
+long Dictionary::code(const std::string &symbol) const {
+    std::unordered_map<std::string, long>::const_iterator it
+        = codes.find(symbol);
+    return it == codes.end() ? -1 : it->second;
+}
+
+const std::string &Dictionary::symbol(uint64_t code) const {
+    if(code >= entries.size()) {
+        throw FrameError("unknown symbol code " + std::to_string(code));
+    }
+    return entries[code];
+}
+
+static void put_node(std::string &out, const Sexp &s,
+                     const Dictionary *dictionary) {
+    if(s.isAtom) {
+        long code = dictionary ? dictionary->code(s.atom) : -1;
+        if(code >= 0) {
+            put_compact_tag(out, compact::SYMBOL, code);
+        } else {
+            put_compact_tag(out, compact::ATOM, s.atom.size());
+            out.append(s.atom);
+        }
+    } else {
+        put_compact_tag(out, compact::LIST, s.elements.size());
+    }
+}
+
+static std::string serialize_with(const Sexp &s,
+                                  const Dictionary *dictionary) {
+    std::string out;
+    if(dictionary) {
+        put_compact_tag(out, compact::HEADER, dictionary->version());
+    }
+    typedef std::list<Sexp>::const_iterator Iter;
+    std::vector<std::pair<Iter, Iter>> open;
+    put_node(out, s, dictionary);
+    open.push_back(std::make_pair(s.elements.cbegin(), s.elements.cend()));
+    while(!open.empty()) {
+        std::pair<Iter, Iter> &top = open.back();
+        if(top.first == top.second) {
+            open.pop_back();
+            continue;
+        }
+        const Sexp &el = *top.first++;
+        put_node(out, el, dictionary);
+        if(!el.elements.empty()) {
+            open.push_back(std::make_pair(el.elements.cbegin(),
+                                          el.elements.cend()));
+        }
+    }
+    return out;
+}
+
+std::string serialize_compact(const Sexp &s) {
+    return serialize_with(s, nullptr);
+}
+
+std::string serialize_compact(const Sexp &s, const Dictionary &dictionary) {
+    return serialize_with(s, &dictionary);
+}
+
+// Read one node's own fields, returning its element count
+static uint64_t get_node(CompactReader &in, Sexp &s,
+                         const Dictionary *dictionary) {
+    uint64_t length;
+    unsigned char kind = in.tag(length);
+    if(kind == compact::ATOM) {
+        s.isAtom = true;
+        s.atom.assign(in.take(length), length);
+        return 0;
+    }
+    if(kind == compact::SYMBOL && dictionary) {
+        s.isAtom = true;
+        s.atom = dictionary->symbol(length);
+        return 0;
+    }
+    if(kind == compact::SYMBOL) {
+        throw FrameError("symbol code in a frame without a dictionary header");
+    }
+    if(kind != compact::LIST) {
+        throw FrameError("unknown node kind");
+    }
+    s.isAtom = false;
+    return length;
+}
+
+// Read one command, leaving the reader just after it
+static Sexp read_with(CompactReader &in, const Dictionary *dictionary) {
+    Sexp sexp;
+    // Lists being filled, innermost last, with their remaining element count
+    std::vector<std::pair<Sexp *, uint64_t>> open;
+    open.push_back(std::make_pair(&sexp, get_node(in, sexp, dictionary)));
+    while(!open.empty()) {
+        if(open.back().second == 0) {
+            open.pop_back();
+            continue;
+        }
+        open.back().second--;
+        Sexp *parent = open.back().first;
+        parent->elements.push_back(Sexp());
+        Sexp &el = parent->elements.back();
+        uint64_t count = get_node(in, el, dictionary);
+        if(count > 0) {
+            open.push_back(std::make_pair(&el, count));
+        }
+    }
+    return sexp;
+}
+
+static Sexp deserialize_with(const std::string &frame,
+                            const Dictionary *dictionary) {
+    CompactReader in(frame);
+    if(dictionary && in.peek() == compact::HEADER) {
+        uint64_t version;
+        in.tag(version);
+        if(version != dictionary->version()) {
+            throw FrameError("frame uses dictionary version "
+                             + std::to_string(version) + ", not "
+                             + std::to_string(dictionary->version()));
+        }
+    } else {
+        // Without a header, symbol codes have no dictionary to refer to
+        dictionary = nullptr;
+    }
+    Sexp sexp = read_with(in, dictionary);
+    if(!in.done()) {
+        throw FrameError("trailing bytes after command");
+    }
+    return sexp;
+}
+
+Sexp read_compact(CompactReader &in) {
+    return read_with(in, nullptr);
+}
+
+Sexp deserialize_compact(const std::string &frame) {
+    return deserialize_with(frame, nullptr);
+}
+
+Sexp deserialize_compact(const std::string &frame,
+                         const Dictionary &dictionary) {
+    return deserialize_with(frame, &dictionary);
+}
@@ -0,0 +1,159 @@
+#ifndef _COMPACT_H_
+#define _COMPACT_H_
+
+#include "interp.hpp"
+
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+// Thrown when a received frame cannot be decoded
+class FrameError : public std::runtime_error {
+public:
+    explicit FrameError(const std::string &what) : std::runtime_error(what) {}
+};
+
+// The compact wire format.
+//
+// Each node is one tag byte, in pre-order. The top two bits of the tag are
+// the node's kind and the low six bits its length: the atom's size in bytes
+// or the list's number of elements. Lengths of 63 or more store 63 in the
+// tag and the rest in a varint (7 bits per byte, least significant first,
+// high bit set on all but the last byte) after it. An atom's bytes follow
+// its tag and length.
+//
+// `(hi joe schmoe)` is 15 bytes, against 79 from `serialize`.
+//
+// Frames written with a Dictionary start with a HEADER tag whose length is
+// the dictionary version, and atoms in the dictionary are written as SYMBOL
+// tags whose length is the atom's code. SYMBOL tags are only read in frames
+// with a HEADER, so a frame can't be decoded against a dictionary it wasn't
+// written with.
+namespace compact {
+    enum Kind { ATOM = 0x00, LIST = 0x40, SYMBOL = 0x80, HEADER = 0xC0 };
+
+    const unsigned char KIND_MASK = 0xC0;
+    const unsigned char LENGTH_MASK = 0x3F;
+}
+
+// Codes for command names and other common symbols, shared by the ground
+// and flight sides so that frames can carry a 1-2 byte code instead of each
+// name. Codes below 63 take one byte and codes below 191 two.
+//
+// The dictionary is generated from a command set: the special forms come
+// first, then the command names in order, then `symbols` (e.g. common mode
+// names) in the order given. Its version is a hash of all the entries in
+// order, so both sides must generate it from the same commands and symbols;
+// a frame written with any other dictionary is rejected.
+class Dictionary {
+public:
+    explicit Dictionary(const CommandSet &commands,
+                        std::vector<std::string> symbols
+                        = std::vector<std::string>());
+
+    uint32_t version() const { return ver; }
+    size_t size() const { return entries.size(); }
+
+    // The code for `symbol`, or -1 if it has none
+    long code(const std::string &symbol) const;
+
+    // The symbol with the given code
+    // throws: FrameError if there is none
+    const std::string &symbol(uint64_t code) const;
+
+private:
+    std::vector<std::string> entries;
+    std::unordered_map<std::string, long> codes;
+    uint32_t ver;
+};
+
+// Append a tag of the given kind with its length to `out`
+void put_compact_tag(std::string &out, unsigned char kind, uint64_t length);
+
+// Reads tags and atoms from a compact frame, without copying them
+class CompactReader {
+public:
+    // Read `frame` from `pos` on
+    explicit CompactReader(std::string_view frame, size_t pos = 0)
+        : frame(frame), pos(pos) {}
+
+    bool done() const { return pos == frame.size(); }
+
+    // How far into the frame the reader is
+    size_t offset() const { return pos; }
+
+    // The kind of the next tag, without reading it
+    // throws: FrameError if there is none
+    unsigned char peek() const {
+        if(done()) {
+            throw FrameError("frame truncated at byte "
+                             + std::to_string(frame.size()));
+        }
+        return (unsigned char)frame[pos] & compact::KIND_MASK;
+    }
+
+    // Read a tag, returning its kind and setting `length`
+    // throws: FrameError
+    unsigned char tag(uint64_t &length) {
+        unsigned char tag = (unsigned char)*take(1);
+        length = tag & compact::LENGTH_MASK;
+        if(length == compact::LENGTH_MASK) {
+            uint64_t rest = 0;
+            for(int shift = 0; ; shift += 7) {
+                if(shift > 63) {
+                    throw FrameError("varint too long");
+                }
+                unsigned char byte = (unsigned char)*take(1);
+                rest |= (uint64_t)(byte & 0x7F) << shift;
+                if(!(byte & 0x80)) {
+                    break;
+                }
+            }
+            length += rest;
+        }
+        return tag & compact::KIND_MASK;
+    }
+
+    // throws: FrameError if the frame is too short
+    const char *take(uint64_t size) {
+        if(size > frame.size() - pos) {
+            throw FrameError("frame truncated at byte "
+                             + std::to_string(frame.size()));
+        }
+        const char *data = frame.data() + pos;
+        pos += size;
+        return data;
+    }
+
+private:
+    std::string_view frame;
+    size_t pos;
+};
+
+// Serialize the given command in the compact format
+std::string serialize_compact(const Sexp &s);
+
+// As above, writing atoms in `dictionary` as codes
+std::string serialize_compact(const Sexp &s, const Dictionary &dictionary);
+
+// Deserialize a command in the compact format
+// throws: FrameError if the frame is truncated, has trailing bytes, uses an
+// unknown node kind or was written with a dictionary
+Sexp deserialize_compact(const std::string &frame);
+
+// Deserialize a command written with `dictionary` (or with none)
+// throws: FrameError as above, or if the frame was written with a different
+// version of the dictionary
+Sexp deserialize_compact(const std::string &frame,
+                         const Dictionary &dictionary);
+
+// Read one command in the compact format, without a dictionary, leaving
+// `in` just after it
+// throws: FrameError if the command is truncated or uses an unknown node
+// kind
+Sexp read_compact(CompactReader &in);
+
+#endif /* _COMPACT_H_ */
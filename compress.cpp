@@ -0,0 +1,274 @@
+#include "compress.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <unordered_map>
+#include <unordered_set>
+
+// The shortest and longest matches a token can copy
+static const size_t MIN_MATCH = 3;
+static const size_t MAX_MATCH = 0x7F + MIN_MATCH;
+// The longest literal run a token can hold
+static const size_t MAX_LITERALS = 0x80;
+// How many earlier positions with the same hash the compressor tries
+static const int MAX_CHAIN = 64;
+static const size_t HASH_BITS = 14;
+
+// Training works on segments of this many bytes, scored by the k-mers
+// (substrings of K bytes) in them
+static const size_t SEGMENT = 32;
+static const size_t K = 6;
+
+static uint16_t fnv16(const std::string &bytes) {
+    uint32_t hash = 2166136261u;
+    for(char c : bytes) {
+        hash = (hash ^ (unsigned char)c) * 16777619u;
+    }
+    return (uint16_t)(hash ^ (hash >> 16));
+}
+
+static size_t hash3(const char *p) {
+    uint32_t x = (unsigned char)p[0] | (unsigned char)p[1] << 8
+        | (unsigned char)p[2] << 16;
+    return (x * 2654435761u) >> (32 - HASH_BITS);
+}
+
+LzDictionary::LzDictionary(std::string bytes)
+    : content(bytes), hash(fnv16(bytes)), head(1 << HASH_BITS, -1),
+      prev(content.size(), -1) {
+    for(size_t pos = 0; pos + MIN_MATCH <= content.size(); ++pos) {
+        size_t h = hash3(&content[pos]);
+        prev[pos] = head[h];
+        head[h] = (int32_t)pos;
+    }
+}
+
+LzDictionary LzDictionary::train(const std::vector<std::string> &corpus,
+                                 size_t size) {
+    // How many frames each k-mer occurs in
+    std::unordered_map<std::string_view, size_t> frequency;
+    for(const std::string &frame : corpus) {
+        std::unordered_set<std::string_view> seen;
+        for(size_t i = 0; i + K <= frame.size(); ++i) {
+            std::string_view kmer(frame.data() + i, K);
+            if(seen.insert(kmer).second) {
+                frequency[kmer]++;
+            }
+        }
+    }
+
+    // Repeatedly take the segment whose k-mers are most common and not yet
+    // covered. The best segments go last, where they are nearest to the
+    // data and so have the shortest distances.
+    std::vector<std::string> segments;
+    size_t total = 0;
+    while(total < size) {
+        size_t best_score = 0;
+        std::string_view best;
+        for(const std::string &frame : corpus) {
+            for(size_t start = 0; start < frame.size(); start += SEGMENT / 2) {
+                std::string_view segment(frame.data() + start,
+                                         std::min(SEGMENT,
+                                                  frame.size() - start));
+                size_t score = 0;
+                for(size_t i = 0; i + K <= segment.size(); ++i) {
+                    std::unordered_map<std::string_view, size_t>::iterator it
+                        = frequency.find(segment.substr(i, K));
+                    score += it == frequency.end() ? 0 : it->second;
+                }
+                if(score > best_score) {
+                    best_score = score;
+                    best = segment;
+                }
+            }
+        }
+        // Stop once no segment has k-mers that recur across frames
+        if(best_score <= 1) {
+            break;
+        }
+        for(size_t i = 0; i + K <= best.size(); ++i) {
+            frequency.erase(best.substr(i, K));
+        }
+        best = best.substr(0, std::min(best.size(), size - total));
+        segments.push_back(std::string(best));
+        total += best.size();
+    }
+
+    std::string bytes;
+    for(std::vector<std::string>::reverse_iterator it = segments.rbegin();
+        it != segments.rend(); ++it) {
+        bytes += *it;
+    }
+    return LzDictionary(bytes);
+}
+
+static void put_varint(std::string &out, uint64_t value) {
+    while(value >= 0x80) {
+        out.push_back((char)(0x80 | (value & 0x7F)));
+        value >>= 7;
+    }
+    out.push_back((char)value);
+}
+
+std::string compress(std::string_view frame, const LzDictionary &dictionary) {
+    std::string out;
+    out.push_back((char)(dictionary.id() & 0xFF));
+    out.push_back((char)(dictionary.id() >> 8));
+
+    // Matches are searched for in the dictionary followed by the frame,
+    // with positions counted from the start of the dictionary
+    const std::string &dict = dictionary.bytes();
+    const size_t start = dict.size();
+    const size_t end = start + frame.size();
+    auto at = [&](size_t pos) {
+        return pos < start ? dict[pos] : frame[pos - start];
+    };
+
+    // The frame's own hash chains, which continue into the dictionary's.
+    // The last frame position with each hash is kept in a small open
+    // addressed table sized for the frame rather than one for every hash.
+    struct Latest {
+        int32_t hash;
+        int32_t pos;
+    };
+    size_t mask = 15;
+    while(mask < frame.size() * 2) {
+        mask = mask * 2 + 1;
+    }
+    std::vector<Latest> latest(mask + 1, Latest{-1, -1});
+    std::vector<int32_t> frame_prev(frame.size(), -1);
+    auto slot = [&](size_t h) -> Latest & {
+        size_t i = h & mask;
+        while(latest[i].hash != -1 && latest[i].hash != (int32_t)h) {
+            i = (i + 1) & mask;
+        }
+        return latest[i];
+    };
+    auto hash_at = [&](size_t pos) {
+        char bytes[MIN_MATCH];
+        for(size_t i = 0; i < MIN_MATCH; ++i) {
+            bytes[i] = at(pos + i);
+        }
+        return hash3(bytes);
+    };
+    auto chain_head = [&](size_t h) {
+        Latest &l = slot(h);
+        return l.hash == -1 ? dictionary.head[h] : l.pos;
+    };
+    auto chain_next = [&](int32_t pos) {
+        return (size_t)pos < start ? dictionary.prev[pos]
+            : frame_prev[pos - start];
+    };
+    auto insert = [&](size_t pos) {
+        if(pos + MIN_MATCH <= end) {
+            size_t h = hash_at(pos);
+            frame_prev[pos - start] = chain_head(h);
+            Latest &l = slot(h);
+            l.hash = (int32_t)h;
+            l.pos = (int32_t)pos;
+        }
+    };
+
+    size_t literals = start;
+    auto flush_literals = [&](size_t to) {
+        while(literals < to) {
+            size_t n = std::min(MAX_LITERALS, to - literals);
+            out.push_back((char)(n - 1));
+            out.append(frame.substr(literals - start, n));
+            literals += n;
+        }
+    };
+    size_t pos = start;
+    while(pos < end) {
+        size_t best_length = 0;
+        size_t best_distance = 0;
+        if(pos + MIN_MATCH <= end) {
+            size_t longest = std::min(MAX_MATCH, end - pos);
+            int32_t candidate = chain_head(hash_at(pos));
+            for(int tries = 0; candidate >= 0 && tries < MAX_CHAIN; ++tries) {
+                size_t length = 0;
+                while(length < longest
+                      && at(candidate + length) == frame[pos - start + length]) {
+                    length++;
+                }
+                // Prefer the nearest of equally long matches
+                if(length > best_length) {
+                    best_length = length;
+                    best_distance = pos - candidate;
+                }
+                candidate = chain_next(candidate);
+            }
+        }
+        if(best_length < MIN_MATCH) {
+            insert(pos++);
+            continue;
+        }
+        flush_literals(pos);
+        out.push_back((char)(0x80 + best_length - MIN_MATCH));
+        put_varint(out, best_distance);
+        for(size_t i = 0; i < best_length; ++i) {
+            insert(pos++);
+        }
+        literals = pos;
+    }
+    flush_literals(end);
+    return out;
+}
+
+std::string decompress(std::string_view data, const LzDictionary &dictionary,
+                       size_t limit) {
+    if(data.size() < 2) {
+        throw FrameError("compressed frame too short");
+    }
+    uint16_t id = (unsigned char)data[0] | (unsigned char)data[1] << 8;
+    if(id != dictionary.id()) {
+        throw FrameError("frame compressed with dictionary "
+                         + std::to_string(id) + ", not "
+                         + std::to_string(dictionary.id()));
+    }
+    const std::string &dict = dictionary.bytes();
+    std::string out;
+    size_t pos = 2;
+    while(pos < data.size()) {
+        unsigned char token = data[pos++];
+        if(token < 0x80) {
+            size_t n = token + 1;
+            if(n > data.size() - pos || out.size() + n > limit) {
+                throw FrameError("literal run past end of frame or limit");
+            }
+            out.append(data.data() + pos, n);
+            pos += n;
+            continue;
+        }
+        size_t length = token - 0x80 + MIN_MATCH;
+        uint64_t distance = 0;
+        for(int shift = 0; ; shift += 7) {
+            if(pos == data.size() || shift > 63) {
+                throw FrameError("bad match distance");
+            }
+            unsigned char byte = data[pos++];
+            distance |= (uint64_t)(byte & 0x7F) << shift;
+            if(!(byte & 0x80)) {
+                break;
+            }
+        }
+        size_t end = dict.size() + out.size();
+        if(distance == 0 || distance > end || out.size() + length > limit) {
+            throw FrameError("match outside window or past limit");
+        }
+        size_t from = end - distance;
+        size_t old = out.size();
+        out.resize(old + length);
+        char *dst = &out[old];
+        if(from + length <= dict.size()) {
+            memcpy(dst, dict.data() + from, length);
+        } else {
+            // Copy byte by byte, since the match may overlap itself
+            for(size_t i = 0; i < length; ++i, ++from) {
+                dst[i] = from < dict.size() ? dict[from]
+                    : out[from - dict.size()];
+            }
+        }
+    }
+    return out;
+}
@@ -0,0 +1,60 @@
+#ifndef _COMPRESS_H_
+#define _COMPRESS_H_
+
+#include "compact.hpp"
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// A static dictionary for LZ compression of command frames, trained on a
+// corpus of past frames and shared by the ground and flight sides.
+//
+// Our commands use a small vocabulary with a lot of repeated structure, so
+// even a single short frame finds most of its bytes in the dictionary.
+class LzDictionary {
+public:
+    // Use dictionary bytes made earlier by `train`
+    explicit LzDictionary(std::string bytes);
+
+    // Build a dictionary of at most `size` bytes from the byte strings that
+    // occur in the most frames of `corpus`
+    static LzDictionary train(const std::vector<std::string> &corpus,
+                              size_t size = 4096);
+
+    const std::string &bytes() const { return content; }
+
+    // A hash of the dictionary, written in each compressed frame
+    uint16_t id() const { return hash; }
+
+private:
+    friend std::string compress(std::string_view frame,
+                                const LzDictionary &dictionary);
+
+    std::string content;
+    uint16_t hash;
+    // Hash chains over the dictionary, built once so that each frame only
+    // has to add its own positions: the last position with each hash, and
+    // for each position the one before it with the same hash (or -1)
+    std::vector<int32_t> head;
+    std::vector<int32_t> prev;
+};
+
+// Compress a frame (in any format) against `dictionary`.
+//
+// The output is the dictionary id (2 bytes, little-endian) followed by
+// tokens. A token byte below 0x80 is followed by that many plus one literal
+// bytes; a token byte of 0x80 or more copies that many minus 0x80 plus 3
+// bytes from a varint distance back in the dictionary and the output so far,
+// with the dictionary coming just before the output.
+std::string compress(std::string_view frame, const LzDictionary &dictionary);
+
+// Decompress a frame compressed with `dictionary`, giving up if the output
+// would be longer than `limit`
+// throws: FrameError if the frame is malformed, was compressed with a
+// different dictionary or is too long
+std::string decompress(std::string_view data, const LzDictionary &dictionary,
+                       size_t limit = 65536);
+
+#endif /* _COMPRESS_H_ */
@@ -0,0 +1,196 @@
+#include "delta.hpp"
+
+#include <iterator>
+#include <vector>
+
+void DeltaWindow::push(uint64_t seq, const Sexp &s) {
+    entries.push_back(std::make_pair(seq, s));
+    while(entries.size() > size) {
+        entries.pop_front();
+    }
+}
+
+const Sexp *DeltaWindow::find(uint64_t seq) const {
+    for(const std::pair<uint64_t, Sexp> &entry : entries) {
+        if(entry.first == seq) {
+            return &entry.second;
+        }
+    }
+    return nullptr;
+}
+
+void DeltaWindow::erase(uint64_t seq) {
+    for(std::deque<std::pair<uint64_t, Sexp>>::iterator it = entries.begin();
+        it != entries.end(); ++it) {
+        if(it->first == seq) {
+            entries.erase(it);
+            return;
+        }
+    }
+}
+
+// Append the edits turning `base` into `target`, returning how many there
+// are. Lists of the same length are compared element by element; anything
+// else that differs is replaced whole.
+static size_t put_edits(std::string &out, const Sexp &base,
+                        const Sexp &target) {
+    struct Pending {
+        const Sexp *base;
+        const Sexp *target;
+        std::vector<uint64_t> path;
+    };
+    size_t edits = 0;
+    std::vector<Pending> stack;
+    stack.push_back(Pending{&base, &target, {}});
+    while(!stack.empty()) {
+        Pending top = std::move(stack.back());
+        stack.pop_back();
+        const Sexp &from = *top.base;
+        const Sexp &to = *top.target;
+        if(from.isAtom && to.isAtom && from.atom == to.atom) {
+            continue;
+        }
+        if(!from.isAtom && !to.isAtom
+           && from.elements.size() == to.elements.size()) {
+            // Push the last elements first, so the edits come out in order
+            uint64_t i = from.elements.size();
+            std::list<Sexp>::const_reverse_iterator b = from.elements.rbegin();
+            std::list<Sexp>::const_reverse_iterator t = to.elements.rbegin();
+            for(; b != from.elements.rend(); ++b, ++t) {
+                Pending child{&*b, &*t, top.path};
+                child.path.push_back(--i);
+                stack.push_back(std::move(child));
+            }
+            continue;
+        }
+        put_compact_tag(out, compact::SYMBOL, top.path.size());
+        for(uint64_t step : top.path) {
+            put_compact_tag(out, compact::SYMBOL, step);
+        }
+        out += serialize_compact(to);
+        edits++;
+    }
+    return edits;
+}
+
+// Read a SYMBOL tag's length
+// throws: FrameError if the next tag isn't a SYMBOL
+static uint64_t get_number(CompactReader &in) {
+    uint64_t value;
+    if(in.tag(value) != compact::SYMBOL) {
+        throw FrameError("expected a number");
+    }
+    return value;
+}
+
+DeltaEncoder::DeltaEncoder(size_t window) : window(window), seq(0) {}
+
+std::string DeltaEncoder::encode(const Sexp &s) {
+    std::string frame;
+    put_compact_tag(frame, compact::HEADER, seq);
+    size_t header = frame.size();
+    put_compact_tag(frame, compact::SYMBOL, 0);
+    frame += serialize_compact(s);
+
+    for(const std::pair<uint64_t, Sexp> &entry : window.commands()) {
+        std::string edits;
+        size_t count = put_edits(edits, entry.second, s);
+        std::string delta = frame.substr(0, header);
+        put_compact_tag(delta, compact::SYMBOL, seq - entry.first);
+        put_compact_tag(delta, compact::SYMBOL, count);
+        delta += edits;
+        // Prefer the nearest base on ties, since it is least likely to be
+        // lost or leave the window
+        if(delta.size() <= frame.size()) {
+            frame.swap(delta);
+        }
+    }
+    window.push(seq++, s);
+    return frame;
+}
+
+void DeltaEncoder::lost(uint64_t seq) {
+    window.erase(seq);
+}
+
+void DeltaEncoder::lost(uint64_t first, uint64_t end) {
+    // Only what is in the window matters, however wide the range
+    std::vector<uint64_t> gone;
+    for(const std::pair<uint64_t, Sexp> &entry : window.commands()) {
+        if(entry.first >= first && entry.first < end) {
+            gone.push_back(entry.first);
+        }
+    }
+    for(uint64_t seq : gone) {
+        window.erase(seq);
+    }
+}
+
+DeltaDecoder::DeltaDecoder(size_t window, uint64_t max_gap)
+    : window(window), max_gap(max_gap), seq(0) {}
+
+void DeltaDecoder::lose(uint64_t first, uint64_t end) {
+    if(!missing.empty() && missing.back().second == first) {
+        missing.back().second = end;
+    } else {
+        missing.push_back(std::make_pair(first, end));
+    }
+}
+
+Sexp DeltaDecoder::decode(std::string_view frame) {
+    CompactReader in(frame);
+    uint64_t frame_seq;
+    if(in.tag(frame_seq) != compact::HEADER) {
+        throw FrameError("delta frame has no sequence number");
+    }
+    if(frame_seq < seq) {
+        throw FrameError("frame " + std::to_string(frame_seq)
+                         + " repeated or out of order, expected "
+                         + std::to_string(seq));
+    }
+    if(frame_seq - seq > max_gap) {
+        throw FrameError("frame " + std::to_string(frame_seq)
+                         + " is too far past " + std::to_string(seq));
+    }
+    if(seq < frame_seq) {
+        lose(seq, frame_seq);
+    }
+    seq = frame_seq + 1;
+
+    try {
+        uint64_t back = get_number(in);
+        Sexp s;
+        if(back == 0) {
+            s = read_compact(in);
+        } else {
+            const Sexp *base = back <= frame_seq
+                ? window.find(frame_seq - back) : nullptr;
+            if(!base) {
+                throw FrameError("base of frame " + std::to_string(frame_seq)
+                                 + " was lost or has left the window");
+            }
+            s = *base;
+            uint64_t edits = get_number(in);
+            for(uint64_t i = 0; i < edits; ++i) {
+                uint64_t depth = get_number(in);
+                Sexp *node = &s;
+                for(uint64_t d = 0; d < depth; ++d) {
+                    uint64_t step = get_number(in);
+                    if(node->isAtom || step >= node->elements.size()) {
+                        throw FrameError("edit path leaves the command");
+                    }
+                    node = &*std::next(node->elements.begin(), step);
+                }
+                *node = read_compact(in);
+            }
+        }
+        if(!in.done()) {
+            throw FrameError("trailing bytes after command");
+        }
+        window.push(frame_seq, s);
+        return s;
+    } catch(const FrameError &e) {
+        lose(frame_seq, frame_seq + 1);
+        throw;
+    }
+}
@@ -0,0 +1,112 @@
+#ifndef _DELTA_H_
+#define _DELTA_H_
+
+#include "compact.hpp"
+#include "interp.hpp"
+
+#include <cstdint>
+#include <deque>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+// Delta frames, sending a command as edits to one sent shortly before it.
+//
+// Both sides number the commands they send and receive, and keep the last
+// few in a window. A frame starts with a HEADER tag whose length is the
+// command's sequence number, then a SYMBOL tag whose length is how many
+// commands back its base is. A base of 0 means the whole command follows in
+// the compact format (see compact.hpp). Otherwise a SYMBOL tag gives the
+// number of edits, each of which is a SYMBOL tag with the depth of the path
+// to the subtree it replaces, a SYMBOL tag per step with the element's
+// position, and then the new subtree in the compact format.
+//
+// `(adcs-point 10 20 30)` sent after `(adcs-point 10 20 25)` is 8 bytes,
+// against 23 for the whole command.
+
+// The commands most recently sent or received, by sequence number
+class DeltaWindow {
+public:
+    explicit DeltaWindow(size_t size) : size(size) {}
+
+    void push(uint64_t seq, const Sexp &s);
+
+    // The command with sequence number `seq`, or nullptr if it isn't in
+    // the window
+    const Sexp *find(uint64_t seq) const;
+
+    // Drop the command with sequence number `seq`, if it is in the window
+    void erase(uint64_t seq);
+
+    const std::deque<std::pair<uint64_t, Sexp>> &commands() const {
+        return entries;
+    }
+
+private:
+    size_t size;
+    std::deque<std::pair<uint64_t, Sexp>> entries;
+};
+
+// Writes delta frames on the ground side
+class DeltaEncoder {
+public:
+    // Encode against the last `window` commands
+    explicit DeltaEncoder(size_t window = 16);
+
+    // The frame for the next command, against whichever command in the
+    // window gives the smallest frame
+    std::string encode(const Sexp &s);
+
+    // The sequence number the next command will get
+    uint64_t next_seq() const { return seq; }
+
+    // The frame with sequence number `seq` was lost, so later frames must
+    // not be encoded against it
+    void lost(uint64_t seq);
+
+    // As above, for the frames from `first` up to but not including `end`
+    void lost(uint64_t first, uint64_t end);
+
+private:
+    DeltaWindow window;
+    uint64_t seq;
+};
+
+// Rebuilds commands from delta frames on the flight side
+class DeltaDecoder {
+public:
+    // Keep the last `window` commands, which must be at least as many as
+    // the encoder keeps. A frame more than `max_gap` past the one expected
+    // is taken to be corrupt rather than a sign of that many lost frames.
+    explicit DeltaDecoder(size_t window = 16, uint64_t max_gap = 4096);
+
+    // The command in `frame`. Skipped sequence numbers are counted as lost,
+    // as is the frame itself if it can't be decoded.
+    // throws: FrameError if the frame is malformed, repeats or comes before
+    // an earlier frame, skips more than `max_gap` frames (which changes
+    // nothing), or its base was lost or has left the window
+    Sexp decode(std::string_view frame);
+
+    // The sequence number expected next
+    uint64_t next_seq() const { return seq; }
+
+    // The frames lost since the last `clear_lost`, to be reported to the
+    // encoder, as ranges of sequence numbers from the first up to but not
+    // including the second
+    const std::vector<std::pair<uint64_t, uint64_t>> &lost() const {
+        return missing;
+    }
+    void clear_lost() { missing.clear(); }
+
+private:
+    // Count the frames from `first` up to `end` as lost
+    void lose(uint64_t first, uint64_t end);
+
+    DeltaWindow window;
+    uint64_t max_gap;
+    uint64_t seq;
+    std::vector<std::pair<uint64_t, uint64_t>> missing;
+};
+
+#endif /* _DELTA_H_ */
@@ -0,0 +1,111 @@
+#include "fold.hpp"
+
+// Is `s` a list headed by the atom `name`?
+static bool is_form(const Sexp &s, const char *name) {
+    return !s.isAtom && !s.elements.empty() && s.elements.front().isAtom
+        && s.elements.front().atom == name;
+}
+
+// Evaluate the constant call `s` with a pure command, if possible
+static Optional<std::string> evaluate(const Sexp &s, const CommandSet &pure) {
+    CommandSet::const_iterator it = pure.find(s.elements.front().atom);
+    if(it == pure.end()) {
+        return None<std::string>();
+    }
+    std::list<std::string> args;
+    std::list<Sexp>::const_iterator el = s.elements.begin();
+    for(++el; el != s.elements.end(); ++el) {
+        args.push_back(el->atom);
+    }
+    try {
+        std::string result = it->second.call(args, CancelToken());
+        if(result.compare(0, 6, "Error:") == 0) {
+            return None<std::string>();
+        }
+        return Just(result);
+    } catch(const std::exception &e) {
+        return None<std::string>();
+    }
+}
+
+Sexp fold_constants(const Sexp &s, const CommandSet &pure, size_t *folded) {
+    Sexp result = s;
+    if(result.isAtom) {
+        return result;
+    }
+    // Lists being folded, innermost last: the list, whether it may itself be
+    // folded, and its next element to visit
+    struct Level {
+        Sexp *list;
+        bool foldable;
+        std::list<Sexp>::iterator next;
+    };
+    std::vector<Level> open;
+    Level root;
+    root.list = &result;
+    root.foldable = false;
+    root.next = result.elements.begin();
+    open.push_back(root);
+
+    while(!open.empty()) {
+        Level &top = open.back();
+        if(top.next != top.list->elements.end()) {
+            Sexp &el = *top.next++;
+            if(el.isAtom || is_form(el, "let") || is_form(el, "set!")
+               || is_form(el, "defmacro") || is_form(el, "alias")) {
+                continue;
+            }
+            Level level;
+            level.list = &el;
+            // The body of an `at` form must stay a command
+            level.foldable = !(is_form(*top.list, "at")
+                               && &el == &top.list->elements.back());
+            level.next = el.elements.begin();
+            open.push_back(level);
+            continue;
+        }
+
+        // All elements are folded as far as they go; fold this list if its
+        // arguments are now all constants
+        Sexp &list = *top.list;
+        bool constant = top.foldable && !list.elements.empty();
+        for(const Sexp &el : list.elements) {
+            constant = constant && el.isAtom;
+        }
+        open.pop_back();
+        if(!constant) {
+            continue;
+        }
+        Optional<std::string> value = evaluate(list, pure);
+        if(!value.isEmpty()) {
+            list.isAtom = true;
+            list.atom = value.get();
+            list.elements.clear();
+            if(folded) {
+                (*folded)++;
+            }
+        }
+    }
+    return result;
+}
+
+FoldReport fold_plan(std::vector<Sexp> &plan, const CommandSet &pure) {
+    FoldReport report;
+    report.commands = plan.size();
+    report.folded = 0;
+    report.bytes_before = 0;
+    report.bytes_after = 0;
+    for(Sexp &command : plan) {
+        report.bytes_before += serialize(command).size();
+        command = fold_constants(command, pure, &report.folded);
+        report.bytes_after += serialize(command).size();
+    }
+    return report;
+}
+
+std::ostream& operator<<(std::ostream& os, const FoldReport &report) {
+    return os << "folded " << report.folded << " subtrees in "
+              << report.commands << " commands: " << report.bytes_before
+              << " -> " << report.bytes_after << " bytes (saved "
+              << report.bytes_saved() << ")";
+}
@@ -0,0 +1,46 @@
+#ifndef _FOLD_H_
+#define _FOLD_H_
+
+#include "interp.hpp"
+
+#include <cstdint>
+#include <iostream>
+#include <vector>
+
+// What folding a plan achieved
+struct FoldReport {
+    // Commands in the plan
+    size_t commands;
+    // Subtrees replaced by their value
+    size_t folded;
+    // Serialized size of the plan before and after folding
+    size_t bytes_before;
+    size_t bytes_after;
+
+    // Negative if folding made the plan larger
+    int64_t bytes_saved() const {
+        return (int64_t)bytes_before - (int64_t)bytes_after;
+    }
+};
+
+// Fold constants in `s` on the ground, before it is serialized.
+//
+// Every list whose command is in `pure` and whose arguments are all atoms
+// (after folding) is replaced by the atom it evaluates to, working
+// bottom-up so that nested constant expressions fold completely.
+// The command itself is never folded away, so `s` stays a command. Neither
+// is the body of an `(at <time> <sexp>)` form.
+// Results that are errors are left for the flight side to report, and
+// `let`, `set!`, `defmacro` and `alias` forms are left untouched, since
+// their atoms may name variables.
+// If `folded` is given, the number of subtrees folded is added to it.
+Sexp fold_constants(const Sexp &s, const CommandSet &pure,
+                    size_t *folded = nullptr);
+
+// Fold every command in `plan` in place, reporting the bytes saved
+FoldReport fold_plan(std::vector<Sexp> &plan, const CommandSet &pure);
+
+// Print a one-line summary of a FoldReport
+std::ostream& operator<<(std::ostream& os, const FoldReport &report);
+
+#endif /* _FOLD_H_ */
@@ -0,0 +1,179 @@
+#include "frame.hpp"
+
+#include <stdexcept>
+#include <utility>
+
+// The size of a tag with the given length
+static size_t tag_size(uint64_t length) {
+    if(length < compact::LENGTH_MASK) {
+        return 1;
+    }
+    size_t size = 2;
+    for(length -= compact::LENGTH_MASK; length >= 0x80; length >>= 7) {
+        size++;
+    }
+    return size;
+}
+
+FrameBuilder::FrameBuilder(size_t mtu) : mtu(mtu), count(0) {}
+
+size_t FrameBuilder::size() const {
+    return tag_size(table.size()) + table_bytes.size() + body.size();
+}
+
+bool FrameBuilder::add(const Sexp &s) {
+    size_t strings_before = table.size();
+    size_t table_before = table_bytes.size();
+    size_t body_before = body.size();
+
+    typedef std::list<Sexp>::const_iterator Iter;
+    std::vector<std::pair<Iter, Iter>> open;
+    const Sexp *node = &s;
+    while(true) {
+        if(node->isAtom) {
+            std::unordered_map<std::string, size_t>::iterator it
+                = index.find(node->atom);
+            if(it == index.end()) {
+                it = index.insert(std::make_pair(node->atom,
+                                                 table.size())).first;
+                table.push_back(node->atom);
+                put_compact_tag(table_bytes, compact::ATOM,
+                                node->atom.size());
+                table_bytes.append(node->atom);
+            }
+            put_compact_tag(body, compact::SYMBOL, it->second);
+        } else {
+            put_compact_tag(body, compact::LIST, node->elements.size());
+            open.push_back(std::make_pair(node->elements.cbegin(),
+                                          node->elements.cend()));
+        }
+        while(!open.empty() && open.back().first == open.back().second) {
+            open.pop_back();
+        }
+        if(open.empty()) {
+            break;
+        }
+        node = &*open.back().first++;
+    }
+
+    if(size() > mtu) {
+        for(size_t i = strings_before; i < table.size(); ++i) {
+            index.erase(table[i]);
+        }
+        table.resize(strings_before);
+        table_bytes.resize(table_before);
+        body.resize(body_before);
+        return false;
+    }
+    count++;
+    return true;
+}
+
+std::string FrameBuilder::finish() {
+    std::string frame;
+    put_compact_tag(frame, compact::HEADER, table.size());
+    frame += table_bytes;
+    frame += body;
+    table.clear();
+    index.clear();
+    table_bytes.clear();
+    body.clear();
+    count = 0;
+    return frame;
+}
+
+std::vector<std::string> pack_plan(const std::vector<Sexp> &plan,
+                                   size_t mtu) {
+    std::vector<std::string> frames;
+    FrameBuilder builder(mtu);
+    for(const Sexp &s : plan) {
+        if(builder.add(s)) {
+            continue;
+        }
+        if(builder.commands() == 0) {
+            throw std::length_error("command does not fit in a "
+                                    + std::to_string(mtu) + " byte frame");
+        }
+        frames.push_back(builder.finish());
+        if(!builder.add(s)) {
+            throw std::length_error("command does not fit in a "
+                                    + std::to_string(mtu) + " byte frame");
+        }
+    }
+    if(builder.commands() > 0) {
+        frames.push_back(builder.finish());
+    }
+    return frames;
+}
+
+FrameReader::FrameReader(std::string_view frame) : frame(frame) {
+    CompactReader in(frame);
+    uint64_t strings;
+    if(in.tag(strings) != compact::HEADER) {
+        throw FrameError("frame has no string table");
+    }
+    if(strings > frame.size()) {
+        throw FrameError("string table longer than frame");
+    }
+    table.reserve(strings);
+    for(uint64_t i = 0; i < strings; ++i) {
+        uint64_t length;
+        if(in.tag(length) != compact::ATOM) {
+            throw FrameError("string table entry is not an atom");
+        }
+        table.push_back(std::string_view(in.take(length), length));
+    }
+    pos = in.offset();
+}
+
+bool FrameReader::next(Sexp &s) {
+    if(pos == frame.size()) {
+        return false;
+    }
+    CompactReader in(frame, pos);
+    // Read one node's own fields, returning its element count
+    auto get_node = [&](Sexp &node) -> uint64_t {
+        uint64_t length;
+        unsigned char kind = in.tag(length);
+        node.elements.clear();
+        if(kind == compact::SYMBOL) {
+            if(length >= table.size()) {
+                throw FrameError("unknown string " + std::to_string(length));
+            }
+            node.isAtom = true;
+            node.atom.assign(table[length]);
+            return 0;
+        }
+        if(kind == compact::ATOM) {
+            node.isAtom = true;
+            node.atom.assign(in.take(length), length);
+            return 0;
+        }
+        if(kind != compact::LIST) {
+            throw FrameError("unknown node kind");
+        }
+        node.isAtom = false;
+        node.atom.clear();
+        return length;
+    };
+
+    // Lists being filled, innermost last, with their remaining element count
+    std::vector<std::pair<Sexp *, uint64_t>> open;
+    open.push_back(std::make_pair(&s, get_node(s)));
+    while(!open.empty()) {
+        if(open.back().second == 0) {
+            open.pop_back();
+            continue;
+        }
+        open.back().second--;
+        Sexp *parent = open.back().first;
+        parent->elements.push_back(Sexp());
+        Sexp &el = parent->elements.back();
+        uint64_t count = get_node(el);
+        if(count > 0) {
+            open.push_back(std::make_pair(&el, count));
+        }
+    }
+    pos = in.offset();
+    return true;
+}
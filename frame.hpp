@@ -0,0 +1,75 @@
+#ifndef _FRAME_H_
+#define _FRAME_H_
+
+#include "compact.hpp"
+#include "interp.hpp"
+
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+// Frames packing many commands, in the compact format (see compact.hpp).
+//
+// A frame starts with a HEADER tag whose length is the number of strings in
+// its string table, followed by the strings as ATOM nodes. The commands
+// follow one after another, with each atom written as a SYMBOL tag whose
+// length is the atom's position in the table. Each distinct atom is stored
+// once per frame, however many commands use it.
+
+// Packs commands into frames of at most `mtu` bytes
+class FrameBuilder {
+public:
+    explicit FrameBuilder(size_t mtu);
+
+    // Add a command to the frame if it still fits within the MTU. Otherwise
+    // gives false, leaving the frame as it was.
+    bool add(const Sexp &s);
+
+    // The size of the frame so far, in bytes
+    size_t size() const;
+
+    // The number of commands in the frame
+    size_t commands() const { return count; }
+
+    // The finished frame. The builder starts a new, empty frame.
+    std::string finish();
+
+private:
+    size_t mtu;
+    std::vector<std::string> table;
+    std::unordered_map<std::string, size_t> index;
+    // The encoded string table, without its header
+    std::string table_bytes;
+    // The encoded commands
+    std::string body;
+    size_t count;
+};
+
+// Pack a plan into as few frames of at most `mtu` bytes as possible, in
+// order
+// throws: std::length_error if a command does not fit in a frame by itself
+std::vector<std::string> pack_plan(const std::vector<Sexp> &plan, size_t mtu);
+
+// Reads the commands in a frame one at a time, as they are needed
+class FrameReader {
+public:
+    // The frame must outlive the reader.
+    // throws: FrameError if the string table is malformed
+    explicit FrameReader(std::string_view frame);
+
+    // The number of strings in the frame's string table
+    size_t strings() const { return table.size(); }
+
+    // Decode the next command into `s`, or give false if there are no more
+    // throws: FrameError if the command is malformed
+    bool next(Sexp &s);
+
+private:
+    std::string_view frame;
+    std::vector<std::string_view> table;
+    // Where the next command starts
+    size_t pos;
+};
+
+#endif /* _FRAME_H_ */
@@ -1,6 +1,126 @@
 #include "interp.hpp"
+#include "compact.hpp"
+#include "compress.hpp"
+#include "delta.hpp"
+#include "fold.hpp"
+#include "frame.hpp"
+#include "journal.hpp"
+#include "packed.hpp"
+#include "schema.hpp"
+#include "scheduler.hpp"
+#include "shared-interp.hpp"
+#include "sexp-json.hpp"
+#include "sexp-view.hpp"
+#include "sink.hpp"
+#include "static-commands.hpp"
+#include "timetag.hpp"
 
+#include <atomic>
 #include <cassert>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <new>
+#include <mutex>
+#include <pthread.h>
+#include <unistd.h>
+#include <sstream>
+#include <thread>
+
+#include "cereal/archives/binary.hpp"
+#include "cereal/archives/portable_binary.hpp"
+
+// Heap allocations made so far, for checking allocation-free paths
+std::atomic<size_t> allocations(0);
+
+// Every replaceable form of the global allocation functions is replaced,
+// so that all of them are counted and each pointer is freed by the same
+// allocator that made it
+static void *counted_alloc(size_t size, size_t align) {
+    allocations++;
+    if(size == 0) {
+        size = 1;
+    }
+    void *p = align <= alignof(std::max_align_t) ? malloc(size)
+        : aligned_alloc(align, (size + align - 1) / align * align);
+    if(!p) {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void *operator new(size_t size) {
+    return counted_alloc(size, 0);
+}
+
+void *operator new[](size_t size) {
+    return counted_alloc(size, 0);
+}
+
+void *operator new(size_t size, std::align_val_t align) {
+    return counted_alloc(size, (size_t)align);
+}
+
+void *operator new[](size_t size, std::align_val_t align) {
+    return counted_alloc(size, (size_t)align);
+}
+
+void *operator new(size_t size, const std::nothrow_t &) noexcept {
+    try {
+        return counted_alloc(size, 0);
+    } catch(const std::bad_alloc &e) {
+        return nullptr;
+    }
+}
+
+void *operator new[](size_t size, const std::nothrow_t &) noexcept {
+    try {
+        return counted_alloc(size, 0);
+    } catch(const std::bad_alloc &e) {
+        return nullptr;
+    }
+}
+
+void operator delete(void *p) noexcept {
+    free(p);
+}
+
+void operator delete[](void *p) noexcept {
+    free(p);
+}
+
+void operator delete(void *p, size_t) noexcept {
+    free(p);
+}
+
+void operator delete[](void *p, size_t) noexcept {
+    free(p);
+}
+
+void operator delete(void *p, std::align_val_t) noexcept {
+    free(p);
+}
+
+void operator delete[](void *p, std::align_val_t) noexcept {
+    free(p);
+}
+
+void operator delete(void *p, size_t, std::align_val_t) noexcept {
+    free(p);
+}
+
+void operator delete[](void *p, size_t, std::align_val_t) noexcept {
+    free(p);
+}
+
+void operator delete(void *p, const std::nothrow_t &) noexcept {
+    free(p);
+}
+
+void operator delete[](void *p, const std::nothrow_t &) noexcept {
+    free(p);
+}
 
 // Example command
 std::string add(std::list<std::string> nums) {
@@ -20,27 +140,122 @@ std::string concat(std::list<std::string> strs) {
     return res;
 }
 
+// Example command that runs until its evaluation is cancelled
+std::string spin(std::list<std::string>, const CancelToken &token) {
+    while(true) {
+        token.check();
+    }
+}
+
+// Example view command: sums its arguments without copying them
+std::string sum(std::span<const ArgView> args) {
+    long long total = 0;
+    for(const ArgView &arg : args) {
+        if(!arg.is_integer) {
+            throw std::invalid_argument(std::string(arg.text));
+        }
+        total += arg.integer;
+    }
+    return std::to_string(total);
+}
+
+// Example sink command: counts up to its argument, writing each number as
+// it goes rather than building the whole result first
+void count(std::list<std::string> args, ChunkWriter &out,
+           const CancelToken &token) {
+    int n = std::stoi(args.front());
+    for(int i = 0; i < n; ++i) {
+        token.check();
+        out.write(std::to_string(i) + " ");
+    }
+}
+
 // Example command
-std::string exit_repl(std::list<std::string> strs) {
+std::string exit_repl(std::list<std::string>) {
     exit(0);
 }
 
+// Commands for testing preemption: `record` logs its argument and `gate`
+// blocks until `gate_open` is set. The log is written by the scheduler's
+// worker, so `records` lets the test wait for it without a race.
+std::vector<std::string> record_log;
+std::mutex record_lock;
+std::atomic<size_t> records(0);
+std::atomic<bool> gate_open(false);
+
+std::string record(std::list<std::string> args) {
+    std::lock_guard<std::mutex> guard(record_lock);
+    record_log.push_back(args.front());
+    records++;
+    return args.front();
+}
+
+std::string gate(std::list<std::string>) {
+    while(!gate_open.load()) {
+        std::this_thread::yield();
+    }
+    return "open";
+}
+
 // Example repl implementation
 void repl() {
     CommandSet commands;
     commands["add"] = add;
     commands["concat"] = concat;
+    commands["count"] = count;
     commands["exit"] = exit_repl;
-    auto interp = make_interpreter(commands);
+    // Results are forwarded to stdout as they are produced
+    StreamWriter out(std::cout);
     std::string cmd;
     std::cout << "interp > ";
     while(getline(std::cin, cmd)) {
-        std::cout << parse(cmd).flatMap(interp).getDefault("Invalid command.")
-                  << std::endl;
+        Optional<Sexp> parsed = parse(cmd);
+        if(parsed.isEmpty() || !interp_to(parsed.get(), commands, out)) {
+            std::cout << "Invalid command.";
+        }
+        std::cout << std::endl;
         std::cout << "interp > ";
     }
 }
 
+// Run `f` on a thread with only `stack_size` bytes of stack
+void run_with_stack(size_t stack_size, void *(*f)(void *)) {
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    assert(pthread_attr_setstacksize(&attr, stack_size) == 0);
+    pthread_t thread;
+    assert(pthread_create(&thread, &attr, f, nullptr) == 0);
+    pthread_join(thread, nullptr);
+    pthread_attr_destroy(&attr);
+}
+
+// Every tree walk on a 1M-deep command, within a 64 KB stack
+void *test_deep(void *) {
+    const size_t depth = 1000000;
+    std::string cmd;
+    for(size_t i = 0; i < depth; ++i) {
+        cmd += "(concat ";
+    }
+    cmd += "x";
+    cmd += std::string(depth, ')');
+
+    Optional<Sexp> os = parse(cmd);
+    assert(!os.isEmpty());
+    Sexp deep = os.get();
+    CommandSet commands;
+    commands["concat"] = concat;
+    assert(interp_with(deep, commands).get() == "x");
+
+    std::ostringstream printed;
+    printed << deep;
+    assert(printed.str().size() == depth * 10 + 1);
+
+    std::string serialized = serialize(deep);
+    Sexp copy = deserialize(serialized);
+    assert(serialize(copy) == serialized);
+    return nullptr;
+}
+
 // Unit tests
 void test() {
     // Sexp parsing
@@ -55,6 +270,616 @@ void test() {
     assert(!s.elements.front().isAtom);
     assert(s.elements.front().elements.size() == 2);
 
+    // Serialization matches cereal's binary archive
+    s = os.get();
+    std::stringstream ss;
+    {
+        cereal::BinaryOutputArchive oarchive(ss);
+        oarchive(s);
+    }
+    assert(serialize(s) == ss.str());
+    assert(serialize(deserialize(ss.str())) == ss.str());
+
+    // Serializing into a caller's buffer
+    {
+        std::byte frame[256];
+        size_t size = serialized_size(s);
+        assert(size == ss.str().size());
+        size_t before = allocations.load();
+        assert(serialize_into(s, frame) == size);
+        assert(serialize_into(s, std::span<std::byte>(frame, size - 1)) == 0);
+        assert(allocations.load() == before);
+        assert(std::string((const char *)frame, size) == ss.str());
+    }
+
+    // Bounded deserialization rejects corrupted lengths without allocating
+    // for them
+    {
+        std::string frame = serialize(s);
+        assert(serialize(deserialize_bounded(frame)) == frame);
+
+        // (hi joe schmoe): the list's count is at byte 9, then "hi"'s length
+        // at byte 18
+        std::string huge_list = frame;
+        huge_list[9 + 5] = 1;
+        std::string huge_atom = frame;
+        huge_atom[18 + 5] = 1;
+        std::string bad_flag = frame;
+        bad_flag[0] = 7;
+        for(std::string bad : {huge_list, huge_atom, bad_flag, frame + "x",
+                               frame.substr(0, frame.size() - 1)}) {
+            size_t before = allocations.load();
+            try {
+                deserialize_bounded(bad);
+                assert(false);
+            } catch(const cereal::Exception &e) {
+            }
+            assert(allocations.load() - before < 16);
+        }
+
+        FrameLimits limits;
+        limits.max_atom = 4;
+        try {
+            deserialize_bounded(frame, limits);
+            assert(false);
+        } catch(const cereal::Exception &e) {
+        }
+        limits = FrameLimits();
+        limits.max_nodes = 3;
+        try {
+            deserialize_bounded(frame, limits);
+            assert(false);
+        } catch(const cereal::Exception &e) {
+        }
+        limits = FrameLimits();
+        limits.max_frame = frame.size() - 1;
+        try {
+            deserialize_bounded(frame, limits);
+            assert(false);
+        } catch(const cereal::Exception &e) {
+        }
+        std::string nested = serialize(parse("(a (b (c (d))))").get());
+        limits = FrameLimits();
+        limits.max_depth = 3;
+        try {
+            deserialize_bounded(nested, limits);
+            assert(false);
+        } catch(const cereal::Exception &e) {
+        }
+        limits.max_depth = 4;
+        assert(serialize(deserialize_bounded(nested, limits)) == nested);
+    }
+
+    // The portable format is fixed little-endian, as cereal's portable
+    // archive writes it
+    {
+        std::stringstream portable_ss;
+        {
+            cereal::PortableBinaryOutputArchive oarchive(
+                portable_ss,
+                cereal::PortableBinaryOutputArchive::Options::LittleEndian());
+            oarchive(s);
+        }
+        std::string frame = serialize_portable(s);
+        assert(frame == portable_ss.str());
+        assert(frame.size() == serialized_portable_size(s));
+        assert(serialize(deserialize_portable(frame)) == ss.str());
+
+        // Both byte orders' code paths give and accept the same bytes
+        Sexp nested = parse("(a (b \"" + std::string(300, 'c')
+                            + "\" (d)) () e)").get();
+        std::string expected = serialize_portable(nested);
+        std::string bytewise(expected.size(), '\0');
+        assert(portable::serialize_into<false>(
+                   nested, std::as_writable_bytes(std::span<char>(bytewise)))
+               == expected.size());
+        assert(bytewise == expected);
+        assert(serialize(portable::deserialize<false>(expected))
+               == serialize(nested));
+        assert(serialize(portable::deserialize<true>(bytewise))
+               == serialize(nested));
+
+        for(std::string bad : {frame.substr(0, frame.size() - 1),
+                               "\0" + frame.substr(1)}) {
+            try {
+                deserialize_portable(bad);
+                assert(false);
+            } catch(const cereal::Exception &e) {
+            }
+        }
+    }
+
+    // The compact format
+    {
+        Sexp hi = parse("(hi joe schmoe)").get();
+        std::string frame = serialize_compact(hi);
+        assert(frame == std::string("\x43\x02hi\x03joe\x06schmoe"));
+        assert(serialize(deserialize_compact(frame)) == serialize(hi));
+        // Long atoms and lists spill their lengths into varints
+        Sexp big = parse("(a (b c) " + std::string(300, 'x') + " ())").get();
+        for(int i = 0; i < 100; ++i) {
+            big.elements.push_back(big.elements.front());
+        }
+        frame = serialize_compact(big);
+        assert(frame.substr(0, 3) == std::string("\x7f\x29\x01", 3));
+        assert(serialize(deserialize_compact(frame)) == serialize(big));
+        for(size_t cut = 0; cut < frame.size(); cut += 7) {
+            try {
+                deserialize_compact(frame.substr(0, cut));
+                assert(false);
+            } catch(const FrameError &e) {
+            }
+        }
+        try {
+            deserialize_compact(frame + "x");
+            assert(false);
+        } catch(const FrameError &e) {
+        }
+    }
+
+    // JSON import and export
+    {
+        Sexp command = parse("(hi (joe 1) schmoe)").get();
+        assert(to_json(command) == "[\"hi\",[\"joe\",\"1\"],\"schmoe\"]");
+        assert(serialize(from_json(to_json(command))) == serialize(command));
+        assert(from_json(" \"ping\" ").atom == "ping");
+        assert(serialize(from_json("[\"a\", 1.50, true, []]"))
+               == serialize(parse("(a 1.50 true ())").get()));
+        // Strings with characters that need escaping survive
+        Sexp quoted;
+        quoted.isAtom = true;
+        quoted.atom = "say \"hi\"\n";
+        assert(from_json(to_json(quoted)).atom == quoted.atom);
+
+        std::stringstream plan;
+        {
+            JsonPlanWriter writer(plan);
+            for(int i = 0; i < 3; ++i) {
+                writer.add(parse("(adcs-point " + std::to_string(i)
+                                 + " (mode fine))").get());
+            }
+        }
+        std::vector<std::string> read;
+        assert(read_json_plan(plan, [&read](Sexp &&s) {
+            read.push_back(serialize(s));
+        }) == 3);
+        assert(read[2] == serialize(parse("(adcs-point 2 (mode fine))").get()));
+
+        // Deep nesting is parsed without recursion
+        std::string deep = std::string(100000, '[') + std::string(100000, ']');
+        assert(to_json(from_json(deep)) == deep);
+
+        for(std::string bad : {"", "[\"a\"", "{\"a\": 1}", "[null]",
+                               "[\"a\"] x"}) {
+            try {
+                from_json(bad);
+                assert(false);
+            } catch(const JsonError &e) {
+            }
+        }
+        std::stringstream not_plan("\"ping\"");
+        try {
+            read_json_plan(not_plan, [](Sexp &&) {});
+            assert(false);
+        } catch(const JsonError &e) {
+        }
+    }
+
+    // Packing commands into frames
+    {
+        std::vector<Sexp> pass;
+        size_t separate = 0;
+        for(int i = 0; i < 20; ++i) {
+            pass.push_back(parse("(camera-capture " + std::to_string(i % 4)
+                                 + " hi-res (add 1 2))").get());
+            separate += serialize_compact(pass.back()).size();
+        }
+        FrameBuilder builder(1000);
+        for(const Sexp &command : pass) {
+            assert(builder.add(command));
+        }
+        std::string frame = builder.finish();
+        assert(frame.size() < separate / 2);
+        FrameReader reader(frame);
+        assert(reader.strings() == 7);
+        Sexp command;
+        for(const Sexp &expected : pass) {
+            assert(reader.next(command));
+            assert(serialize(command) == serialize(expected));
+        }
+        assert(!reader.next(command));
+
+        std::vector<std::string> frames = pack_plan(pass, 60);
+        assert(frames.size() > 1);
+        size_t read = 0;
+        for(const std::string &f : frames) {
+            assert(f.size() <= 60);
+            FrameReader r(f);
+            while(r.next(command)) {
+                assert(serialize(command) == serialize(pass[read++]));
+            }
+        }
+        assert(read == pass.size());
+        try {
+            pack_plan(pass, 10);
+            assert(false);
+        } catch(const std::length_error &e) {
+        }
+        // The reader only views the frame, so keep it alive
+        std::string cut = frame.substr(0, frame.size() - 1);
+        FrameReader truncated(cut);
+        try {
+            while(truncated.next(command)) {
+            }
+            assert(false);
+        } catch(const FrameError &e) {
+        }
+    }
+
+    // Compressing frames against a trained dictionary
+    {
+        std::vector<std::string> corpus;
+        for(int i = 0; i < 200; ++i) {
+            corpus.push_back(serialize_compact(parse(
+                "(camera-capture " + std::to_string(i * 7 % 100)
+                + " hi-res (add " + std::to_string(i) + " 250))").get()));
+        }
+        LzDictionary dictionary = LzDictionary::train(corpus, 256);
+        assert(dictionary.bytes().size() <= 256);
+        assert(dictionary.bytes().find("camera-capture") != std::string::npos);
+        assert(LzDictionary(dictionary.bytes()).id() == dictionary.id());
+
+        std::string frame = serialize_compact(parse(
+            "(camera-capture 12 hi-res (add 3 250))").get());
+        std::string packed = compress(frame, dictionary);
+        assert(packed.size() < frame.size() / 2);
+        assert(decompress(packed, dictionary) == frame);
+        // Frames the dictionary knows nothing about still round trip
+        std::string other(300, 'z');
+        other += "unrelated";
+        assert(decompress(compress(other, dictionary), dictionary) == other);
+        assert(decompress(compress("", dictionary), dictionary) == "");
+
+        for(std::string bad : {packed.substr(0, packed.size() - 1),
+                               std::string("\x00\x00\x05", 3),
+                               packed.substr(0, 2) + "\x80\xff\x7f"}) {
+            try {
+                decompress(bad, dictionary);
+                assert(false);
+            } catch(const FrameError &e) {
+            }
+        }
+        try {
+            decompress(compress(other, dictionary), dictionary, 100);
+            assert(false);
+        } catch(const FrameError &e) {
+        }
+    }
+
+    // Delta frames against recently sent commands
+    {
+        DeltaEncoder encoder(4);
+        DeltaDecoder decoder(4);
+        std::vector<std::string> frames;
+        for(int angle = 0; angle < 6; ++angle) {
+            Sexp command = parse("(adcs-point 10 20 " + std::to_string(angle)
+                                 + " (mode fine))").get();
+            frames.push_back(encoder.encode(command));
+            assert(serialize(decoder.decode(frames.back()))
+                   == serialize(command));
+        }
+        std::string full = serialize_compact(
+            parse("(adcs-point 10 20 5 (mode fine))").get());
+        assert(frames.back().size() < full.size() / 2);
+        assert(encoder.next_seq() == 6 && decoder.next_seq() == 6);
+        assert(decoder.lost().empty());
+
+        // Commands of a different shape are sent whole, and later ones can
+        // still refer back past them
+        Sexp other = parse("(ping)").get();
+        assert(serialize(decoder.decode(encoder.encode(other)))
+               == serialize(other));
+        Sexp again = parse("(adcs-point 10 20 9 (mode fine))").get();
+        assert(serialize(decoder.decode(encoder.encode(again)))
+               == serialize(again));
+
+        // A lost frame is detected, as is a later frame built on it. Once the
+        // encoder is told, it stops using them as bases.
+        Sexp step = parse("(adcs-point 10 20 10 (mode fine))").get();
+        encoder.encode(step);
+        Sexp next = parse("(adcs-point 10 20 11 (mode fine))").get();
+        std::string orphan = encoder.encode(next);
+        try {
+            decoder.decode(orphan);
+            assert(false);
+        } catch(const FrameError &e) {
+        }
+        assert(decoder.lost().size() == 1);
+        assert(decoder.lost()[0] == std::make_pair(uint64_t(8), uint64_t(10)));
+        for(const std::pair<uint64_t, uint64_t> &range : decoder.lost()) {
+            encoder.lost(range.first, range.second);
+        }
+        decoder.clear_lost();
+        Sexp last = parse("(adcs-point 10 20 12 (mode fine))").get();
+        assert(serialize(decoder.decode(encoder.encode(last)))
+               == serialize(last));
+        assert(decoder.lost().empty());
+
+        // Repeated frames and frames outside the command are rejected
+        try {
+            decoder.decode(frames[0]);
+            assert(false);
+        } catch(const FrameError &e) {
+        }
+        DeltaDecoder fresh(4);
+        fresh.decode(frames[0]);
+        std::string bad = frames[1];
+        bad[4] = 0x80 | 9;
+        try {
+            fresh.decode(bad);
+            assert(false);
+        } catch(const FrameError &e) {
+        }
+
+        // A corrupt sequence number far ahead is rejected without losing
+        // track of the link
+        fresh.clear_lost();
+        auto whole = [](uint64_t seq, const Sexp &s) {
+            std::string frame;
+            put_compact_tag(frame, compact::HEADER, seq);
+            put_compact_tag(frame, compact::SYMBOL, 0);
+            return frame + serialize_compact(s);
+        };
+        try {
+            fresh.decode(whole(1ull << 34, other));
+            assert(false);
+        } catch(const FrameError &e) {
+        }
+        assert(fresh.next_seq() == 2 && fresh.lost().empty());
+        assert(serialize(fresh.decode(whole(2, other))) == serialize(other));
+        assert(fresh.lost().empty());
+    }
+
+    // Bit-packed arguments from schemas
+    {
+        CommandSet commands;
+        commands["adcs-point"] = Command(concat).with_schema(Schema{{
+            ArgSchema::number("roll", -180, 180),
+            ArgSchema::number("pitch", -90, 90),
+            ArgSchema::number("yaw", -180, 180)}});
+        commands["heater-set"] = Command(concat).with_schema(Schema{{
+            ArgSchema::integer("zone", 0, 15),
+            ArgSchema::one_of("state", {"on", "off"}),
+            ArgSchema::integer("watts")}});
+        commands["log"] = Command(concat).with_schema(
+            Schema{{ArgSchema::any("line")}, true});
+        commands["add"] = add;
+        ArgPacker packer(commands);
+        assert(packer.fingerprint() == PlanChecker(commands).fingerprint());
+
+        auto round_trip = [&packer](const std::string &text) {
+            Sexp s = parse(text).get();
+            std::string frame = packer.pack(s);
+            assert(serialize(packer.unpack(frame)) == serialize(s));
+            return frame;
+        };
+        // Arguments that pack into no bits can still be repeated
+        {
+            CommandSet arming;
+            arming["arm"] = Command(concat).with_schema(
+                Schema{{ArgSchema::one_of("safe", {"yes"})}, true});
+            ArgPacker empty(arming);
+            std::string text = "(arm";
+            for(int i = 0; i < 100; ++i) {
+                text += " yes";
+            }
+            Sexp many = parse(text + ")").get();
+            std::string frame = empty.pack(many);
+            assert(empty.packs(many) && frame.size() <= 2);
+            assert(serialize(empty.unpack(frame)) == serialize(many));
+        }
+
+        Sexp point = parse("(adcs-point 12.5 -0.1 45)").get();
+        std::string packed = round_trip("(adcs-point 12.5 -0.1 45)");
+        assert(packer.packs(point));
+        // 2 code bits, then 2 + 32, 2 + 32 and 2 + 8 bits
+        assert(packed.size() == 10);
+        assert(packed.size() * 2 < serialize_compact(point).size());
+        assert(packed.size() * 8 < serialize(point).size());
+        // 2 + 4 + 1 + 8 bits
+        assert(round_trip("(heater-set 3 off -20)").size() == 2);
+        round_trip("(adcs-point 1e3 0.30000000000000004 nan)");
+        round_trip("(log)");
+        round_trip("(log one two three)");
+
+        // Anything else is sent in the compact format
+        for(std::string other : {"(add 1 2)", "(heater-set 3 dim 5)",
+                                 "(heater-set 3 on (add 1 2))",
+                                 "(heater-set 16 on 5)", "(heater-set 03 on 5)",
+                                 "(adcs-point 1 2)", "(let ((x 1)) x)",
+                                 "(unknown)", "(5 on)"}) {
+            assert(!packer.packs(parse(other).get()));
+            std::string frame = round_trip(other);
+            assert(frame.substr(1) == serialize_compact(parse(other).get()));
+        }
+
+        std::string heater = packer.pack(parse("(heater-set 3 off 5)").get());
+        for(std::string bad : {packed.substr(0, packed.size() - 1),
+                               packed + "x", heater.substr(0, 1),
+                               std::string("\xC0", 1)}) {
+            try {
+                packer.unpack(bad);
+                assert(false);
+            } catch(const FrameError &e) {
+            }
+        }
+    }
+
+    // Dictionary codes for command names
+    {
+        CommandSet names;
+        names["add"] = add;
+        names["camera-capture"] = concat;
+        Dictionary dictionary(names, {"hi-res"});
+        assert(dictionary.size() == 8);
+        assert(dictionary.code("let") == 0 && dictionary.code("add") == 5);
+        assert(dictionary.code("unknown") == -1);
+        Sexp capture = parse("(camera-capture 12 (add 1 2) hi-res)").get();
+        std::string frame = serialize_compact(capture, dictionary);
+        // The header, with the 32-bit version, then codes for the names and
+        // literal numbers
+        assert(frame.size() <= 6 + 12);
+        assert(frame.size() - 6 < serialize_compact(capture).size() / 2);
+        assert(serialize(deserialize_compact(frame, dictionary))
+               == serialize(capture));
+        // Frames without a dictionary still decode
+        assert(serialize(deserialize_compact(serialize_compact(capture),
+                                             dictionary))
+               == serialize(capture));
+
+        // Frames can't be read with another dictionary, or without one
+        names["sub"] = add;
+        Dictionary newer(names, {"hi-res"});
+        assert(newer.version() != dictionary.version());
+        try {
+            deserialize_compact(frame, newer);
+            assert(false);
+        } catch(const FrameError &e) {
+        }
+        try {
+            deserialize_compact(frame);
+            assert(false);
+        } catch(const FrameError &e) {
+        }
+        // Nor can symbol codes be read from a frame without its header
+        CompactReader header(frame);
+        uint64_t version;
+        assert(header.tag(version) == compact::HEADER
+               && version == dictionary.version());
+        std::string headless = frame.substr(header.offset());
+        try {
+            deserialize_compact(headless, dictionary);
+            assert(false);
+        } catch(const FrameError &e) {
+        }
+        try {
+            SexpView view(headless, &dictionary);
+            assert(false);
+        } catch(const FrameError &e) {
+        }
+    }
+
+    // Journal of executed commands
+    {
+        std::string dir = (std::filesystem::temp_directory_path()
+                           / ("interp-journal-" + std::to_string(getpid())))
+            .string();
+        std::filesystem::remove_all(dir);
+        CommandSet commands;
+        commands["add"] = add;
+        JournalOptions options;
+        options.segment_size = 4096;
+        options.group_size = 16;
+        std::chrono::system_clock::time_point middle;
+        {
+            Journal journal(dir, options);
+            Interpreter interp = journaled(make_interpreter(commands), journal);
+            for(int i = 0; i < 500; ++i) {
+                if(i == 100) {
+                    middle = std::chrono::system_clock::now();
+                }
+                interp(parse(i % 10 == 0 ? "(nope)"
+                             : "(add " + std::to_string(i) + " 1)").get());
+            }
+            journal.flush();
+            assert(journal.durable() == 500);
+        }
+        size_t files = 0;
+        for(const auto &file : std::filesystem::directory_iterator(dir)) {
+            files += file.path().extension() == ".journal";
+        }
+        assert(files > 1);
+
+        {
+            JournalReader reader(dir);
+            assert(reader.size() == 500);
+            JournalEntry entry;
+            assert(reader.seek(uint64_t(250)) && reader.next(entry));
+            assert(entry.seq == 250 && entry.status == JournalStatus::Error);
+            assert(reader.next(entry) && entry.seq == 251);
+            assert(entry.status == JournalStatus::Ok);
+            assert(serialize(entry.command)
+                   == serialize(parse("(add 251 1)").get()));
+            assert(reader.seek(middle) && reader.next(entry));
+            assert(entry.seq <= 100 && entry.time >= middle);
+            assert(!reader.seek(uint64_t(500)));
+            assert(!reader.next(entry));
+        }
+
+        // A reopened journal continues where it left off, and a torn record
+        // is where the journal ends
+        {
+            Journal journal(dir, options);
+            assert(journal.next_seq() == 500);
+            assert(journal.append(parse("(marker-xyz)").get(),
+                                  JournalStatus::Ok) == 500);
+        }
+        for(const auto &file : std::filesystem::directory_iterator(dir)) {
+            std::fstream f(file.path(), std::ios::in | std::ios::out
+                           | std::ios::binary);
+            std::string bytes((std::istreambuf_iterator<char>(f)),
+                              std::istreambuf_iterator<char>());
+            size_t at = bytes.find("marker-xyz");
+            if(at != std::string::npos) {
+                f.seekp(at);
+                f.put('M');
+            }
+        }
+        assert(JournalReader(dir).size() == 500);
+        {
+            Journal journal(dir, options);
+            assert(journal.next_seq() == 500);
+        }
+
+        // A segment left empty by a reset as it was made, and stray files,
+        // don't stop the journal opening
+        std::ofstream(dir + "/00000000000000000500.journal");
+        std::ofstream(dir + "/notes.journal") << "not a segment";
+        {
+            Journal journal(dir, options);
+            assert(journal.next_seq() == 500);
+            assert(journal.append(parse("(after-reset)").get(),
+                                  JournalStatus::Ok) == 500);
+        }
+        assert(JournalReader(dir).size() == 501);
+
+        // An empty record would read as the end of the segment, so it is
+        // refused rather than hiding the records after it
+        {
+            Journal journal(dir, options);
+            try {
+                journal.append_compact("", JournalStatus::Ok);
+                assert(false);
+            } catch(const std::invalid_argument &e) {
+            }
+            assert(journal.append(parse("(after-empty)").get(),
+                                  JournalStatus::Ok) == 501);
+        }
+        {
+            Journal journal(dir, options);
+            assert(journal.next_seq() == 502);
+            JournalReader reader(dir);
+            JournalEntry entry;
+            assert(reader.seek(uint64_t(501)) && reader.next(entry));
+            assert(serialize(entry.command)
+                   == serialize(parse("(after-empty)").get()));
+        }
+        std::filesystem::remove_all(dir);
+    }
+
+    // Deeply nested commands
+    run_with_stack(64 * 1024, test_deep);
+
     // Interp
     CommandSet commands;
     commands["add"] = add;
@@ -79,9 +904,565 @@ void test() {
     ores = parse("(concat \"this   is \" \"test\")").flatMap(interp);
     assert(!ores.isEmpty());
     assert(ores.get() == "this   is test");
+
+    // Deadlines
+    commands["spin"] = spin;
+    auto bounded = make_interpreter(commands, std::chrono::milliseconds(20));
+    ores = parse("(add 1 2)").flatMap(bounded);
+    assert(!ores.isEmpty());
+    assert(ores.get() == "3");
+    ores = parse("(add (spin) 1)").flatMap(bounded);
+    assert(!ores.isEmpty());
+    assert(ores.get() == "Error: deadline exceeded.");
+    CancelToken token;
+    token.cancel();
+    ores = interp_with(parse("(add 1 2)").get(), commands, token);
+    assert(ores.get() == "Error: deadline exceeded.");
+
+    // Scheduler
+    commands["record"] = record;
+    commands["gate"] = gate;
+    {
+        Scheduler scheduler(commands, 1);
+        auto low = scheduler.submit(
+            parse("(concat (record a) (gate) (record b) )").get(),
+            Priority::Housekeeping);
+        while(records.load() == 0) {
+            std::this_thread::yield();
+        }
+        auto high = scheduler.submit(parse("(record h)").get(),
+                                     Priority::SafeMode);
+        gate_open = true;
+        assert(low.get().get() == "aopenb");
+        assert(high.get().get() == "h");
+        // The safe-mode command ran at the first node boundary after `gate`
+        std::lock_guard<std::mutex> guard(record_lock);
+        assert(record_log.size() == 3);
+        assert(record_log[1] == "h");
+        assert(scheduler.stats(Priority::SafeMode).started == 1);
+        assert(scheduler.stats(Priority::Housekeeping).depth == 0);
+    }
+
+    // Time-tagged commands, simulating several hours of schedule
+    OrbitTime now = 1000;
+    OrbitClock fake_clock = [&now]() { return now; };
+    const char *journal = "/tmp/interp-test-timetag.journal";
+    std::remove(journal);
+    {
+        TimeTaggedQueue queue(interp, fake_clock, journal);
+        assert(queue.schedule(parse("(at 5000 (add 1 2))").get()).get() == 1);
+        assert(queue.schedule(parse("(at 2000 (concat early))").get())
+               .get() == 2);
+        assert(queue.schedule(parse("(at 36000000 (add 40 2))").get())
+               .get() == 3);
+        Optional<TimeTaggedQueue::Id> cancelled =
+            queue.schedule(parse("(at 7000 (add 0 0))").get());
+        assert(queue.schedule(parse("(at soon (add 0 0))").get()).isEmpty());
+        assert(queue.cancel(cancelled.get()));
+        assert(!queue.cancel(cancelled.get()));
+
+        assert(queue.run_due().empty());
+        now = 10000;
+        auto results = queue.run_due();
+        assert(results.size() == 2);
+        assert(results[0].second.get() == "early");
+        assert(results[1].second.get() == "3");
+        assert(queue.size() == 1);
+    }
+    {
+        // The pending command survives a restart
+        TimeTaggedQueue queue(interp, fake_clock, journal);
+        assert(queue.size() == 1);
+        now = 10 * 3600 * 1000 - 1;
+        assert(queue.run_due().empty());
+        now = 10 * 3600 * 1000;
+        auto results = queue.run_due();
+        assert(results.size() == 1);
+        assert(results[0].second.get() == "42");
+        assert(queue.size() == 0);
+    }
+    {
+        // Ids that ran or were cancelled before the restarts stay used
+        TimeTaggedQueue queue(interp, fake_clock, journal);
+        assert(queue.size() == 0);
+        assert(queue.schedule(now + 1, parse("(add 1)").get()) == 5);
+    }
+    std::remove(journal);
+
+    // Every entry fires exactly once, in order, at its due time
+    {
+        TimeTaggedQueue queue(interp, fake_clock);
+        OrbitTime start = now;
+        for(OrbitTime t = 1; t <= 4000; ++t) {
+            std::string time = std::to_string(start + t * 997);
+            queue.schedule(parse("(at " + time + " (add " + time + "))").get());
+        }
+        size_t fired = 0;
+        while(queue.size() > 0) {
+            now += 60 * 1000;
+            for(auto &result : queue.run_due()) {
+                OrbitTime at = std::stoull(result.second.get());
+                assert(at <= now && at > now - 60 * 1000);
+                assert(at == start + (++fired) * 997);
+            }
+        }
+        assert(fired == 4000);
+    }
+
+    // Entries scheduled in the past fire in due order, ties in the order
+    // they were scheduled
+    {
+        TimingWheel wheel(100);
+        std::vector<TimingWheel::Entry> due;
+        wheel.insert(1, 50, Sexp());
+        wheel.insert(2, 20, Sexp());
+        wheel.insert(3, 80, Sexp());
+        wheel.insert(4, 20, Sexp());
+        wheel.advance(100, due);
+        assert(due.size() == 4);
+        assert(due[0].id == 2 && due[1].id == 4 && due[2].id == 1
+               && due[3].id == 3);
+    }
+
+    // Times far in the future wait in the top level without upsetting the
+    // wheel
+    {
+        TimingWheel wheel(0);
+        std::vector<TimingWheel::Entry> due;
+        wheel.insert(1, 1ull << 62, Sexp());
+        wheel.insert(2, ~0ull, Sexp());
+        wheel.advance(100, due);
+        assert(due.empty());
+        wheel.advance((1ull << 62) - 1, due);
+        assert(due.empty());
+        wheel.advance(1ull << 62, due);
+        assert(due.size() == 1 && due[0].id == 1);
+        wheel.advance(~0ull, due);
+        assert(due.size() == 2 && due[1].id == 2);
+
+        TimeTaggedQueue queue(interp, fake_clock);
+        assert(!queue.schedule(parse("(at 18446744073709551615 (add 1))")
+                               .get()).isEmpty());
+        assert(queue.run_due().empty() && queue.size() == 1);
+    }
+
+    // Shared interpreter: readers see one whole table or the next while
+    // tables are hot-swapped underneath them
+    {
+        CommandSet versioned;
+        versioned["version"] = [](std::list<std::string>) {
+            return std::string("0");
+        };
+        SharedInterpreter shared(versioned);
+        std::atomic<bool> done(false);
+        std::vector<std::thread> readers;
+        for(int i = 0; i < 4; ++i) {
+            readers.push_back(std::thread([&shared, &done]() {
+                Sexp version = parse("(version)").get();
+                int last = 0;
+                while(!done.load()) {
+                    int seen = std::stoi(shared.interp(version).get());
+                    assert(seen >= last);
+                    last = seen;
+                }
+            }));
+        }
+        for(int v = 1; v <= 200; ++v) {
+            versioned["version"] = [v](std::list<std::string>) {
+                return std::to_string(v);
+            };
+            shared.publish(versioned);
+        }
+        done = true;
+        for(std::thread &reader : readers) {
+            reader.join();
+        }
+        assert(shared.interp(parse("(version)").get()).get() == "200");
+        assert(shared.reclaim() == 0);
+
+        // Definitions are published as new tables
+        assert(shared.interp(parse("(alias v version)").get()).get() == "v");
+        assert(shared.interp(parse("(v)").get()).get() == "200");
+    }
+
+    // Macros and aliases
+    {
+        auto definer = make_interpreter(commands);
+        ores = parse("(defmacro add3 (a b c) (add a (add b c)))")
+            .flatMap(definer);
+        assert(ores.get() == "add3");
+        assert(parse("(add3 1 2 3)").flatMap(definer).get() == "6");
+        // Macros may use earlier macros, and their arguments are evaluated
+        parse("(defmacro greet (who) (concat hello- who (add3 0 0 1)))")
+            .flatMap(definer);
+        assert(parse("(greet (concat jo e))").flatMap(definer).get()
+               == "hello-joe1");
+        assert(parse("(alias plus add)").flatMap(definer).get() == "plus");
+        assert(parse("(plus 2 2)").flatMap(definer).get() == "4");
+        // Macros can be redefined, native commands cannot
+        parse("(defmacro add3 (a b c) (concat a b c))").flatMap(definer);
+        assert(parse("(add3 1 2 3)").flatMap(definer).get() == "123");
+        assert(parse("(defmacro add (a) a)").flatMap(definer).get()
+               == "Error: cannot redefine command 'add'.");
+        // Definitions are checked when they are made
+        assert(parse("(defmacro bad (a a) a)").flatMap(definer).get()
+               == "Error: defmacro: duplicate parameter 'a'.");
+        assert(parse("(defmacro bad (a) (nope a))").flatMap(definer).get()
+               == "Error: defmacro: Command 'nope' undefined.");
+        assert(parse("(bad 1)").flatMap(definer).get()
+               == "Error: Command 'bad' undefined.");
+        assert(parse("(add3 1 2)").flatMap(definer).get()
+               == "Error: invalid argument: add3 takes 3 arguments");
+        // Other interpreters are unaffected
+        assert(parse("(plus 2 2)").flatMap(interp).get()
+               == "Error: Command 'plus' undefined.");
+        // Copies share definitions, and can define and run on other threads
+        Interpreter copy = definer;
+        std::vector<std::thread> threads;
+        for(int t = 0; t < 4; ++t) {
+            threads.push_back(std::thread([copy, t]() {
+                std::string name = "sum" + std::to_string(t);
+                for(int i = 0; i < 200; ++i) {
+                    parse("(alias " + name + " add)").flatMap(copy);
+                    assert(parse("(" + name + " 1 1)").flatMap(copy).get()
+                           == "2");
+                }
+            }));
+        }
+        for(std::thread &thread : threads) {
+            thread.join();
+        }
+        assert(parse("(sum3 2 2)").flatMap(definer).get() == "4");
+    }
+
+    // Variables
+    ores = parse("(let ((x (add 1 2)) (y (add x 1))) (add x y))")
+        .flatMap(interp);
+    assert(ores.get() == "7");
+    ores = parse("(let ((x 1)) (set! x (add x 10)) (concat x (let ((x a)) x) x))")
+        .flatMap(interp);
+    assert(ores.get() == "11a11");
+    ores = parse("(concat (let ((f concat)) (f a b)) c)").flatMap(interp);
+    assert(ores.get() == "abc");
+    ores = parse("(let ((x 1)) (nope x))").flatMap(interp);
+    assert(ores.get() == "Error: Command 'nope' undefined.");
+    ores = parse("(set! x 1)").flatMap(interp);
+    assert(ores.get() == "Error: unbound variable 'x'.");
+    ores = parse("(let (x) x)").flatMap(interp);
+    assert(ores.get() == "Error: malformed let binding.");
+    {
+        auto definer = make_interpreter(commands);
+        parse("(defmacro twice (a) (let ((b (add a a))) (concat b - b)))")
+            .flatMap(definer);
+        ores = parse("(let ((n 4)) (twice (add n 1)))").flatMap(definer);
+        assert(ores.get() == "10-10");
+    }
+
+    // Constant folding
+    {
+        CommandSet pure;
+        pure["add"] = add;
+        std::vector<Sexp> plan;
+        plan.push_back(parse("(point (add 1 2) x (add (add 1 1) 3))").get());
+        plan.push_back(parse("(add 1 2)").get());
+        plan.push_back(parse("(at 100 (add 1 (add 2 2)))").get());
+        plan.push_back(parse("(let ((x 1)) (add x 1))").get());
+        plan.push_back(parse("(point (add one 1))").get());
+        FoldReport report = fold_plan(plan, pure);
+        std::ostringstream folded;
+        for(const Sexp &command : plan) {
+            folded << command;
+        }
+        assert(folded.str() == "(point 3 x 5 )(add 1 2 )(at 100 (add 1 4 ) )"
+                               "(let ((x 1 ) ) (add x 1 ) )(point (add one 1 ) )");
+        assert(report.folded == 4);
+        assert(report.bytes_saved() > 0);
+        assert(report.bytes_after == serialize(plan[0]).size()
+               + serialize(plan[1]).size() + serialize(plan[2]).size()
+               + serialize(plan[3]).size() + serialize(plan[4]).size());
+
+        // A value can take more bytes than the expression giving it
+        pure["repeat"] = [](std::list<std::string> args) {
+            return std::string(std::stoi(args.front()), 'x');
+        };
+        std::vector<Sexp> growing{parse("(point (repeat 100))").get()};
+        report = fold_plan(growing, pure);
+        assert(report.folded == 1);
+        assert(report.bytes_after > report.bytes_before);
+        assert(report.bytes_saved() < 0);
+        assert(report.bytes_saved() == (int64_t)report.bytes_before
+               - (int64_t)report.bytes_after);
+    }
+
+    // Streaming output
+    {
+        commands["count"] = count;
+        std::vector<std::string> frames;
+        {
+            BufferWriter downlink(4, [&frames](const char *data, size_t size) {
+                frames.push_back(std::string(data, size));
+            });
+            assert(interp_to(parse("(count (add 2 3))").get(), commands,
+                             downlink));
+            // Full frames went out while the command was still running
+            assert(frames.size() == 2);
+        }
+        assert(frames.size() == 3);
+        assert(frames[0] == "0 1 " && frames[2] == "4 ");
+
+        // A failing link is reported by flush, but not by the destructor
+        {
+            BufferWriter broken(4, [](const char *, size_t) {
+                throw std::runtime_error("link down");
+            });
+            broken.write("ab");
+            try {
+                broken.flush();
+                assert(false);
+            } catch(const std::runtime_error &e) {
+            }
+        }
+        // Empty frames could never fill up
+        try {
+            BufferWriter empty(0, [](const char *, size_t) {});
+            assert(false);
+        } catch(const std::invalid_argument &e) {
+        }
+
+        // Used as an argument, a sink command's output is collected
+        StringWriter out;
+        assert(interp_to(parse("(concat (count 3) !)").get(), commands, out));
+        assert(out.str == "0 1 2 !");
+        assert(interp_with(parse("(count 2)").get(), commands).get() == "0 1 ");
+
+        StringWriter timed_out;
+        assert(interp_to(parse("(count 100000000)").get(), commands, timed_out,
+                         CancelToken::after(std::chrono::milliseconds(10))));
+        assert(timed_out.str.size() > 25);
+        assert(timed_out.str.substr(timed_out.str.size() - 25)
+               == "Error: deadline exceeded.");
+    }
+
+    // Argument views
+    {
+        commands["sum"] = sum;
+        commands["zero"] = [](std::span<const ArgView>) {
+            return std::string("0");
+        };
+        assert(interp_with(parse("(sum 1 (sum 2 3) (add 4 5))").get(),
+                           commands).get() == "15");
+        assert(interp_with(parse("(sum 1 x)").get(), commands).get()
+               == "Error: invalid argument: x");
+        // View commands still work where they get copies, e.g. in macros
+        assert(interp_with(parse("(let ((x 2)) (sum x x))").get(),
+                           commands).get() == "4");
+        ArgView number("2.5");
+        assert(number.is_number && !number.is_integer && number.number == 2.5);
+        ArgView integer("-12");
+        assert(integer.is_integer && integer.integer == -12);
+        assert(!ArgView("").is_number && !ArgView("12a").is_number);
+
+        // Once the buffers have grown, calls with short arguments don't
+        // allocate
+        Sexp calls = parse("(sum 1 2 (sum 3 4 (zero)) 5)").get();
+        assert(interp_with(calls, commands).get() == "15");
+        size_t before = allocations.load();
+        for(int i = 0; i < 100; ++i) {
+            assert(interp_with(calls, commands).get() == "15");
+        }
+        assert(allocations.load() == before);
+
+        // Received frames can be checked and run in place
+        Dictionary dictionary(commands);
+        std::string frame = serialize_compact(calls, dictionary);
+        SexpView view(frame, &dictionary);
+        assert(view.nodes() == 11 && !view.has_forms());
+        NodeView root = view.root();
+        assert(!root.isAtom && root.size == 5);
+        NodeView name = view.first(root);
+        assert(name.isAtom && name.atom == "sum");
+        NodeView inner = view.next(view.next(view.next(name)));
+        assert(!inner.isAtom && inner.size == 4);
+        assert(view.next(inner).atom == "5");
+        assert(serialize(view.to_sexp()) == serialize(calls));
+        assert(interp_view(view, commands).get() == "15");
+        before = allocations.load();
+        for(int i = 0; i < 100; ++i) {
+            SexpView received(frame, &dictionary);
+            assert(interp_view(received, commands).get() == "15");
+        }
+        assert(allocations.load() == before);
+
+        std::string with_let = serialize_compact(
+            parse("(let ((x 2)) (sum x x))").get());
+        assert(SexpView(with_let).has_forms());
+        assert(interp_view(SexpView(with_let), commands).get() == "4");
+        assert(interp_view(SexpView(serialize_compact(parse("(sum 1 (x))")
+                                                      .get())),
+                           commands).get() == "Error: invalid argument: "
+               "Error: Command 'x' undefined.");
+        std::string bad = frame;
+        bad[frame.size() - 2] = '\x45';
+        for(std::string broken : {frame.substr(0, frame.size() - 1),
+                                  frame + "x", bad}) {
+            try {
+                SexpView received(broken, &dictionary);
+                assert(false);
+            } catch(const FrameError &e) {
+            }
+        }
+    }
+
+    // Static command sets
+    {
+        typedef StaticCommandSet<Cmd<"concat", &concat>, Cmd<"add", &add>,
+                                 Cmd<"sum", &sum>, Cmd<"spin", &spin>,
+                                 Cmd<"count", &count>> Flight;
+        static_assert(Flight::contains("sum") && !Flight::contains("sub"));
+        Flight flight;
+        assert(interp_with(parse("(add 1 (sum 2 3) (add 4 5))").get(), flight)
+               .get() == "15");
+        assert(interp_with(parse("(concat (count 2) x)").get(), flight).get()
+               == "0 1 x");
+        assert(interp_with(parse("(sub 1 2)").get(), flight).get()
+               == "Error: Command 'sub' undefined.");
+        assert(interp_with(parse("(sum x)").get(), flight).get()
+               == "Error: invalid argument: x");
+        assert(interp_with(parse("(add 1 (spin))").get(), flight,
+                           CancelToken::after(std::chrono::milliseconds(10)))
+               .get() == "Error: deadline exceeded.");
+        assert(make_interpreter(flight)(parse("(sum 1 2)").get()).get() == "3");
+        CommandSet dynamic = Flight::to_command_set();
+        assert(dynamic.size() == 5);
+        assert(interp_with(parse("(let ((x 2)) (sum x (add x 1)))").get(),
+                           dynamic).get() == "5");
+    }
+
+    // Argument schemas
+    {
+        CommandSet ground;
+        ground["add"] = Command(add).with_schema(
+            Schema{{ArgSchema::integer("n")}, true});
+        ground["mode"] = Command(concat).with_schema(
+            Schema{{ArgSchema::one_of("mode", {"safe", "normal"}),
+                    ArgSchema::integer("seconds", 0, 600)}});
+        ground["concat"] = concat;
+        PlanChecker checker(ground);
+
+        std::vector<Sexp> plan;
+        plan.push_back(parse("(add 1 (add 2 x))").get());
+        plan.push_back(parse("(mode fast 900)").get());
+        plan.push_back(parse("(mode safe)").get());
+        plan.push_back(parse("(ad 1 2)").get());
+        plan.push_back(parse("(let ((y 3)) (add y (concat a b)))").get());
+        plan.push_back(parse("(defmacro twice (a) (add a a))").get());
+        plan.push_back(parse("(twice 1 2)").get());
+        plan.push_back(parse("(alias plus add)").get());
+        plan.push_back(parse("(plus 1 z)").get());
+        std::vector<Diagnostic> found = checker.check_plan(plan);
+        std::vector<std::string> messages;
+        for(const Diagnostic &diagnostic : found) {
+            std::ostringstream out;
+            out << diagnostic;
+            messages.push_back(out.str());
+        }
+        assert(messages.size() == 7);
+        assert(messages[0] == "command 0, element 2.2: argument 2 (n) of 'add'"
+               " must be an integer, got 'x'");
+        assert(messages[1] == "command 1, element 1: argument 1 (mode) of"
+               " 'mode' must be one of normal safe, got 'fast'");
+        assert(messages[2] == "command 1, element 2: argument 2 (seconds) of"
+               " 'mode' must be between 0 and 600, got '900'");
+        assert(messages[3] == "command 2: 'mode' takes 2 arguments, got 1");
+        assert(messages[4] == "command 3, element 0: unknown command 'ad'"
+               " (did you mean 'add'?)");
+        assert(messages[5] == "command 6: 'twice' takes 1 argument, got 2");
+        assert(messages[6] == "command 8, element 2: argument 2 (n) of 'plus'"
+               " must be an integer, got 'z'");
+
+        // Sealed frames skip the flight-side check only if the schemas match
+        Sexp good = parse("(add 1 2)").get();
+        assert(checker.seal(plan[0]).isEmpty());
+        std::string sealed = checker.seal(good).get();
+        assert(serialize(PlanChecker(ground).admit(sealed).get())
+               == serialize(good));
+        assert(serialize(checker.admit(serialize(good)).get()) == serialize(good));
+        std::vector<Diagnostic> rejected;
+        assert(checker.admit(serialize(plan[0]), &rejected).isEmpty());
+        assert(rejected.size() == 1);
+        CommandSet stricter = ground;
+        stricter["add"] = Command(add).with_schema(
+            Schema{{ArgSchema::integer("n", 0, 1)}, true});
+        PlanChecker flight(stricter);
+        assert(flight.fingerprint() != checker.fingerprint());
+        assert(flight.admit(sealed).isEmpty());
+        // Schemas don't change how commands run
+        assert(interp_with(good, ground).get() == "3");
+
+        // Definitions are checked as the interpreter would take them, and
+        // macro bodies against the commands plus the parameters
+        std::vector<Sexp> definitions;
+        definitions.push_back(parse("(defmacro m (a) (add a 1) extra)").get());
+        definitions.push_back(parse("(alias p add extra)").get());
+        definitions.push_back(parse("(defmacro dup (a a) a)").get());
+        definitions.push_back(parse("(defmacro bad (a) (nope a x))").get());
+        definitions.push_back(parse("(defmacro self (a) (self a))").get());
+        definitions.push_back(parse("(defmacro ok (a) (add a 1))").get());
+        definitions.push_back(parse("(ok 2)").get());
+        definitions.push_back(parse("(defmacro var (a) (a 1))").get());
+        definitions.push_back(parse("(defmacro head (a) ((concat a) 1))").get());
+        messages.clear();
+        for(const Diagnostic &diagnostic : checker.check_plan(definitions)) {
+            std::ostringstream out;
+            out << diagnostic;
+            messages.push_back(out.str());
+        }
+        assert(messages.size() == 7);
+        assert(messages[0] == "command 0: defmacro takes a name, parameters"
+               " and a body");
+        assert(messages[1] == "command 1: alias takes a name and a command");
+        assert(messages[2] == "command 2, element 2: defmacro parameters are"
+               " distinct names");
+        assert(messages[3] == "command 3, element 3.0: unknown command"
+               " 'nope' (did you mean 'mode'?)");
+        assert(messages[4] == "command 4, element 3.0: unknown command"
+               " 'self'");
+        assert(messages[5] == "command 7, element 3.0: command names in a"
+               " macro body must be literal");
+        assert(messages[6] == "command 8, element 3.0: command names in a"
+               " macro body must be literal");
+        // The interpreter refuses the same bodies
+        auto definer = make_interpreter(ground);
+        for(size_t i = 7; i < definitions.size(); ++i) {
+            assert(definer(definitions[i]).get()
+                   == "Error: defmacro: command names in a macro body must"
+                      " be literal.");
+        }
+
+        // The fingerprint and the sealed header don't depend on the host
+        CommandSet pinned;
+        pinned["add"] = Command(add).with_schema(
+            Schema{{ArgSchema::integer("n", 0, 9),
+                    ArgSchema::one_of("mode", {"b", "a"})}, true});
+        uint64_t pinned_print = PlanChecker(pinned).fingerprint();
+        assert(pinned_print == 0x1cae9f74b4c0fc2dULL);
+        std::string header =
+            PlanChecker(pinned).seal(parse("(add 1 a)").get()).get().substr(1, 8);
+        for(size_t i = 0; i < 8; ++i) {
+            assert((unsigned char)header[i]
+                   == (unsigned char)(pinned_print >> (8 * i)));
+        }
+
+        // A variadic schema needs an argument to repeat
+        try {
+            Command(add).with_schema(Schema{{}, true});
+            assert(false);
+        } catch(const std::invalid_argument &e) {
+        }
+    }
 }
 
-int main(int argc, char *argv[]) {
+int main() {
     std::cout << "Running tests..." << std::endl;
     test();
     std::cout << "Done." << std::endl;
@@ -1,10 +1,20 @@
+#include <atomic>
+#include <charconv>
+#include <cstddef>
+#include <cstring>
+#include <deque>
 #include <iostream>
-#include <stack>
+#include <iterator>
 #include <list>
 #include <map>
 #include <functional>
+#include <memory>
+#include <mutex>
+#include <span>
 #include <string>
-#include <sstream>
+#include <string_view>
+#include <system_error>
+#include <vector>
 
 #include "Optional.hpp"
 #include "cereal/archives/binary.hpp"
@@ -13,126 +23,155 @@
 
 #include "interp.hpp"
 
-std::ostream& operator<<(std::ostream& os, const Sexp &s) {
-    if(s.isAtom) {
-        return os << s.atom;
-    } else {
-        os << "(";
-        for(Sexp el : s.elements) {
-            os << el << " ";
-        }
-        return os << ")";
+Sexp::Sexp(const Sexp &other) : isAtom(other.isAtom), atom(other.atom) {
+    // Copy level by level: each source list is paired with the list that
+    // receives its copy
+    std::vector<std::pair<const Sexp *, Sexp *>> todo;
+    todo.push_back(std::make_pair(&other, this));
+    while(!todo.empty()) {
+	const Sexp *from = todo.back().first;
+	Sexp *to = todo.back().second;
+	todo.pop_back();
+	for(const Sexp &el : from->elements) {
+	    to->elements.push_back(Sexp());
+	    Sexp &copy = to->elements.back();
+	    copy.isAtom = el.isAtom;
+	    copy.atom = el.atom;
+	    if(!el.elements.empty()) {
+		todo.push_back(std::make_pair(&el, &copy));
+	    }
+	}
     }
 }
 
+Sexp::Sexp(Sexp &&other) noexcept
+    : isAtom(other.isAtom), atom(std::move(other.atom)),
+      elements(std::move(other.elements)) {}
 
-// Parse the given string for a substring representing an s-expression,
-// if possible.
-// The given string *must* begin with '('.
-//
-// Examples:
-// "(blah (blah) baz) shdfhj djf) fjdsj)" -> Just("(blah (blah) baz)")
-// "(blah (blah) baz" -> None
-// " (blah)" -> None
-Optional<std::string> sexp_str(std::string str) {
-    if(str.size() < 2 || str[0] != '(') {
-	return None<std::string>();
+Sexp &Sexp::operator=(const Sexp &other) {
+    if(this != &other) {
+	Sexp copy(other);
+	*this = std::move(copy);
     }
+    return *this;
+}
 
-    std::stack<char> parens;
-    bool in_str = false;
-    char last_char = ' ';
-    for (int i = 0; i < str.size(); ++i) {
-	char c = str[i];
-	switch(c) {
-	case '(':
-	    if(!in_str) {
-		parens.push('(');
-	    }
-	    break;
+Sexp &Sexp::operator=(Sexp &&other) noexcept {
+    isAtom = other.isAtom;
+    atom.swap(other.atom);
+    // `other` destroys our old elements
+    elements.swap(other.elements);
+    return *this;
+}
 
-	case ')':
-	    if(!in_str) {
-		parens.pop();
-		if(parens.empty()) {
-		    return Just(str.substr(0, i + 1));
-		}
-	    }
-	    break;
+Sexp::~Sexp() {
+    // Move every descendant into one flat list before destroying it, so that
+    // each node is destroyed with no elements left to recurse into
+    std::list<Sexp> doomed;
+    doomed.splice(doomed.end(), elements);
+    while(!doomed.empty()) {
+	doomed.splice(doomed.end(), doomed.front().elements);
+	doomed.pop_front();
+    }
+}
 
-	case '"':
-	    if(last_char != '\\') {
-		in_str = !in_str;
+std::ostream& operator<<(std::ostream& os, const Sexp &s) {
+    if(s.isAtom) {
+        return os << s.atom;
+    }
+    // The lists being printed, innermost last, with their next element
+    typedef std::list<Sexp>::const_iterator Iter;
+    std::vector<std::pair<Iter, Iter>> open;
+    os << "(";
+    open.push_back(std::make_pair(s.elements.begin(), s.elements.end()));
+    while(!open.empty()) {
+	std::pair<Iter, Iter> &top = open.back();
+	if(top.first == top.second) {
+	    os << ")";
+	    open.pop_back();
+	    if(!open.empty()) {
+		os << " ";
 	    }
-	    break;
-
-	default:
-	    break;
+	    continue;
+        }
+	const Sexp &el = *top.first++;
+	if(el.isAtom) {
+	    os << el.atom << " ";
+	} else {
+	    os << "(";
+	    open.push_back(std::make_pair(el.elements.begin(),
+					  el.elements.end()));
 	}
-	last_char = c;
     }
-    return None<std::string>();
+    return os;
+}
+
+// Append the atom `token` to `list` if it is not empty, and clear it
+static void finish_token(std::string &token, Sexp &list) {
+    if(token != "") {
+	Sexp s;
+	s.isAtom = true;
+	s.atom = token;
+	list.elements.push_back(std::move(s));
+	token = "";
+    }
 }
 
+// Parse the given command string in a single pass. The lists that are still
+// open are kept on an explicit stack, so nesting depth is limited only by
+// memory.
+// Any text after the command's closing paren is ignored.
 Optional<Sexp> parse(std::string cmd) {
 
     if(cmd.size() < 1 || cmd[0] != '(') {
 	return None<Sexp>();
     }
-    std::list<Sexp> tokens;
+    // Lists that have been opened but not closed, innermost last
+    std::vector<Sexp> open;
     bool in_str = false;
     std::string token = "";
-    bool started_cmd = false;
     char last_char = ' ';
-    for (int i = 0; i < cmd.size(); ++i) {
+    for (size_t i = 0; i < cmd.size(); ++i) {
 	char c = cmd[i];
 	switch(c) {
 	case '(':
-	    if(!started_cmd) {
-		started_cmd = true;
+	    if(in_str) {
+		token += c;
 	    } else {
-		Optional<std::string> sexp_as_str = sexp_str(cmd.substr(i));
-		Optional<Sexp> sexp = sexp_as_str.flatMap(parse);
-		if(sexp.isEmpty()) {
-		    return None<Sexp>();
-		} else {
-		    tokens.push_back(sexp.get());
-		    i += sexp_as_str.get().size();
+		if(!open.empty()) {
+		    finish_token(token, open.back());
 		}
+		open.push_back(Sexp());
 	    }
 	    break;
 
 	case ')':
-	    if(started_cmd) {
-		// Reached end of cmd
-		if(token != "") {
-		    Sexp s;
-		    s.isAtom = true;
-		    s.atom = token;
-		    tokens.push_back(s);
+	    if(in_str) {
+		token += c;
+	    } else {
+		// Reached end of a list
+		finish_token(token, open.back());
+		Sexp s = std::move(open.back());
+		open.pop_back();
+		if(open.empty()) {
+		    return Just(s);
 		}
-		Sexp s;
-		s.isAtom = false;
-		s.elements = tokens;
-		return Just(s);
+		open.back().elements.push_back(std::move(s));
 	    }
 	    break;
 
 	case '"':
 	    if(last_char != '\\') {
-		Sexp s;
-		s.isAtom = true;
-		s.atom = token;
 		if(in_str) {
 		    in_str = false;
-		    tokens.push_back(s);
+		    Sexp s;
+		    s.isAtom = true;
+		    s.atom = token;
+		    open.back().elements.push_back(std::move(s));
 		    token = "";
 		} else {
-		    if(token != "") {
-			// need to finish prev token
-			tokens.push_back(s);
-			token = "";
-		    }
+		    // need to finish prev token
+		    finish_token(token, open.back());
 		    in_str = true;
 		}
 	    }
@@ -140,13 +179,7 @@ Optional<Sexp> parse(std::string cmd) {
 
 	case ' ':
 	    if(!in_str) {
-		if(token != "") {
-		    Sexp s;
-		    s.isAtom = true;
-		    s.atom = token;
-		    tokens.push_back(s);
-		    token = "";
-		}
+		finish_token(token, open.back());
 	    } else {
 		token += c;
 	    }
@@ -164,58 +197,1033 @@ Optional<Sexp> parse(std::string cmd) {
     return None<Sexp>();
 }
 
-Optional<std::string> interp_with(Sexp s, CommandSet commands) {
-    if(s.isAtom) {
-	return Just(s.atom);
+// A compiled command tree, used for macro bodies and `let` forms.
+// The tree is flattened into postfix instructions over a stack of values.
+// Variables and macro parameters are resolved to slots in a frame and
+// commands to their implementations when the tree is compiled, so running
+// it needs no name lookups: reading a variable is an index into the frame.
+struct Instruction {
+    enum Op {
+	LITERAL, // push `atom`
+	SLOT,    // push the value in `slot`
+	SET,     // store the top value in `slot`, leaving it on the stack
+	DROP,    // pop a value
+	CALL,    // pop `args` values and push `command`'s result
+	LOOKUP   // pop a command name and `args` values, push its result
+    };
+
+    Op op = LITERAL;
+    // LITERAL: the atom; CALL: the command name
+    std::string atom;
+    size_t slot = 0;
+    size_t args = 0;
+    const Command *command = nullptr;
+};
+
+struct Program {
+    std::vector<Instruction> code;
+    size_t frame_size = 0;
+    // Copies of the commands a macro body calls, so that it keeps working
+    // without the command set it was defined with
+    std::deque<Command> bound;
+};
+
+// Variables in scope while compiling, innermost last
+struct Scope {
+    std::vector<std::pair<std::string, size_t>> names;
+
+    Optional<size_t> find(const std::string &name) const {
+	for(size_t i = names.size(); i > 0; --i) {
+	    if(names[i - 1].first == name) {
+		return Just(names[i - 1].second);
+	    }
+	}
+	return None<size_t>();
+    }
+};
+
+// Frames of running code on this thread, allocated as one stack that is
+// reused across evaluations
+static thread_local std::vector<std::string> frame_arena;
+
+// Pushes a frame on the arena for the guard's lifetime
+class Frame {
+public:
+    explicit Frame(size_t size) : base(frame_arena.size()) {
+	frame_arena.resize(base + size);
+    }
+    ~Frame() { frame_arena.resize(base); }
+
+    std::string &operator[](size_t slot) { return frame_arena[base + slot]; }
+
+private:
+    size_t base;
+};
+
+ArgView::ArgView(std::string_view text)
+    : text(text), is_integer(false), integer(0), is_number(false), number(0) {
+    const char *first = text.data();
+    const char *last = first + text.size();
+    long long i;
+    std::from_chars_result r = std::from_chars(first, last, i);
+    if(r.ec == std::errc() && r.ptr == last && first != last) {
+	is_integer = true;
+	integer = i;
+    }
+    double d;
+    r = std::from_chars(first, last, d);
+    if(r.ec == std::errc() && r.ptr == last && first != last) {
+	is_number = true;
+	number = d;
+    }
+}
+
+// Call `command` with the evaluated `args` (a list of strings or a span of
+// views), turning the errors commands may throw into error results.
+// throws: DeadlineExceeded
+template<class Args>
+static std::string call_command(const Command &command,
+				const std::string &name,
+				Args args,
+				const CancelToken &token) {
+    try {
+	std::string result = command.call(args, token);
+	// Abandon results of commands that overran their budget
+	token.check();
+	return result;
+    } catch(const std::invalid_argument &e) {
+	return "Error: invalid argument: " + std::string(e.what());
+    } catch(const std::bad_function_call &e) {
+	return "Error: Command '" + name + "' undefined.";
+    }
+}
+
+// Look `name` up in `commands` and call it
+// throws: DeadlineExceeded
+static std::string lookup_and_call(const CommandSet &commands,
+				   const std::string &name,
+				   std::list<std::string> args,
+				   const CancelToken &token) {
+    CommandSet::const_iterator it = commands.find(name);
+    if(it == commands.end()) {
+	return "Error: Command '" + name + "' undefined.";
+    }
+    return call_command(it->second, name, args, token);
+}
+
+// Run a compiled program in `frame`. `commands` is only needed for LOOKUP
+// instructions, which macro bodies never contain.
+// throws: DeadlineExceeded
+static std::string run_program(const Program &program, Frame &frame,
+			       const CommandSet *commands,
+			       const CancelToken &token,
+			       const Checkpoint *at_node) {
+    std::vector<std::string> values;
+    for(const Instruction &ins : program.code) {
+	token.check();
+	if(at_node && *at_node) {
+	    (*at_node)();
+	}
+	switch(ins.op) {
+	case Instruction::LITERAL:
+	    values.push_back(ins.atom);
+	    break;
+
+	case Instruction::SLOT:
+	    values.push_back(frame[ins.slot]);
+	    break;
+
+	case Instruction::SET:
+	    frame[ins.slot] = values.back();
+	    break;
+
+	case Instruction::DROP:
+	    values.pop_back();
+	    break;
+
+	default: {
+	    size_t first = values.size() - ins.args
+		- (ins.op == Instruction::LOOKUP ? 1 : 0);
+	    std::list<std::string> args(
+		std::make_move_iterator(values.begin() + first),
+		std::make_move_iterator(values.end()));
+	    values.resize(first);
+	    if(ins.op == Instruction::CALL) {
+		values.push_back(call_command(*ins.command, ins.atom, args,
+					      token));
+	    } else {
+		std::string name = args.front();
+		args.pop_front();
+		values.push_back(lookup_and_call(*commands, name, args,
+						 token));
+	    }
+	}
+	}
+    }
+    return values.back();
+}
+
+// Compile `s` into `program`, returning an error message if it is invalid.
+// `scope` holds the variables that are already bound, such as macro
+// parameters.
+// In a `strict` compile (macro bodies) every command must be named literally
+// and exist, and a copy of it is kept in the program; otherwise unknown or
+// computed command names are looked up when the program runs, as the
+// interpreter would.
+static std::string compile(const Sexp &s, Scope scope,
+			   const CommandSet &commands, bool strict,
+			   Program &program) {
+    // Work still to do, next step last
+    struct Step {
+	enum Kind { COMPILE, EMIT, BIND, UNBIND };
+
+	Kind kind = COMPILE;
+	// COMPILE
+	const Sexp *sexp = nullptr;
+	// EMIT
+	Instruction ins;
+	// BIND: bring `name` into scope in `slot`; UNBIND: drop the
+	// innermost names until `slot` are left
+	std::string name;
+	size_t slot = 0;
+    };
+    std::vector<Step> todo;
+    std::vector<Step> steps;
+    Step step;
+    step.kind = Step::COMPILE;
+    step.sexp = &s;
+    todo.push_back(step);
+
+    while(!todo.empty()) {
+	step = todo.back();
+	todo.pop_back();
+	if(step.kind == Step::EMIT) {
+	    program.code.push_back(step.ins);
+	    continue;
+	} else if(step.kind == Step::BIND) {
+	    scope.names.push_back(std::make_pair(step.name, step.slot));
+	    continue;
+	} else if(step.kind == Step::UNBIND) {
+	    scope.names.resize(step.slot);
+	    continue;
+	}
+
+	const Sexp &node = *step.sexp;
+	Instruction ins;
+	if(node.isAtom) {
+	    Optional<size_t> slot = scope.find(node.atom);
+	    if(slot.isEmpty()) {
+		ins.op = Instruction::LITERAL;
+		ins.atom = node.atom;
+	    } else {
+		ins.op = Instruction::SLOT;
+		ins.slot = slot.get();
+	    }
+	    program.code.push_back(ins);
+	    continue;
+	}
+	if(node.elements.empty()) {
+	    return "empty command";
+	}
+	std::vector<const Sexp *> parts;
+	for(const Sexp &el : node.elements) {
+	    parts.push_back(&el);
+	}
+	const Sexp &head = *parts[0];
+
+	// The steps for this node, in order
+	steps.clear();
+	Step compile_step;
+	compile_step.kind = Step::COMPILE;
+	Step emit_step;
+	emit_step.kind = Step::EMIT;
+
+	if(head.isAtom && head.atom == "let") {
+	    // (let ((name value) ...) body...), binding in order
+	    if(parts.size() < 3 || parts[1]->isAtom) {
+		return "malformed let";
+	    }
+	    for(const Sexp &binding : parts[1]->elements) {
+		if(binding.isAtom || binding.elements.size() != 2
+		   || !binding.elements.front().isAtom) {
+		    return "malformed let binding";
+		}
+		size_t slot = program.frame_size++;
+		compile_step.sexp = &binding.elements.back();
+		steps.push_back(compile_step);
+		emit_step.ins.op = Instruction::SET;
+		emit_step.ins.slot = slot;
+		steps.push_back(emit_step);
+		emit_step.ins.op = Instruction::DROP;
+		steps.push_back(emit_step);
+		Step bind;
+		bind.kind = Step::BIND;
+		bind.name = binding.elements.front().atom;
+		bind.slot = slot;
+		steps.push_back(bind);
+	    }
+	    for(size_t i = 2; i < parts.size(); ++i) {
+		compile_step.sexp = parts[i];
+		steps.push_back(compile_step);
+		if(i + 1 < parts.size()) {
+		    emit_step.ins.op = Instruction::DROP;
+		    steps.push_back(emit_step);
+		}
+	    }
+	    Step unbind;
+	    unbind.kind = Step::UNBIND;
+	    unbind.slot = scope.names.size();
+	    steps.push_back(unbind);
+	} else if(head.isAtom && head.atom == "set!") {
+	    // (set! name value)
+	    if(parts.size() != 3 || !parts[1]->isAtom) {
+		return "malformed set!";
+	    }
+	    Optional<size_t> slot = scope.find(parts[1]->atom);
+	    if(slot.isEmpty()) {
+		return "unbound variable '" + parts[1]->atom + "'";
+	    }
+	    compile_step.sexp = parts[2];
+	    steps.push_back(compile_step);
+	    emit_step.ins.op = Instruction::SET;
+	    emit_step.ins.slot = slot.get();
+	    steps.push_back(emit_step);
+	} else {
+	    CommandSet::const_iterator it = commands.end();
+	    if(head.isAtom && scope.find(head.atom).isEmpty()) {
+		it = commands.find(head.atom);
+	    }
+	    size_t first_arg = 1;
+	    emit_step.ins.args = parts.size() - 1;
+	    if(it != commands.end()) {
+		emit_step.ins.op = Instruction::CALL;
+		emit_step.ins.atom = head.atom;
+		if(strict) {
+		    program.bound.push_back(it->second);
+		    emit_step.ins.command = &program.bound.back();
+		} else {
+		    emit_step.ins.command = &it->second;
+		}
+	    } else if(strict) {
+		if(head.isAtom && scope.find(head.atom).isEmpty()) {
+		    return "Command '" + head.atom + "' undefined";
+		}
+		return "command names in a macro body must be literal";
+	    } else {
+		emit_step.ins.op = Instruction::LOOKUP;
+		first_arg = 0;
+	    }
+	    for(size_t i = first_arg; i < parts.size(); ++i) {
+		compile_step.sexp = parts[i];
+		steps.push_back(compile_step);
+	    }
+	    steps.push_back(emit_step);
+	}
+	todo.insert(todo.end(), steps.rbegin(), steps.rend());
+    }
+    return "";
+}
+
+// Compile and run a `let` or `set!` form met during interpretation.
+// Only `let` can bind variables, so a `set!` outside one is an error.
+// throws: DeadlineExceeded
+static std::string interp_let(const Sexp &s, const CommandSet &commands,
+			      const CancelToken &token,
+			      const Checkpoint &at_node) {
+    Program program;
+    program.frame_size = 0;
+    std::string error = compile(s, Scope(), commands, false, program);
+    if(error != "") {
+	return "Error: " + error + ".";
+    }
+    Frame frame(program.frame_size);
+    return run_program(program, frame, &commands, token, &at_node);
+}
+
+// Is `s` a special form headed by `name`?
+static bool is_form(const Sexp &s, const char *name) {
+    return !s.isAtom && !s.elements.empty() && s.elements.front().isAtom
+	&& s.elements.front().atom == name;
+}
+
+// The stacks of the evaluations running on a thread. They are reused by
+// every evaluation, so once they have grown to fit the commands being run,
+// evaluating makes no allocations of its own. An evaluation started by a
+// command (e.g. one that runs a script) stacks on top of the one calling it.
+struct EvalStacks {
+    // A list being evaluated
+    struct Level {
+	std::list<Sexp>::const_iterator next;
+	std::list<Sexp>::const_iterator end;
+	// Where the values of its elements start in `values`
+	size_t base;
+    };
+    std::vector<Level> levels;
+    // The values of the elements evaluated so far. Only the first `used`
+    // are live; the rest keep their buffers for reuse. A deque never moves
+    // its elements, so views of them stay valid as it grows.
+    std::deque<std::string> values;
+    size_t used = 0;
+    // Argument views for the view commands being called, one buffer per
+    // nested call
+    std::deque<std::vector<ArgView>> views;
+    size_t views_used = 0;
+
+    // The next free value, to be assigned to
+    std::string &push() {
+	if(used == values.size()) {
+	    values.emplace_back();
+	}
+	return values[used++];
+    }
+};
+
+static thread_local EvalStacks eval_stacks;
+
+// Restores the stacks to how an evaluation found them, however it ends
+class StackMark {
+public:
+    explicit StackMark(EvalStacks &stacks)
+	: stacks(stacks), levels(stacks.levels.size()), used(stacks.used),
+	  views_used(stacks.views_used) {}
+
+    ~StackMark() {
+	stacks.levels.resize(levels);
+	stacks.used = used;
+	stacks.views_used = views_used;
+    }
+
+private:
+    EvalStacks &stacks;
+    size_t levels;
+    size_t used;
+    size_t views_used;
+};
+
+// Call the command named by values[base] with the values after it, leaving
+// the result in values[base]. View commands get views of the values in place.
+// throws: DeadlineExceeded
+static void call_from_stack(EvalStacks &stacks, const CommandSet &commands,
+			    size_t base, const CancelToken &token) {
+    const std::string &name = stacks.values[base];
+    size_t argc = stacks.used - base - 1;
+    std::string result;
+    CommandSet::const_iterator it = commands.find(name);
+    if(it == commands.end()) {
+	result = "Error: Command '" + name + "' undefined.";
+    } else if(it->second.takes_views()) {
+	if(stacks.views_used == stacks.views.size()) {
+	    stacks.views.emplace_back();
+	}
+	std::vector<ArgView> &views = stacks.views[stacks.views_used++];
+	views.resize(argc);
+	for(size_t i = 0; i < argc; i++) {
+	    views[i] = ArgView(stacks.values[base + 1 + i]);
+	}
+	result = call_command(it->second, name,
+			      std::span<const ArgView>(views), token);
+	stacks.views_used--;
     } else {
-	std::list<Sexp> elements = s.elements;
-	std::list<std::string> element_strs;
-	for(Sexp s : elements) {
-	    Optional<std::string> element = interp_with(s, commands);
-	    if(element.isEmpty()) {
+	std::list<std::string> args(stacks.values.begin() + base + 1,
+				    stacks.values.begin() + stacks.used);
+	result = call_command(it->second, name, args, token);
+    }
+    stacks.values[base].swap(result);
+    stacks.used = base + 1;
+}
+
+// Interpret `s`, checking `token` and running `at_node` before every node.
+// The lists being evaluated are kept on the thread's evaluation stacks,
+// along with the values of the elements evaluated so far.
+// throws: DeadlineExceeded
+static Optional<std::string> interp_checked(const Sexp &s,
+					    const CommandSet &commands,
+					    const CancelToken &token,
+					    const Checkpoint &at_node) {
+    EvalStacks &stacks = eval_stacks;
+    StackMark mark(stacks);
+    size_t bottom = stacks.levels.size();
+    // The node to evaluate next
+    const Sexp *node = &s;
+
+    while(true) {
+	if(node) {
+	    token.check();
+	    if(at_node) {
+		at_node();
+	    }
+	    if(node->isAtom) {
+		stacks.push() = node->atom;
+	    } else if(is_form(*node, "let") || is_form(*node, "set!")) {
+		std::string result = interp_let(*node, commands, token,
+						at_node);
+		stacks.push().swap(result);
+	    } else if(node->elements.empty()) {
 		std::cout << "Error: element fails interp: "
-			  << s << std::endl;
+			  << *node << std::endl;
 		return None<std::string>();
+	    } else {
+		EvalStacks::Level level;
+		level.next = node->elements.begin();
+		level.end = node->elements.end();
+		level.base = stacks.used;
+		stacks.levels.push_back(level);
+		node = &*stacks.levels.back().next++;
+		continue;
+	    }
+	} else {
+	    // Every element of the innermost list has been evaluated
+	    size_t base = stacks.levels.back().base;
+	    stacks.levels.pop_back();
+	    call_from_stack(stacks, commands, base, token);
+	}
+
+	if(stacks.levels.size() == bottom) {
+	    return Just(stacks.values[stacks.used - 1]);
+	}
+	EvalStacks::Level &parent = stacks.levels.back();
+	node = parent.next == parent.end ? nullptr : &*parent.next++;
+    }
+}
+
+// Check and compile a top-level `defmacro` or `alias` form, handing the
+// resulting command to `define`
+static Optional<std::string> interp_definition(const Sexp &s,
+					       const CommandSet &commands,
+					       const Definer &define) {
+    const std::string &form = s.elements.front().atom;
+    std::vector<Sexp> parts(s.elements.begin(), s.elements.end());
+    if(parts.size() != (form == "defmacro" ? 4 : 3) || !parts[1].isAtom) {
+	return Just("Error: malformed " + form + ".");
+    }
+    const std::string &name = parts[1].atom;
+    CommandSet::const_iterator existing = commands.find(name);
+    if(name == "defmacro" || name == "alias"
+       || (existing != commands.end() && !existing->second.is_definition())) {
+	return Just("Error: cannot redefine command '" + name + "'.");
+    }
+    if(!define) {
+	return Just("Error: " + form + " is not supported here.");
+    }
+
+    if(form == "alias") {
+	const Sexp &target = parts[2];
+	CommandSet::const_iterator it =
+	    target.isAtom ? commands.find(target.atom) : commands.end();
+	if(it == commands.end()) {
+	    return Just("Error: alias: Command '" + target.atom
+			+ "' undefined.");
+	}
+	define(name, it->second.as_definition());
+	return Just(name);
+    }
+
+    std::vector<std::string> params;
+    if(parts[2].isAtom) {
+	return Just(std::string("Error: defmacro: malformed parameters."));
+    }
+    for(const Sexp &param : parts[2].elements) {
+	if(!param.isAtom) {
+	    return Just(std::string("Error: defmacro: malformed parameters."));
+	}
+	for(const std::string &other : params) {
+	    if(other == param.atom) {
+		return Just("Error: defmacro: duplicate parameter '"
+			    + param.atom + "'.");
+	    }
+	}
+	params.push_back(param.atom);
+    }
+    // Parameters take the first slots of the macro's frame
+    Scope scope;
+    for(size_t i = 0; i < params.size(); ++i) {
+	scope.names.push_back(std::make_pair(params[i], i));
+    }
+    std::shared_ptr<Program> body = std::make_shared<Program>();
+    body->frame_size = params.size();
+    std::string error = compile(parts[3], scope, commands, true, *body);
+    if(error != "") {
+	return Just("Error: defmacro: " + error + ".");
+    }
+
+    size_t arity = params.size();
+    Command macro = [body, arity, name](
+	std::list<std::string> args, const CancelToken &token) {
+	if(args.size() != arity) {
+	    throw std::invalid_argument(name + " takes "
+					+ std::to_string(arity)
+					+ " arguments");
+	}
+	Frame frame(body->frame_size);
+	size_t slot = 0;
+	for(std::string &arg : args) {
+	    frame[slot++].swap(arg);
+	}
+	return run_program(*body, frame, nullptr, token, nullptr);
+    };
+    define(name, macro.as_definition());
+    return Just(name);
+}
+
+Optional<std::string> interp_with(const Sexp &s,
+				  const CommandSet &commands) {
+    return interp_with(s, commands, CancelToken::never());
+}
+
+Optional<std::string> interp_with(const Sexp &s,
+				  const CommandSet &commands,
+				  CancelToken token) {
+    return interp_with(s, commands, token, Checkpoint());
+}
+
+Optional<std::string> interp_with(const Sexp &s,
+				  const CommandSet &commands,
+				  CancelToken token, Checkpoint at_node) {
+    return interp_with(s, commands, token, at_node, Definer());
+}
+
+Optional<std::string> interp_with(const Sexp &s,
+				  const CommandSet &commands,
+				  CancelToken token, Checkpoint at_node,
+				  Definer define) {
+    if(!s.isAtom && !s.elements.empty() && s.elements.front().isAtom
+       && (s.elements.front().atom == "defmacro"
+	   || s.elements.front().atom == "alias")) {
+	return interp_definition(s, commands, define);
+    }
+    try {
+	return interp_checked(s, commands, token, at_node);
+    } catch(const DeadlineExceeded &e) {
+	return Just(std::string("Error: deadline exceeded."));
+    }
+}
+
+bool interp_to(const Sexp &s, const CommandSet &commands, ChunkWriter &out,
+	       CancelToken token) {
+    if(s.isAtom || s.elements.empty() || is_form(s, "let")
+       || is_form(s, "set!") || is_form(s, "defmacro") || is_form(s, "alias")) {
+	Optional<std::string> result = interp_with(s, commands, token);
+	if(result.isEmpty()) {
+	    return false;
+	}
+	out.write(result.get());
+	return true;
+    }
+    try {
+	token.check();
+	std::list<std::string> element_strs;
+	for(const Sexp &el : s.elements) {
+	    Optional<std::string> element = interp_checked(el, commands, token,
+							   Checkpoint());
+	    if(element.isEmpty()) {
+		return false;
 	    }
 	    element_strs.push_back(element.get());
 	}
 	std::string command = element_strs.front();
 	element_strs.pop_front();
+	CommandSet::const_iterator it = commands.find(command);
+	if(it == commands.end()) {
+	    out.write("Error: Command '" + command + "' undefined.");
+	    return true;
+	}
 	try {
-	    return Just(commands[command](element_strs));
+	    it->second.call_into(element_strs, out, token);
+	    token.check();
 	} catch(const std::invalid_argument &e) {
-	    return Just("Error: invalid argument: " + std::string(e.what()));
+	    out.write("Error: invalid argument: " + std::string(e.what()));
 	} catch(const std::bad_function_call &e) {
-	    return Just("Error: Command '" + command + "' undefined.");
+	    out.write("Error: Command '" + command + "' undefined.");
 	}
+    } catch(const DeadlineExceeded &e) {
+	out.write(std::string("Error: deadline exceeded."));
     }
+    return true;
+}
+
+// The command set of an interpreter made by make_interpreter, shared by its
+// copies. Definitions replace the set rather than change it, so that copies
+// running on other threads keep using the set they started with. Reading
+// the set takes no lock; only definitions are serialized.
+struct DefinedTable {
+    std::atomic<std::shared_ptr<const CommandSet>> commands;
+    // Serializes definitions, so that none is lost to another's copy
+    std::mutex lock;
+
+    std::shared_ptr<const CommandSet> current() const {
+	return commands.load();
+    }
+
+    void define(std::string name, Command command) {
+	std::lock_guard<std::mutex> guard(lock);
+	std::shared_ptr<CommandSet> next =
+	    std::make_shared<CommandSet>(*commands.load());
+	(*next)[name] = command;
+	commands.store(next);
+    }
+};
+
+static std::shared_ptr<DefinedTable> defined_table(CommandSet commands) {
+    std::shared_ptr<DefinedTable> table = std::make_shared<DefinedTable>();
+    table->commands.store(
+	std::make_shared<const CommandSet>(std::move(commands)));
+    return table;
+}
+
+static Definer define_into(std::shared_ptr<DefinedTable> table) {
+    return [table](std::string name, Command command) {
+	table->define(name, command);
+    };
 }
 
 std::function<Optional<std::string>(Sexp)>
 make_interpreter(CommandSet commands) {
-    return [commands](Sexp s) {
-	return interp_with(s, commands);
+    std::shared_ptr<DefinedTable> table = defined_table(commands);
+    Definer define = define_into(table);
+    return [table, define](Sexp s) {
+	return interp_with(s, *table->current(), CancelToken::never(),
+			   Checkpoint(), define);
     };
 }
 
-std::string serialize(Sexp s) {
-    std::stringstream ss;
+std::function<Optional<std::string>(Sexp)>
+make_interpreter(CommandSet commands, CancelToken::Clock::duration budget) {
+    std::shared_ptr<DefinedTable> table = defined_table(commands);
+    Definer define = define_into(table);
+    return [table, define, budget](Sexp s) {
+	return interp_with(s, *table->current(), CancelToken::after(budget),
+			   Checkpoint(), define);
+    };
+}
+
+// A stack that keeps its first N entries inline, so that walking commands
+// nested less than N lists deep makes no heap allocation
+template<class T, size_t N>
+class SmallStack {
+public:
+    SmallStack() : count(0) {}
+
+    bool empty() const { return count == 0; }
+
+    T &back() { return count <= N ? fixed[count - 1] : spilled.back(); }
+
+    void push(const T &value) {
+	if(count < N) {
+	    fixed[count] = value;
+	} else {
+	    spilled.push_back(value);
+	}
+	count++;
+    }
+
+    void pop() {
+	if(count > N) {
+	    spilled.pop_back();
+	}
+	count--;
+    }
+
+private:
+    T fixed[N];
+    std::vector<T> spilled;
+    size_t count;
+};
+
+// Call `visit` on every node of `s` in pre-order, from an explicit stack
+template<class F>
+static void preorder(const Sexp &s, F visit) {
+    typedef std::list<Sexp>::const_iterator Iter;
+    SmallStack<std::pair<Iter, Iter>, 64> open;
+    visit(s);
+    open.push(std::make_pair(s.elements.cbegin(), s.elements.cend()));
+    while(!open.empty()) {
+	std::pair<Iter, Iter> &top = open.back();
+	if(top.first == top.second) {
+	    open.pop();
+	    continue;
+	}
+	const Sexp &el = *top.first++;
+	visit(el);
+	if(!el.elements.empty()) {
+	    open.push(std::make_pair(el.elements.cbegin(),
+				     el.elements.cend()));
+	}
+    }
+}
+
+// Copy `value` to `out` in native byte order, as cereal's binary archive
+// would
+template<class T>
+static std::byte *put(std::byte *out, T value) {
+    memcpy(out, &value, sizeof(T));
+    return out + sizeof(T);
+}
 
-    {
-	cereal::BinaryOutputArchive oarchive(ss); // Create an output archive
+// The size of one node's own fields in cereal's binary layout: `isAtom`,
+// then the atom and the element count, each size as a cereal::size_type
+static const size_t EMPTY_NODE = sizeof(bool)
+    + 2 * sizeof(cereal::size_type);
 
-	oarchive(s); // Write the data to the archive
-    } // archive goes out of scope, ensuring all contents are flushed
+static size_t node_size(const Sexp &s) {
+    return EMPTY_NODE + s.atom.size();
+}
 
-    return ss.str();
+size_t serialized_size(const Sexp &s) {
+    size_t size = 0;
+    preorder(s, [&size](const Sexp &node) {
+	size += node_size(node);
+    });
+    return size;
 }
 
-Sexp deserialize(std::string str) {
-    std::stringstream ss(str);
+// The output is byte-for-byte what cereal::BinaryOutputArchive produces for
+// a Sexp, but nodes are written from an explicit stack instead of by
+// recursion.
+size_t serialize_into(const Sexp &s, std::span<std::byte> out) {
+    size_t size = serialized_size(s);
+    if(size > out.size()) {
+	return 0;
+    }
+    std::byte *pos = out.data();
+    preorder(s, [&pos](const Sexp &node) {
+	pos = put(pos, node.isAtom);
+	pos = put(pos, static_cast<cereal::size_type>(node.atom.size()));
+	memcpy(pos, node.atom.data(), node.atom.size());
+	pos += node.atom.size();
+	pos = put(pos, static_cast<cereal::size_type>(node.elements.size()));
+    });
+    return size;
+}
+
+std::string serialize(const Sexp &s) {
+    std::string out(serialized_size(s), '\0');
+    serialize_into(s, std::as_writable_bytes(std::span<char>(out)));
+    return out;
+}
+
+// Reads fields from a serialized command
+class Reader {
+public:
+    explicit Reader(const std::string &str) : str(str), pos(0) {}
+
+    // throws: cereal::Exception if the input is too short
+    template<class T>
+    T get() {
+	T value;
+	memcpy(&value, take(sizeof(T)), sizeof(T));
+	return value;
+    }
+
+    // The number of bytes not yet read
+    size_t remaining() const { return str.size() - pos; }
+
+    // throws: cereal::Exception if the input is too short
+    const char *take(size_t size) {
+	if(size > str.size() - pos) {
+	    throw cereal::Exception("Failed to read " + std::to_string(size)
+				    + " bytes from input stream! Read "
+				    + std::to_string(str.size() - pos));
+	}
+	const char *data = str.data() + pos;
+	pos += size;
+	return data;
+    }
+
+private:
+    const std::string &str;
+    size_t pos;
+};
+
+// Read one node's own fields, returning its element count
+static cereal::size_type get_node(Reader &in, Sexp &s) {
+    s.isAtom = in.get<bool>();
+    cereal::size_type size = in.get<cereal::size_type>();
+    s.atom.assign(in.take(size), size);
+    return in.get<cereal::size_type>();
+}
+
+// Read a whole command, using `get_node` to read each node's own fields,
+// tracking the lists still being filled on an explicit stack. `get_node` is
+// also given the node's depth, 0 for the command itself.
+template<class GetNode>
+static Sexp read_tree(Reader &in, GetNode get_node) {
     Sexp sexp;
-    {
-	cereal::BinaryInputArchive iarchive(ss);
-	iarchive(sexp);
+    // Lists being filled, innermost last, with their remaining element count
+    std::vector<std::pair<Sexp *, cereal::size_type>> open;
+    open.push_back(std::make_pair(&sexp, get_node(in, sexp, 0)));
+    while(!open.empty()) {
+	if(open.back().second == 0) {
+	    open.pop_back();
+	    continue;
+	}
+	open.back().second--;
+	Sexp *parent = open.back().first;
+	parent->elements.push_back(Sexp());
+	Sexp &el = parent->elements.back();
+	cereal::size_type count = get_node(in, el, open.size());
+	if(count > 0) {
+	    open.push_back(std::make_pair(&el, count));
+	}
     }
     return sexp;
 }
+
+// Reads the format written by `serialize` (and cereal::BinaryOutputArchive)
+// throws: cereal::Exception if the input is truncated
+Sexp deserialize(std::string str) {
+    Reader in(str);
+    return read_tree(in, [](Reader &in, Sexp &s, size_t) {
+	return get_node(in, s);
+    });
+}
+
+// Throw a cereal::Exception for a frame that breaks a limit
+[[noreturn]] static void reject(const std::string &why) {
+    throw cereal::Exception("Frame rejected: " + why);
+}
+
+// Like `deserialize`, checking each length against the limits and the bytes
+// left before anything is allocated for it. Each element of a list takes at
+// least an empty node's bytes, so no list can claim more elements than the
+// rest of the frame could hold, and the work done is linear in the frame's
+// size.
+Sexp deserialize_bounded(const std::string &str, const FrameLimits &limits) {
+    if(str.size() > limits.max_frame) {
+	reject("frame of " + std::to_string(str.size()) + " bytes");
+    }
+    Reader in(str);
+    size_t nodes = 0;
+    Sexp sexp = read_tree(in, [&](Reader &in, Sexp &s, size_t depth) {
+	if(++nodes > limits.max_nodes) {
+	    reject("more than " + std::to_string(limits.max_nodes)
+		   + " nodes");
+	}
+	if(depth > limits.max_depth) {
+	    reject("nested more than " + std::to_string(limits.max_depth)
+		   + " deep");
+	}
+	unsigned char is_atom = *in.take(1);
+	if(is_atom > 1) {
+	    reject("bad atom flag " + std::to_string(is_atom));
+	}
+	s.isAtom = is_atom;
+	cereal::size_type size = in.get<cereal::size_type>();
+	if(size > limits.max_atom || size > in.remaining()) {
+	    reject("atom of " + std::to_string(size) + " bytes");
+	}
+	s.atom.assign(in.take(size), size);
+	cereal::size_type count = in.get<cereal::size_type>();
+	if(count > in.remaining() / EMPTY_NODE
+	   || count > limits.max_nodes - nodes) {
+	    reject("list of " + std::to_string(count) + " elements");
+	}
+	return count;
+    });
+    if(in.remaining() > 0) {
+	reject(std::to_string(in.remaining()) + " trailing bytes");
+    }
+    return sexp;
+}
+
+// Copy `value` to `out` as little-endian
+template<bool Memcpy>
+static std::byte *put_le(std::byte *out, uint64_t value) {
+    if constexpr(Memcpy) {
+	memcpy(out, &value, sizeof(value));
+    } else {
+	for(size_t i = 0; i < sizeof(value); ++i) {
+	    out[i] = std::byte(value >> (8 * i));
+	}
+    }
+    return out + sizeof(value);
+}
+
+// Read a little-endian value
+template<bool Memcpy>
+static uint64_t get_le(Reader &in) {
+    const char *bytes = in.take(sizeof(uint64_t));
+    uint64_t value = 0;
+    if constexpr(Memcpy) {
+	memcpy(&value, bytes, sizeof(value));
+    } else {
+	for(size_t i = 0; i < sizeof(value); ++i) {
+	    value |= (uint64_t)(unsigned char)bytes[i] << (8 * i);
+	}
+    }
+    return value;
+}
+
+// The portable format is that of cereal::PortableBinaryOutputArchive set to
+// little-endian: a byte of 1 for little-endian, then the same fields as
+// `serialize`, with one byte for `isAtom` and eight for each length
+static const size_t PORTABLE_NODE = 1 + 2 * sizeof(uint64_t);
+
+size_t serialized_portable_size(const Sexp &s) {
+    size_t size = 1;
+    preorder(s, [&size](const Sexp &node) {
+	size += PORTABLE_NODE + node.atom.size();
+    });
+    return size;
+}
+
+template<bool Memcpy>
+size_t portable::serialize_into(const Sexp &s, std::span<std::byte> out) {
+    size_t size = serialized_portable_size(s);
+    if(size > out.size()) {
+	return 0;
+    }
+    std::byte *pos = out.data();
+    *pos++ = std::byte(1);
+    preorder(s, [&pos](const Sexp &node) {
+	*pos++ = std::byte(node.isAtom);
+	pos = put_le<Memcpy>(pos, node.atom.size());
+	memcpy(pos, node.atom.data(), node.atom.size());
+	pos += node.atom.size();
+	pos = put_le<Memcpy>(pos, node.elements.size());
+    });
+    return size;
+}
+
+template<bool Memcpy>
+Sexp portable::deserialize(const std::string &str) {
+    Reader in(str);
+    if(*in.take(1) != 1) {
+	throw cereal::Exception("Portable command is not little-endian");
+    }
+    return read_tree(in, [](Reader &in, Sexp &s, size_t) {
+	s.isAtom = *in.take(1) != 0;
+	uint64_t size = get_le<Memcpy>(in);
+	s.atom.assign(in.take(size), size);
+	return get_le<Memcpy>(in);
+    });
+}
+
+template size_t portable::serialize_into<true>(const Sexp &,
+					       std::span<std::byte>);
+template size_t portable::serialize_into<false>(const Sexp &,
+						std::span<std::byte>);
+template Sexp portable::deserialize<true>(const std::string &);
+template Sexp portable::deserialize<false>(const std::string &);
+
+size_t serialize_portable_into(const Sexp &s, std::span<std::byte> out) {
+    return portable::serialize_into<portable::MEMCPY>(s, out);
+}
+
+std::string serialize_portable(const Sexp &s) {
+    std::string out(serialized_portable_size(s), '\0');
+    serialize_portable_into(s, std::as_writable_bytes(std::span<char>(out)));
+    return out;
+}
+
+Sexp deserialize_portable(const std::string &str) {
+    return portable::deserialize<portable::MEMCPY>(str);
+}
+
+void portable::put_u64(std::byte *out, uint64_t value) {
+    put_le<MEMCPY>(out, value);
+}
+
+uint64_t portable::get_u64(const std::string &str) {
+    Reader in(str);
+    return get_le<MEMCPY>(in);
+}
@@ -6,45 +6,472 @@
 #include "cereal/types/list.hpp"
 #include "cereal/types/string.hpp"
 
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <cstddef>
 #include <functional>
 #include <list>
 #include <map>
+#include <memory>
+#include <span>
+#include <stdexcept>
 #include <string>
+#include <string_view>
 #include <iostream>
+#include <type_traits>
+#include <vector>
 
+// A parsed command: either an atom or a list of elements.
+// Copying and destroying a Sexp walk the tree with explicit stacks, so
+// arbitrarily deep trees are safe on small thread stacks.
 class Sexp {
 public:
     bool isAtom;
     std::string atom;
     std::list<Sexp> elements;
 
+    Sexp() : isAtom(false) {}
+    Sexp(const Sexp &other);
+    Sexp(Sexp &&other) noexcept;
+    Sexp &operator=(const Sexp &other);
+    Sexp &operator=(Sexp &&other) noexcept;
+    ~Sexp();
+
+    // For archiving a Sexp with other cereal archives. This recurses once
+    // per nesting level; `serialize` and `deserialize` below do not.
     template<class Archive>
     void serialize(Archive &archive) {
         archive(isAtom, atom, elements);
     }
 };
 
-typedef std::map<std::string,
-                 std::function<std::string(std::list<std::string>)>> CommandSet;
+// Thrown by CancelToken::check once the token is cancelled or past its
+// deadline. The interpreter turns it into a timeout error for the whole
+// evaluation.
+class DeadlineExceeded : public std::runtime_error {
+public:
+    DeadlineExceeded() : std::runtime_error("deadline exceeded") {}
+};
+
+// A cancellation token shared by an evaluation and the commands it runs.
+// The interpreter checks it between node evaluations; long-running commands
+// should call `check` (or poll `expired`) themselves so that they can be
+// abandoned cooperatively.
+// Copies share the same cancellation flag.
+class CancelToken {
+public:
+    typedef std::chrono::steady_clock Clock;
+
+    // A token with no deadline; it only expires if cancelled
+    CancelToken()
+        : cancelled(std::make_shared<std::atomic<bool>>(false)),
+          has_deadline(false) {}
+
+    // A token that never expires. Unlike a default token it cannot be
+    // cancelled, and making one does not allocate.
+    static CancelToken never() {
+        return CancelToken(std::shared_ptr<std::atomic<bool>>());
+    }
+
+    // A token that expires once `budget` has elapsed from now
+    static CancelToken after(Clock::duration budget) {
+        return at(Clock::now() + budget);
+    }
+
+    // A token that expires at the given time
+    static CancelToken at(Clock::time_point deadline) {
+        CancelToken token;
+        token.deadline = deadline;
+        token.has_deadline = true;
+        return token;
+    }
+
+    // Cancel this token (and every copy of it) immediately
+    void cancel() const {
+        if(cancelled) {
+            cancelled->store(true, std::memory_order_relaxed);
+        }
+    }
+
+    // Has this token been cancelled or run past its deadline?
+    bool expired() const {
+        return (cancelled && cancelled->load(std::memory_order_relaxed))
+            || (has_deadline && Clock::now() >= deadline);
+    }
+
+    // throws: DeadlineExceeded
+    void check() const {
+        if(expired()) {
+            throw DeadlineExceeded();
+        }
+    }
+
+private:
+    explicit CancelToken(std::shared_ptr<std::atomic<bool>> cancelled)
+        : cancelled(cancelled), has_deadline(false) {}
+
+    std::shared_ptr<std::atomic<bool>> cancelled;
+    Clock::time_point deadline;
+    bool has_deadline;
+};
+
+// A destination for command output that is written in chunks as it is
+// produced, e.g. a file, a socket or a downlink buffer (see sink.hpp)
+class ChunkWriter {
+public:
+    virtual ~ChunkWriter() {}
+
+    virtual void write(const char *data, size_t size) = 0;
+
+    void write(const std::string &chunk) { write(chunk.data(), chunk.size()); }
+};
+
+// Collects chunks into a string
+class StringWriter : public ChunkWriter {
+public:
+    void write(const char *data, size_t size) { str.append(data, size); }
+    using ChunkWriter::write;
+
+    std::string str;
+};
+
+// One evaluated argument as seen by a view command. `text` points into the
+// interpreter's own argument buffers and is only valid during the call.
+// Numeric arguments are decoded once, by the interpreter.
+struct ArgView {
+    std::string_view text;
+    // Is the whole text a decimal integer?
+    bool is_integer;
+    long long integer;
+    // Is the whole text a number? (Integers are numbers too.)
+    bool is_number;
+    double number;
+
+    ArgView() : is_integer(false), integer(0), is_number(false), number(0) {}
+    explicit ArgView(std::string_view text);
+};
+
+// The kinds of value a command argument can be required to have
+enum class ArgType { Any, Integer, Number, Choice };
+
+// What one command argument must look like
+struct ArgSchema {
+    // Used in diagnostics
+    std::string name;
+    ArgType type;
+    // Inclusive bounds for Integer and Number arguments
+    bool has_range;
+    double min;
+    double max;
+    // The values allowed for a Choice argument
+    std::vector<std::string> choices;
+
+    static ArgSchema any(std::string name) {
+        return ArgSchema{name, ArgType::Any, false, 0, 0, {}};
+    }
+
+    static ArgSchema integer(std::string name) {
+        return ArgSchema{name, ArgType::Integer, false, 0, 0, {}};
+    }
+
+    static ArgSchema integer(std::string name, long long min, long long max) {
+        return ArgSchema{name, ArgType::Integer, true, (double)min,
+                         (double)max, {}};
+    }
+
+    static ArgSchema number(std::string name) {
+        return ArgSchema{name, ArgType::Number, false, 0, 0, {}};
+    }
+
+    static ArgSchema number(std::string name, double min, double max) {
+        return ArgSchema{name, ArgType::Number, true, min, max, {}};
+    }
+
+    static ArgSchema one_of(std::string name,
+                            std::vector<std::string> choices) {
+        return ArgSchema{name, ArgType::Choice, false, 0, 0, choices};
+    }
+};
+
+// The arguments a command takes, checked by a PlanChecker (see schema.hpp).
+// If `variadic`, the last argument may be repeated any number of times,
+// including none.
+struct Schema {
+    std::vector<ArgSchema> args;
+    bool variadic = false;
+};
+
+// The supported command signatures: plain commands, commands that take the
+// evaluation's cancellation token so that they can give up early, sink
+// commands that write large results to a ChunkWriter as they produce them
+// instead of returning them, and view commands that read their arguments in
+// place instead of receiving copies.
+typedef std::function<std::string(std::list<std::string>)> CommandFn;
+typedef std::function<std::string(std::list<std::string>,
+                                  const CancelToken &)> CancellableCommandFn;
+typedef std::function<void(std::list<std::string>, ChunkWriter &,
+                           const CancelToken &)> SinkCommandFn;
+typedef std::function<std::string(std::span<const ArgView>)> ViewCommandFn;
+
+// A command implementation. Any signature above converts implicitly, so
+// commands are still added with `commands["name"] = fn;`.
+class Command {
+public:
+    Command() : defined(false) {}
+
+    template<class F>
+    Command(F f,
+            typename std::enable_if<std::is_constructible<CommandFn, F>::value
+                                    >::type* = 0)
+        : fn(wrap(CommandFn(f))), defined(false) {}
+
+    template<class F>
+    Command(F f,
+            typename std::enable_if<
+                std::is_constructible<CancellableCommandFn, F>::value
+                && !std::is_constructible<CommandFn, F>::value
+                >::type* = 0)
+        : fn(f), defined(false) {}
+
+    template<class F>
+    Command(F f,
+            typename std::enable_if<
+                std::is_constructible<SinkCommandFn, F>::value>::type* = 0)
+        : fn(collect(SinkCommandFn(f))), sink(f), defined(false) {}
+
+    template<class F>
+    Command(F f,
+            typename std::enable_if<
+                std::is_constructible<ViewCommandFn, F>::value>::type* = 0)
+        : fn(unview(ViewCommandFn(f))), view(f), defined(false) {}
+
+    // throws: std::bad_function_call if the command is empty
+    std::string call(std::list<std::string> args,
+                     const CancelToken &token) const {
+        return fn(args, token);
+    }
+
+    // Call the command with views of its arguments. Only view commands
+    // avoid copying them.
+    // throws: std::bad_function_call if the command is empty
+    std::string call(std::span<const ArgView> args,
+                     const CancelToken &token) const {
+        if(view) {
+            return view(args);
+        }
+        std::list<std::string> copies;
+        for(const ArgView &arg : args) {
+            copies.push_back(std::string(arg.text));
+        }
+        return fn(copies, token);
+    }
+
+    // Does this command take views of its arguments?
+    bool takes_views() const { return (bool)view; }
+
+    // Run the command, writing its output to `out`. Sink commands write
+    // their chunks straight through; others write their result as one chunk.
+    // throws: std::bad_function_call if the command is empty
+    void call_into(std::list<std::string> args, ChunkWriter &out,
+                   const CancelToken &token) const {
+        if(sink) {
+            sink(args, out, token);
+        } else {
+            out.write(fn(args, token));
+        }
+    }
+
+    // A copy of this command that declares the arguments it takes
+    // throws: std::invalid_argument if the schema is variadic but has no
+    // argument to repeat
+    Command with_schema(Schema schema) const {
+        if(schema.variadic && schema.args.empty()) {
+            throw std::invalid_argument("variadic schema with no arguments");
+        }
+        Command command(*this);
+        command.arg_schema = std::make_shared<const Schema>(schema);
+        return command;
+    }
+
+    // The command's argument schema, or null if it has none
+    const Schema *schema() const { return arg_schema.get(); }
+
+    // Was this command defined at runtime with `defmacro` or `alias`?
+    bool is_definition() const { return defined; }
+
+    // A copy of this command marked as defined at runtime
+    Command as_definition() const {
+        Command command(*this);
+        command.defined = true;
+        return command;
+    }
+
+private:
+    static CancellableCommandFn wrap(CommandFn f) {
+        return [f](std::list<std::string> args, const CancelToken &) {
+            return f(args);
+        };
+    }
+
+    // Sink commands used as arguments have their output collected
+    static CancellableCommandFn collect(SinkCommandFn f) {
+        return [f](std::list<std::string> args, const CancelToken &token) {
+            StringWriter out;
+            f(args, out, token);
+            return out.str;
+        };
+    }
+
+    // View commands called with copies get views of the copies
+    static CancellableCommandFn unview(ViewCommandFn f) {
+        return [f](std::list<std::string> args, const CancelToken &) {
+            std::vector<ArgView> views;
+            for(const std::string &arg : args) {
+                views.push_back(ArgView(arg));
+            }
+            return f(views);
+        };
+    }
+
+    CancellableCommandFn fn;
+    SinkCommandFn sink;
+    ViewCommandFn view;
+    std::shared_ptr<const Schema> arg_schema;
+    bool defined;
+};
+
+typedef std::map<std::string, Command> CommandSet;
 typedef std::function<Optional<std::string>(Sexp)> Interpreter;
 
+// A hook run by the interpreter at every node boundary, e.g. to let more
+// urgent work run first
+typedef std::function<void()> Checkpoint;
+
+// Stores a command defined at runtime by `defmacro` or `alias`
+typedef std::function<void(std::string, Command)> Definer;
+
 // Parse the given command string
 Optional<Sexp> parse(std::string cmd);
 
 // Interpret the given command Sexp using the given set of commands
-Optional<std::string> interp_with(Sexp s, CommandSet commands);
+Optional<std::string> interp_with(const Sexp &s,
+                                  const CommandSet &commands);
+
+// Interpret the given command Sexp, giving up with the error
+// "Error: deadline exceeded." once `token` expires.
+// The token is checked before every node and passed to cancellable commands.
+Optional<std::string> interp_with(const Sexp &s,
+                                  const CommandSet &commands,
+                                  CancelToken token);
+
+// As above, additionally running `at_node` before every node
+Optional<std::string> interp_with(const Sexp &s,
+                                  const CommandSet &commands,
+                                  CancelToken token, Checkpoint at_node);
+
+// As above, additionally accepting definitions as the top-level command:
+//   (defmacro name (params...) body)
+//   (alias name command)
+// A definition is checked and compiled once, then handed to `define` to be
+// stored. Macro calls evaluate their arguments like any other command and
+// then run the compiled body with the parameters bound to them; the
+// commands in the body are resolved when the macro is defined.
+Optional<std::string> interp_with(const Sexp &s,
+                                  const CommandSet &commands,
+                                  CancelToken token, Checkpoint at_node,
+                                  Definer define);
+
+// Interpret the given command Sexp, writing its result to `out` instead of
+// returning it. If the command is a sink command, its output is forwarded
+// chunk by chunk as it is produced; sink commands used as arguments are
+// collected into strings as usual. Errors are written as the result.
+// Returns false if the command cannot be interpreted.
+bool interp_to(const Sexp &s, const CommandSet &commands, ChunkWriter &out,
+               CancelToken token = CancelToken::never());
 
 // Make an interpreter with the given set of commands "built-in"
 // That is, produce a function that can interpret commands without having to
 // provide the command set every time
+// Definitions made through the interpreter are kept in its own command set.
+// Copies of the interpreter share that set, so a definition made through one
+// is seen by all of them. They may run on separate threads: each evaluation
+// uses the set as it was when the evaluation started.
 Interpreter make_interpreter(CommandSet commands);
 
+// Make an interpreter that gives every evaluation its own time budget
+Interpreter make_interpreter(CommandSet commands,
+                             CancelToken::Clock::duration budget);
+
 // Serialize the given command
-std::string serialize(Sexp s);
+std::string serialize(const Sexp &s);
+
+// The number of bytes `serialize` would produce for the given command
+size_t serialized_size(const Sexp &s);
+
+// Serialize the given command straight into `out`, such as a radio frame
+// buffer, without allocating (for commands nested less than 64 lists deep).
+// Returns the number of bytes written, or 0 if `out` is too small, in which
+// case nothing is written.
+size_t serialize_into(const Sexp &s, std::span<std::byte> out);
 
 // Deserialize the given command
 Sexp deserialize(std::string str);
 
+// Limits on the frames `deserialize_bounded` accepts
+struct FrameLimits {
+    size_t max_frame = 65536;
+    // The most nodes, atoms and lists, in the command
+    size_t max_nodes = 4096;
+    // The most lists any atom or list may be within
+    size_t max_depth = 64;
+    size_t max_atom = 1024;
+};
+
+// Deserialize a command from an untrusted frame. Unlike `deserialize`, a
+// corrupted length can't make it allocate more than the frame could hold.
+// throws: cereal::Exception if the frame is truncated, has trailing bytes or
+// breaks a limit
+Sexp deserialize_bounded(const std::string &str,
+                         const FrameLimits &limits = FrameLimits());
+
+// `serialize` writes fields in the host's byte order. The portable format
+// has the same fields in a fixed little-endian layout, so the ground and
+// flight sides can differ in byte order. It is also what
+// cereal::PortableBinaryOutputArchive writes when set to little-endian.
+std::string serialize_portable(const Sexp &s);
+
+// The number of bytes `serialize_portable` would produce
+size_t serialized_portable_size(const Sexp &s);
+
+// As `serialize_into`, in the portable format
+size_t serialize_portable_into(const Sexp &s, std::span<std::byte> out);
+
+// Deserialize a command in the portable format
+// throws: cereal::Exception if the input is truncated or big-endian
+Sexp deserialize_portable(const std::string &str);
+
+namespace portable {
+    // Little-endian hosts read and write fields with memcpy; others
+    // assemble them a byte at a time. Both work on any host, so each can be
+    // tested on any host.
+    constexpr bool MEMCPY = std::endian::native == std::endian::little;
+
+    template<bool Memcpy>
+    size_t serialize_into(const Sexp &s, std::span<std::byte> out);
+
+    template<bool Memcpy>
+    Sexp deserialize(const std::string &str);
+
+    // Write `value` as eight little-endian bytes, for headers in front of
+    // a frame
+    void put_u64(std::byte *out, uint64_t value);
+
+    // Read eight little-endian bytes from the start of `str`
+    // throws: cereal::Exception if `str` is shorter than eight bytes
+    uint64_t get_u64(const std::string &str);
+}
+
 // Stringify a Sexp
 std::ostream& operator<<(std::ostream& os, const Sexp &s);
 
@@ -0,0 +1,380 @@
+#include "journal.hpp"
+#include "compact.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <charconv>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Where each field is in a record's header
+static const size_t LENGTH_AT = 0;
+static const size_t CHECKSUM_AT = 4;
+static const size_t SEQ_AT = 8;
+static const size_t TIME_AT = 16;
+static const size_t STATUS_AT = 24;
+static const size_t HEADER_SIZE = 25;
+
+static const char *SUFFIX = ".journal";
+
+[[noreturn]] static void fail(const std::string &what,
+                              const std::string &path) {
+    throw JournalError(what + " " + path + ": " + strerror(errno));
+}
+
+template<class T>
+static T get(const char *data, size_t at) {
+    T value;
+    memcpy(&value, data + at, sizeof(T));
+    return value;
+}
+
+template<class T>
+static void put(char *data, size_t at, T value) {
+    memcpy(data + at, &value, sizeof(T));
+}
+
+// FNV-1a over the record's length and everything after its checksum
+static uint32_t checksum(const char *record, uint32_t length) {
+    uint32_t hash = 2166136261u;
+    auto mix = [&hash](const char *data, size_t size) {
+        for(size_t i = 0; i < size; ++i) {
+            hash = (hash ^ (unsigned char)data[i]) * 16777619u;
+        }
+    };
+    mix(record + LENGTH_AT, sizeof(uint32_t));
+    mix(record + SEQ_AT, HEADER_SIZE - SEQ_AT + length);
+    return hash;
+}
+
+// The segment files in `dir` with the sequence number each starts at, in
+// order
+static std::vector<std::pair<uint64_t, std::string>>
+list_segments(const std::string &dir) {
+    std::vector<std::pair<uint64_t, std::string>> segments;
+    for(const auto &file : std::filesystem::directory_iterator(dir)) {
+        std::string name = file.path().filename().string();
+        size_t digits = name.size() - strlen(SUFFIX);
+        if(name.size() <= strlen(SUFFIX)
+           || name.compare(digits, std::string::npos, SUFFIX) != 0) {
+            continue;
+        }
+        // Other files that happen to end in the suffix aren't segments
+        uint64_t first;
+        std::from_chars_result r = std::from_chars(name.data(),
+                                                   name.data() + digits,
+                                                   first);
+        if(r.ec != std::errc() || r.ptr != name.data() + digits) {
+            continue;
+        }
+        segments.push_back(std::make_pair(first, file.path().string()));
+    }
+    std::sort(segments.begin(), segments.end());
+    return segments;
+}
+
+static std::string segment_path(const std::string &dir, uint64_t first) {
+    char name[32];
+    snprintf(name, sizeof(name), "%020llu", (unsigned long long)first);
+    return dir + "/" + name + SUFFIX;
+}
+
+// Call `found(offset, seq, time)` for each intact record in a segment whose
+// first record is `first`, returning where the records end
+template<class F>
+static size_t scan(const char *data, size_t size, uint64_t first, F found) {
+    size_t offset = 0;
+    for(uint64_t seq = first; size - offset >= HEADER_SIZE; ++seq) {
+        const char *record = data + offset;
+        uint32_t length = get<uint32_t>(record, LENGTH_AT);
+        if(length == 0 || length > size - offset - HEADER_SIZE
+           || get<uint32_t>(record, CHECKSUM_AT) != checksum(record, length)
+           || get<uint64_t>(record, SEQ_AT) != seq) {
+            break;
+        }
+        found(offset, seq, get<int64_t>(record, TIME_AT));
+        offset += HEADER_SIZE + length;
+    }
+    return offset;
+}
+
+Journal::Journal(const std::string &dir, JournalOptions options)
+    : dir(dir), options(options), seq(0), synced_seq(0), urgent(false),
+      stopping(false) {
+    std::error_code error;
+    std::filesystem::create_directories(dir, error);
+    if(error) {
+        throw JournalError("can't create " + dir + ": " + error.message());
+    }
+    std::vector<std::pair<uint64_t, std::string>> segments
+        = list_segments(dir);
+    if(segments.empty()) {
+        current = open_segment(0, 0);
+    } else {
+        // Continue in the last segment, after its last intact record
+        const std::string &path = segments.back().second;
+        current.fd = open(path.c_str(), O_RDWR);
+        struct stat st;
+        if(current.fd < 0 || fstat(current.fd, &st) != 0) {
+            fail("can't open", path);
+        }
+        // A reset while the segment was being made can leave it empty or
+        // short, so make it a whole segment again; the zeros read as no
+        // records
+        current.size = st.st_size;
+        if(current.size < options.segment_size) {
+            current.size = options.segment_size;
+            if(ftruncate(current.fd, current.size) != 0) {
+                close(current.fd);
+                fail("can't size", path);
+            }
+        }
+        current.data = (char *)mmap(nullptr, current.size,
+                                    PROT_READ | PROT_WRITE, MAP_SHARED,
+                                    current.fd, 0);
+        if(current.data == MAP_FAILED) {
+            close(current.fd);
+            fail("can't map", path);
+        }
+        seq = segments.back().first;
+        current.used = scan(current.data, current.size, seq,
+                            [this](size_t, uint64_t, int64_t) { seq++; });
+        // Clear anything torn after the last intact record
+        memset(current.data + current.used, 0, current.size - current.used);
+        current.synced = current.used;
+        synced_seq = seq;
+    }
+    flusher = std::thread(&Journal::flush_loop, this);
+}
+
+Journal::~Journal() {
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        stopping = true;
+    }
+    wake.notify_all();
+    flusher.join();
+    close_segment(current);
+}
+
+Journal::Segment Journal::open_segment(uint64_t first, size_t record) {
+    std::string path = segment_path(dir, first);
+    Segment segment;
+    segment.size = std::max(options.segment_size, record);
+    segment.fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if(segment.fd < 0) {
+        fail("can't create", path);
+    }
+    if(ftruncate(segment.fd, segment.size) != 0) {
+        close(segment.fd);
+        fail("can't size", path);
+    }
+    segment.data = (char *)mmap(nullptr, segment.size,
+                                PROT_READ | PROT_WRITE, MAP_SHARED,
+                                segment.fd, 0);
+    if(segment.data == MAP_FAILED) {
+        close(segment.fd);
+        fail("can't map", path);
+    }
+    return segment;
+}
+
+void Journal::close_segment(Segment &segment) {
+    if(segment.data) {
+        msync(segment.data, segment.size, MS_SYNC);
+        munmap(segment.data, segment.size);
+        close(segment.fd);
+        segment.data = nullptr;
+    }
+}
+
+uint64_t Journal::append(const Sexp &command, JournalStatus status) {
+    return append_compact(serialize_compact(command), status);
+}
+
+uint64_t Journal::append_compact(std::string_view payload,
+                                 JournalStatus status) {
+    // A zero length marks the end of a segment's records
+    if(payload.empty()) {
+        throw std::invalid_argument("empty journal record");
+    }
+    size_t record = HEADER_SIZE + payload.size();
+    std::unique_lock<std::mutex> guard(lock);
+    if(record > current.size - current.used) {
+        // Only retire the full segment once its successor is mapped, so a
+        // failure leaves the journal as it was
+        Segment next = open_segment(seq, record);
+        retired.push_back(current);
+        current = next;
+    }
+    char *data = current.data + current.used;
+    put<uint32_t>(data, LENGTH_AT, payload.size());
+    put<uint64_t>(data, SEQ_AT, seq);
+    put<int64_t>(data, TIME_AT,
+                 std::chrono::duration_cast<std::chrono::nanoseconds>(
+                     std::chrono::system_clock::now().time_since_epoch())
+                 .count());
+    put<uint8_t>(data, STATUS_AT, (uint8_t)status);
+    memcpy(data + HEADER_SIZE, payload.data(), payload.size());
+    put<uint32_t>(data, CHECKSUM_AT, checksum(data, payload.size()));
+    current.used += record;
+    uint64_t appended = seq++;
+    if(seq - synced_seq >= options.group_size) {
+        guard.unlock();
+        wake.notify_one();
+    }
+    return appended;
+}
+
+void Journal::flush() {
+    std::unique_lock<std::mutex> guard(lock);
+    uint64_t target = seq;
+    urgent = true;
+    wake.notify_one();
+    flushed.wait(guard, [this, target]() { return synced_seq >= target; });
+}
+
+uint64_t Journal::next_seq() {
+    std::lock_guard<std::mutex> guard(lock);
+    return seq;
+}
+
+uint64_t Journal::durable() {
+    std::lock_guard<std::mutex> guard(lock);
+    return synced_seq;
+}
+
+void Journal::flush_loop() {
+    static const size_t PAGE = sysconf(_SC_PAGESIZE);
+    std::unique_lock<std::mutex> guard(lock);
+    while(true) {
+        wake.wait_for(guard, options.flush_interval, [this]() {
+            return stopping || urgent
+                || seq - synced_seq >= options.group_size;
+        });
+        if(seq == synced_seq && retired.empty()) {
+            urgent = false;
+            flushed.notify_all();
+            if(stopping) {
+                return;
+            }
+            continue;
+        }
+
+        // Flush one group, without holding the lock. Only this thread
+        // unmaps segments, so `data` stays mapped even if the segment is
+        // retired meanwhile.
+        std::vector<Segment> done;
+        done.swap(retired);
+        char *data = current.data;
+        size_t from = current.synced / PAGE * PAGE;
+        size_t to = current.used;
+        uint64_t target = seq;
+        urgent = false;
+        guard.unlock();
+        for(Segment &segment : done) {
+            close_segment(segment);
+        }
+        if(to > from) {
+            msync(data + from, to - from, MS_SYNC);
+        }
+        guard.lock();
+        if(current.data == data) {
+            current.synced = to;
+        }
+        synced_seq = target;
+        flushed.notify_all();
+    }
+}
+
+Interpreter journaled(Interpreter interpreter, Journal &journal) {
+    return [interpreter, &journal](Sexp s) {
+        // Serialize first, so that the command can be moved into the
+        // interpreter rather than copied
+        std::string frame = serialize_compact(s);
+        Optional<std::string> result = interpreter(std::move(s));
+        JournalStatus status = JournalStatus::Ok;
+        if(result.isEmpty()) {
+            status = JournalStatus::Failed;
+        } else if(result.get().starts_with("Error")) {
+            status = JournalStatus::Error;
+        }
+        journal.append_compact(frame, status);
+        return result;
+    };
+}
+
+JournalReader::JournalReader(const std::string &dir) : pos(0) {
+    for(const auto &segment : list_segments(dir)) {
+        int fd = open(segment.second.c_str(), O_RDONLY);
+        struct stat st;
+        if(fd < 0 || fstat(fd, &st) != 0) {
+            fail("can't open", segment.second);
+        }
+        Mapping mapping{nullptr, (size_t)st.st_size};
+        if(mapping.size > 0) {
+            void *data = mmap(nullptr, mapping.size, PROT_READ, MAP_SHARED,
+                              fd, 0);
+            if(data == MAP_FAILED) {
+                close(fd);
+                fail("can't map", segment.second);
+            }
+            mapping.data = (const char *)data;
+        }
+        close(fd);
+        segments.push_back(mapping);
+        size_t index_of = segments.size() - 1;
+        scan(mapping.data, mapping.size, segment.first,
+             [this, index_of](size_t offset, uint64_t seq, int64_t time) {
+                 index.push_back(Position{seq, time, index_of, offset});
+             });
+    }
+}
+
+JournalReader::~JournalReader() {
+    for(const Mapping &mapping : segments) {
+        if(mapping.data) {
+            munmap((void *)mapping.data, mapping.size);
+        }
+    }
+}
+
+bool JournalReader::seek(uint64_t seq) {
+    pos = std::lower_bound(index.begin(), index.end(), seq,
+                           [](const Position &p, uint64_t seq) {
+                               return p.seq < seq;
+                           }) - index.begin();
+    return pos < index.size();
+}
+
+bool JournalReader::seek(std::chrono::system_clock::time_point time) {
+    int64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        time.time_since_epoch()).count();
+    pos = std::lower_bound(index.begin(), index.end(), ns,
+                           [](const Position &p, int64_t ns) {
+                               return p.time < ns;
+                           }) - index.begin();
+    return pos < index.size();
+}
+
+bool JournalReader::next(JournalEntry &entry) {
+    if(pos == index.size()) {
+        return false;
+    }
+    const Position &at = index[pos++];
+    const char *record = segments[at.segment].data + at.offset;
+    entry.seq = at.seq;
+    entry.time = std::chrono::system_clock::time_point(
+        std::chrono::duration_cast<std::chrono::system_clock::duration>(
+            std::chrono::nanoseconds(at.time)));
+    entry.status = (JournalStatus)get<uint8_t>(record, STATUS_AT);
+    entry.command = deserialize_compact(
+        std::string(record + HEADER_SIZE, get<uint32_t>(record, LENGTH_AT)));
+    return true;
+}
@@ -0,0 +1,176 @@
+#ifndef _JOURNAL_H_
+#define _JOURNAL_H_
+
+#include "interp.hpp"
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+// A durable record of the commands the interpreter ran.
+//
+// The journal is a directory of segment files, each named after the
+// sequence number of its first record and memory-mapped while it is written.
+// Each record is a header (the payload's length, a checksum, the sequence
+// number, the time in nanoseconds since the epoch and the status) followed
+// by the command in the compact format (see compact.hpp). Fields are in the
+// host's byte order, since the journal is read where it is written. The
+// rest of a segment is zeros, and a record is only read back if its
+// checksum matches, so a record torn by a reset is where the journal ends.
+
+// Thrown when the journal's files can't be created, mapped or read
+class JournalError : public std::runtime_error {
+public:
+    explicit JournalError(const std::string &what)
+        : std::runtime_error(what) {}
+};
+
+// How a journaled command ended
+enum class JournalStatus : uint8_t {
+    Ok = 0,
+    // The interpreter gave an error result
+    Error = 1,
+    // The interpreter gave no result at all
+    Failed = 2,
+};
+
+struct JournalEntry {
+    uint64_t seq;
+    std::chrono::system_clock::time_point time;
+    JournalStatus status;
+    Sexp command;
+};
+
+struct JournalOptions {
+    // Bytes per segment file. Larger records get a segment of their own.
+    size_t segment_size = 1 << 20;
+    // Flush at least this often while there are records to flush
+    std::chrono::milliseconds flush_interval{10};
+    // Flush early once this many records are waiting
+    size_t group_size = 256;
+};
+
+// Appends records to the journal. Appending only copies the record into the
+// mapped segment; a background thread flushes what has been appended in
+// groups, so callers don't wait for the disk.
+class Journal {
+public:
+    // Open the journal in `dir`, creating the directory if needed, and
+    // continue after its last intact record
+    // throws: JournalError
+    explicit Journal(const std::string &dir,
+                     JournalOptions options = JournalOptions());
+
+    // Flush everything and close the journal
+    ~Journal();
+
+    // Append a record, returning its sequence number
+    // throws: JournalError if a new segment can't be made
+    uint64_t append(const Sexp &command, JournalStatus status);
+
+    // As above, for a command already in the compact format
+    // throws: std::invalid_argument if `frame` is empty, JournalError
+    uint64_t append_compact(std::string_view frame, JournalStatus status);
+
+    // Wait until every record appended so far is on disk
+    void flush();
+
+    // The sequence number the next record will get
+    uint64_t next_seq();
+
+    // The number of records known to be on disk, which are those with
+    // sequence numbers below this
+    uint64_t durable();
+
+private:
+    struct Segment {
+        int fd = -1;
+        char *data = nullptr;
+        size_t size = 0;
+        // Bytes written, and bytes flushed
+        size_t used = 0;
+        size_t synced = 0;
+    };
+
+    // Map a new segment starting at sequence number `first`, big enough
+    // for a record of `record` bytes
+    // throws: JournalError
+    Segment open_segment(uint64_t first, size_t record);
+
+    // Flush and unmap a segment
+    static void close_segment(Segment &segment);
+
+    void flush_loop();
+
+    std::string dir;
+    JournalOptions options;
+    std::mutex lock;
+    // Wakes the flusher
+    std::condition_variable wake;
+    // Wakes those waiting in `flush`
+    std::condition_variable flushed;
+    Segment current;
+    // Full segments still to be flushed and unmapped by the flusher
+    std::vector<Segment> retired;
+    uint64_t seq;
+    uint64_t synced_seq;
+    // Someone is waiting in `flush`
+    bool urgent;
+    bool stopping;
+    std::thread flusher;
+};
+
+// Records a command run by `interpreter`, and its status, in `journal`
+Interpreter journaled(Interpreter interpreter, Journal &journal);
+
+// Reads a journal, found by an index of every record built when it is
+// opened. Records appended after that are not seen.
+class JournalReader {
+public:
+    // throws: JournalError
+    explicit JournalReader(const std::string &dir);
+    ~JournalReader();
+
+    JournalReader(const JournalReader &) = delete;
+    JournalReader &operator=(const JournalReader &) = delete;
+
+    // The number of records
+    size_t size() const { return index.size(); }
+
+    // Position the reader at the record with sequence number `seq`, or the
+    // first after it. Gives false if there is none.
+    bool seek(uint64_t seq);
+
+    // Position the reader at the first record at or after `time`. Records
+    // are in time order unless the clock was set back.
+    bool seek(std::chrono::system_clock::time_point time);
+
+    // Read the record at the reader's position and move past it, or give
+    // false at the end
+    // throws: FrameError if the record's command is malformed
+    bool next(JournalEntry &entry);
+
+private:
+    struct Mapping {
+        const char *data;
+        size_t size;
+    };
+    struct Position {
+        uint64_t seq;
+        int64_t time;
+        size_t segment;
+        size_t offset;
+    };
+
+    std::vector<Mapping> segments;
+    std::vector<Position> index;
+    size_t pos;
+};
+
+#endif /* _JOURNAL_H_ */
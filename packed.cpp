@@ -0,0 +1,401 @@
+#include "packed.hpp"
+#include "schema.hpp"
+
+#include <algorithm>
+#include <bit>
+#include <charconv>
+#include <cmath>
+#include <cstring>
+#include <iterator>
+
+// How a Number argument is sent
+enum NumberMode { INTEGER = 0, FLOAT = 1, DOUBLE = 2, TEXT = 3 };
+
+// Writes fields of any number of bits, most significant bit first
+class BitWriter {
+public:
+    void put(uint64_t value, unsigned bits) {
+        for(unsigned i = bits; i > 0; --i) {
+            if(used == 0) {
+                out.push_back(0);
+            }
+            if((value >> (i - 1)) & 1) {
+                out.back() |= (char)(0x80 >> used);
+            }
+            used = (used + 1) % 8;
+        }
+    }
+
+    void put_varint(uint64_t value) {
+        while(value >= 0x80) {
+            put(0x80 | (value & 0x7F), 8);
+            value >>= 7;
+        }
+        put(value, 8);
+    }
+
+    void put_zigzag(long long value) {
+        put_varint(((uint64_t)value << 1) ^ (uint64_t)(value >> 63));
+    }
+
+    void put_text(std::string_view text) {
+        put_varint(text.size());
+        for(char c : text) {
+            put((unsigned char)c, 8);
+        }
+    }
+
+    std::string out;
+
+private:
+    // Bits used in the last byte
+    unsigned used = 0;
+};
+
+// Reads fields written by a BitWriter
+// throws: FrameError if the frame runs out
+class BitReader {
+public:
+    explicit BitReader(std::string_view frame) : frame(frame), pos(0) {}
+
+    uint64_t get(unsigned bits) {
+        if(bits > frame.size() * 8 - pos) {
+            throw FrameError("packed frame truncated");
+        }
+        uint64_t value = 0;
+        for(unsigned i = 0; i < bits; ++i, ++pos) {
+            unsigned char byte = frame[pos / 8];
+            value = (value << 1) | ((byte >> (7 - pos % 8)) & 1);
+        }
+        return value;
+    }
+
+    uint64_t get_varint() {
+        uint64_t value = 0;
+        for(int shift = 0; ; shift += 7) {
+            if(shift > 63) {
+                throw FrameError("varint too long");
+            }
+            uint64_t byte = get(8);
+            value |= (byte & 0x7F) << shift;
+            if(!(byte & 0x80)) {
+                return value;
+            }
+        }
+    }
+
+    long long get_zigzag() {
+        uint64_t value = get_varint();
+        return (long long)((value >> 1) ^ -(value & 1));
+    }
+
+    std::string get_text() {
+        uint64_t size = get_varint();
+        if(size > (frame.size() * 8 - pos) / 8) {
+            throw FrameError("packed text longer than frame");
+        }
+        std::string text(size, '\0');
+        for(char &c : text) {
+            c = (char)get(8);
+        }
+        return text;
+    }
+
+    // Skip to the next whole byte
+    size_t align() {
+        pos = (pos + 7) / 8 * 8;
+        return pos / 8;
+    }
+
+private:
+    std::string_view frame;
+    // In bits
+    size_t pos;
+};
+
+// Is `text` exactly what to_chars gives for `value`?
+template<class T>
+static bool prints_as(T value, std::string_view text) {
+    char buffer[64];
+    std::to_chars_result r = std::to_chars(buffer, buffer + sizeof(buffer),
+                                           value);
+    return std::string_view(buffer, r.ptr - buffer) == text;
+}
+
+template<class T>
+static std::string to_text(T value) {
+    char buffer[64];
+    std::to_chars_result r = std::to_chars(buffer, buffer + sizeof(buffer),
+                                           value);
+    return std::string(buffer, r.ptr - buffer);
+}
+
+// The bits needed for values 0 to `n` inclusive
+static unsigned bits_for(uint64_t n) {
+    return std::bit_width(n);
+}
+
+// The range of a ranged Integer argument as whole numbers, or false if it
+// has none (or too wide a one to pack)
+static bool integer_range(const ArgSchema &spec, long long &lo,
+                          long long &hi) {
+    if(!spec.has_range || spec.min < -4e18 || spec.max > 4e18
+       || spec.min > spec.max) {
+        return false;
+    }
+    lo = (long long)std::ceil(spec.min);
+    hi = (long long)std::floor(spec.max);
+    return lo <= hi;
+}
+
+// Can `text` be packed as an argument described by `spec`?
+static bool packable_arg(const ArgSchema &spec, const std::string &text) {
+    switch(spec.type) {
+    case ArgType::Integer: {
+        ArgView arg(text);
+        if(!arg.is_integer || !prints_as(arg.integer, text)) {
+            return false;
+        }
+        long long lo, hi;
+        return !integer_range(spec, lo, hi)
+            || (arg.integer >= lo && arg.integer <= hi);
+    }
+    case ArgType::Choice:
+        return std::binary_search(spec.choices.begin(), spec.choices.end(),
+                                  text);
+    default:
+        return true;
+    }
+}
+
+// The fewest bits an argument described by `spec` packs into
+static unsigned min_bits(const ArgSchema &spec) {
+    long long lo, hi;
+    switch(spec.type) {
+    case ArgType::Integer:
+        return integer_range(spec, lo, hi)
+            ? bits_for((uint64_t)hi - (uint64_t)lo) : 8;
+    case ArgType::Number:
+        return 2 + 8;
+    case ArgType::Choice:
+        return bits_for(spec.choices.size() - 1);
+    default:
+        return 8;
+    }
+}
+
+// The most repeats of an argument that packs into no bits at all (a single
+// choice, or a range of one value), which the frame's size can't bound
+static const uint64_t MAX_EMPTY_REPEATS = 4096;
+
+static void put_arg(BitWriter &out, const ArgSchema &spec,
+                    const std::string &text) {
+    switch(spec.type) {
+    case ArgType::Integer: {
+        long long value = ArgView(text).integer;
+        long long lo, hi;
+        if(integer_range(spec, lo, hi)) {
+            out.put((uint64_t)value - (uint64_t)lo,
+                    bits_for((uint64_t)hi - (uint64_t)lo));
+        } else {
+            out.put_zigzag(value);
+        }
+        return;
+    }
+    case ArgType::Number: {
+        ArgView arg(text);
+        if(arg.is_integer && prints_as(arg.integer, text)) {
+            out.put(INTEGER, 2);
+            out.put_zigzag(arg.integer);
+        } else if(arg.is_number && prints_as((float)arg.number, text)) {
+            float f = (float)arg.number;
+            uint32_t bits;
+            memcpy(&bits, &f, sizeof(bits));
+            out.put(FLOAT, 2);
+            out.put(bits, 32);
+        } else if(arg.is_number && prints_as(arg.number, text)) {
+            uint64_t bits;
+            memcpy(&bits, &arg.number, sizeof(bits));
+            out.put(DOUBLE, 2);
+            out.put(bits, 64);
+        } else {
+            out.put(TEXT, 2);
+            out.put_text(text);
+        }
+        return;
+    }
+    case ArgType::Choice: {
+        size_t index = std::lower_bound(spec.choices.begin(),
+                                        spec.choices.end(), text)
+            - spec.choices.begin();
+        out.put(index, bits_for(spec.choices.size() - 1));
+        return;
+    }
+    default:
+        out.put_text(text);
+    }
+}
+
+// throws: FrameError
+static std::string get_arg(BitReader &in, const ArgSchema &spec) {
+    switch(spec.type) {
+    case ArgType::Integer: {
+        long long lo, hi;
+        if(!integer_range(spec, lo, hi)) {
+            return to_text(in.get_zigzag());
+        }
+        uint64_t offset = in.get(bits_for((uint64_t)hi - (uint64_t)lo));
+        if(offset > (uint64_t)hi - (uint64_t)lo) {
+            throw FrameError("packed integer out of range");
+        }
+        return to_text((long long)((uint64_t)lo + offset));
+    }
+    case ArgType::Number:
+        switch(in.get(2)) {
+        case INTEGER:
+            return to_text(in.get_zigzag());
+        case FLOAT: {
+            uint32_t bits = in.get(32);
+            float f;
+            memcpy(&f, &bits, sizeof(f));
+            return to_text(f);
+        }
+        case DOUBLE: {
+            uint64_t bits = in.get(64);
+            double d;
+            memcpy(&d, &bits, sizeof(d));
+            return to_text(d);
+        }
+        default:
+            return in.get_text();
+        }
+    case ArgType::Choice: {
+        uint64_t index = in.get(bits_for(spec.choices.size() - 1));
+        if(index >= spec.choices.size()) {
+            throw FrameError("unknown choice " + std::to_string(index));
+        }
+        return spec.choices[index];
+    }
+    default:
+        return in.get_text();
+    }
+}
+
+ArgPacker::ArgPacker(const CommandSet &commands)
+    : print(PlanChecker(commands).fingerprint()) {
+    // CommandSet is ordered, so the table comes out sorted by name
+    for(const auto &command : commands) {
+        const Schema *schema = command.second.schema();
+        // A variadic schema needs an argument to repeat
+        if(!schema || (schema->variadic && schema->args.empty())) {
+            continue;
+        }
+        Entry entry{command.first, *schema};
+        for(ArgSchema &arg : entry.schema.args) {
+            std::sort(arg.choices.begin(), arg.choices.end());
+            // A choice of nothing can't be packed
+            if(arg.type == ArgType::Choice && arg.choices.empty()) {
+                arg.type = ArgType::Any;
+            }
+        }
+        table.push_back(entry);
+    }
+    code_bits = bits_for(table.size());
+}
+
+const ArgPacker::Entry *ArgPacker::packable(const Sexp &s) const {
+    if(s.isAtom || s.elements.empty() || !s.elements.front().isAtom) {
+        return nullptr;
+    }
+    const std::string &name = s.elements.front().atom;
+    std::vector<Entry>::const_iterator it = std::lower_bound(
+        table.begin(), table.end(), name,
+        [](const Entry &entry, const std::string &name) {
+            return entry.name < name;
+        });
+    if(it == table.end() || it->name != name) {
+        return nullptr;
+    }
+    const std::vector<ArgSchema> &specs = it->schema.args;
+    size_t args = s.elements.size() - 1;
+    if(it->schema.variadic ? args + 1 < specs.size() : args != specs.size()) {
+        return nullptr;
+    }
+    if(it->schema.variadic && min_bits(specs.back()) == 0
+       && args + 1 - specs.size() > MAX_EMPTY_REPEATS) {
+        return nullptr;
+    }
+    size_t i = 0;
+    for(std::list<Sexp>::const_iterator arg = std::next(s.elements.begin());
+        arg != s.elements.end(); ++arg, ++i) {
+        if(!arg->isAtom
+           || !packable_arg(specs[std::min(i, specs.size() - 1)],
+                            arg->atom)) {
+            return nullptr;
+        }
+    }
+    return &*it;
+}
+
+bool ArgPacker::packs(const Sexp &s) const {
+    return packable(s) != nullptr;
+}
+
+std::string ArgPacker::pack(const Sexp &s) const {
+    BitWriter out;
+    const Entry *entry = packable(s);
+    if(!entry) {
+        out.put(table.size(), code_bits);
+        return out.out + serialize_compact(s);
+    }
+    out.put(entry - table.data(), code_bits);
+    const std::vector<ArgSchema> &specs = entry->schema.args;
+    if(entry->schema.variadic) {
+        out.put_varint(s.elements.size() - specs.size());
+    }
+    size_t i = 0;
+    for(std::list<Sexp>::const_iterator arg = std::next(s.elements.begin());
+        arg != s.elements.end(); ++arg, ++i) {
+        put_arg(out, specs[std::min(i, specs.size() - 1)], arg->atom);
+    }
+    return out.out;
+}
+
+Sexp ArgPacker::unpack(std::string_view frame) const {
+    BitReader in(frame);
+    uint64_t code = in.get(code_bits);
+    if(code == table.size()) {
+        return deserialize_compact(std::string(frame.substr(in.align())));
+    }
+    if(code > table.size()) {
+        throw FrameError("unknown command code " + std::to_string(code));
+    }
+    const Entry &entry = table[code];
+    const std::vector<ArgSchema> &specs = entry.schema.args;
+    uint64_t args = specs.size();
+    if(entry.schema.variadic) {
+        uint64_t repeats = in.get_varint();
+        unsigned bits = min_bits(specs.back());
+        if(bits == 0 ? repeats > MAX_EMPTY_REPEATS
+           : repeats > frame.size() * 8 / bits) {
+            throw FrameError("too many repeated arguments");
+        }
+        args += repeats - 1;
+    }
+
+    Sexp s;
+    s.isAtom = false;
+    s.elements.push_back(Sexp());
+    s.elements.back().isAtom = true;
+    s.elements.back().atom = entry.name;
+    for(uint64_t i = 0; i < args; ++i) {
+        s.elements.push_back(Sexp());
+        s.elements.back().isAtom = true;
+        s.elements.back().atom = get_arg(
+            in, specs[std::min<uint64_t>(i, specs.size() - 1)]);
+    }
+    if(in.align() != frame.size()) {
+        throw FrameError("trailing bytes after packed command");
+    }
+    return s;
+}
@@ -0,0 +1,76 @@
+#ifndef _PACKED_H_
+#define _PACKED_H_
+
+#include "compact.hpp"
+#include "interp.hpp"
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Bit-packed frames, using the commands' argument schemas (see Schema in
+// interp.hpp) to send arguments as binary fields instead of text.
+//
+// A frame is a bit stream, most significant bit first, starting with the
+// command's code: its position among the commands with schemas, sorted by
+// name, in just enough bits for all of them plus one. Each argument follows
+// as its schema says:
+//
+// - Integer with a range: the offset from the minimum, in just enough bits
+//   for the range
+// - Integer without one: a zigzag varint (7 bits per byte, least
+//   significant first)
+// - Number: two bits saying how, then a zigzag varint if the text is an
+//   integer, a 32-bit or 64-bit float if the shortest text of one is exactly
+//   the argument, or else the text as for Any
+// - Choice: the position among the sorted choices, in just enough bits
+//   (so a choice of two is one bit)
+// - Any: a varint length and the bytes
+//
+// For variadic schemas, a varint with the number of repeats comes first.
+// The last byte is padded with zero bits.
+//
+// Commands that can't be packed this way, because they have no schema, use
+// a special form, or have an argument that is computed by a nested command
+// or doesn't match the schema, are sent with the code one past the last,
+// then from the next byte on in the compact format (see compact.hpp).
+//
+// Both sides must build the packer from the same schemas, which can be
+// confirmed with `fingerprint` when a pass starts. Frames carry no version,
+// to keep them small.
+class ArgPacker {
+public:
+    explicit ArgPacker(const CommandSet &commands);
+
+    std::string pack(const Sexp &s) const;
+
+    // throws: FrameError if the frame is truncated, has trailing bytes, or
+    // has an unknown command code or choice
+    Sexp unpack(std::string_view frame) const;
+
+    // Would `s` be packed, rather than sent in the compact format?
+    bool packs(const Sexp &s) const;
+
+    // Identifies the schemas the packer uses, as PlanChecker::fingerprint
+    uint64_t fingerprint() const { return print; }
+
+    // A command with a schema, compiled for packing
+    struct Entry {
+        std::string name;
+        // With each Choice argument's choices sorted
+        Schema schema;
+    };
+
+private:
+    // The entry for the command `s` calls, if it can be packed
+    const Entry *packable(const Sexp &s) const;
+
+    // Sorted by name
+    std::vector<Entry> table;
+    // Bits in a command code
+    unsigned code_bits;
+    uint64_t print;
+};
+
+#endif /* _PACKED_H_ */
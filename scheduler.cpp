@@ -0,0 +1,109 @@
+#include "scheduler.hpp"
+
+Scheduler::Scheduler(CommandSet commands, int workers)
+    : commands(commands), stopping(false) {
+    for(int i = 0; i < NUM_PRIORITIES; ++i) {
+        metrics[i].depth = 0;
+        metrics[i].started = 0;
+        metrics[i].total_wait = Clock::duration::zero();
+        metrics[i].max_wait = Clock::duration::zero();
+        waiting[i] = 0;
+    }
+    for(int i = 0; i < workers; ++i) {
+        this->workers.push_back(std::thread(&Scheduler::work, this));
+    }
+}
+
+Scheduler::~Scheduler() {
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        stopping = true;
+    }
+    ready.notify_all();
+    for(std::thread &worker : workers) {
+        worker.join();
+    }
+}
+
+std::future<Optional<std::string>> Scheduler::submit(Sexp s,
+                                                     Priority priority,
+                                                     CancelToken token) {
+    int p = static_cast<int>(priority);
+    Job job;
+    job.sexp = s;
+    job.token = token;
+    job.queued = Clock::now();
+    job.result = std::make_shared<std::promise<Optional<std::string>>>();
+    std::future<Optional<std::string>> result = job.result->get_future();
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        queues[p].push_back(job);
+        waiting[p].fetch_add(1);
+    }
+    ready.notify_one();
+    return result;
+}
+
+QueueStats Scheduler::stats(Priority priority) {
+    int p = static_cast<int>(priority);
+    std::lock_guard<std::mutex> guard(lock);
+    QueueStats stats = metrics[p];
+    stats.depth = queues[p].size();
+    return stats;
+}
+
+bool Scheduler::take(int running, bool block, Job &job, int &priority) {
+    std::unique_lock<std::mutex> guard(lock);
+    while(true) {
+        for(int p = 0; p < running; ++p) {
+            if(!queues[p].empty()) {
+                job = queues[p].front();
+                queues[p].pop_front();
+                waiting[p].fetch_sub(1);
+
+                Clock::duration wait = Clock::now() - job.queued;
+                metrics[p].started++;
+                metrics[p].total_wait += wait;
+                if(wait > metrics[p].max_wait) {
+                    metrics[p].max_wait = wait;
+                }
+                priority = p;
+                return true;
+            }
+        }
+        if(!block || stopping) {
+            return false;
+        }
+        ready.wait(guard);
+    }
+}
+
+void Scheduler::run(Job &job, int priority) {
+    // Preempt this job at its node boundaries in favour of more urgent ones
+    Checkpoint preempt = [this, priority]() {
+        for(int p = 0; p < priority; ++p) {
+            if(waiting[p].load() > 0) {
+                Job urgent;
+                int urgent_priority;
+                while(take(priority, false, urgent, urgent_priority)) {
+                    run(urgent, urgent_priority);
+                }
+                return;
+            }
+        }
+    };
+    try {
+        job.result->set_value(interp_with(job.sexp, commands, job.token,
+                                          preempt));
+    } catch(...) {
+        job.result->set_exception(std::current_exception());
+    }
+}
+
+void Scheduler::work() {
+    Job job;
+    int priority;
+    while(take(NUM_PRIORITIES, true, job, priority)) {
+        run(job, priority);
+    }
+}
@@ -0,0 +1,86 @@
+#ifndef _SCHEDULER_H_
+#define _SCHEDULER_H_
+
+#include "interp.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <future>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Priority classes, most urgent first
+enum class Priority { SafeMode = 0, Normal = 1, Housekeeping = 2 };
+const int NUM_PRIORITIES = 3;
+
+// Queue metrics for one priority class
+struct QueueStats {
+    // Commands waiting to start
+    size_t depth;
+    // Commands that have started running
+    size_t started;
+    // Total and worst time spent waiting in the queue before starting
+    std::chrono::steady_clock::duration total_wait;
+    std::chrono::steady_clock::duration max_wait;
+
+    std::chrono::steady_clock::duration mean_wait() const {
+        return started == 0 ? std::chrono::steady_clock::duration::zero()
+                            : total_wait / (long)started;
+    }
+};
+
+// A priority queue of commands in front of one or more interpreter workers.
+//
+// Workers always take the most urgent queued command. A running command is
+// preempted at its node boundaries: before evaluating each node, the worker
+// first runs any queued command of a strictly higher priority class and
+// then resumes where it left off.
+class Scheduler {
+public:
+    // Start `workers` worker threads interpreting with `commands`
+    Scheduler(CommandSet commands, int workers = 1);
+
+    // Stop accepting commands, run everything still queued, and join the
+    // workers
+    ~Scheduler();
+
+    // Queue a parsed or deserialized command. The future receives the
+    // interpreter's result; `token` bounds the command's run time as with
+    // interp_with.
+    std::future<Optional<std::string>> submit(
+        Sexp s, Priority priority, CancelToken token = CancelToken::never());
+
+    // Metrics for the given priority class
+    QueueStats stats(Priority priority);
+
+private:
+    typedef std::chrono::steady_clock Clock;
+
+    struct Job {
+        Sexp sexp;
+        CancelToken token;
+        Clock::time_point queued;
+        std::shared_ptr<std::promise<Optional<std::string>>> result;
+    };
+
+    // Pop the most urgent job more urgent than `running` (or of any class if
+    // `running` is NUM_PRIORITIES), waiting for one if `block` is set.
+    bool take(int running, bool block, Job &job, int &priority);
+    void run(Job &job, int priority);
+    void work();
+
+    CommandSet commands;
+    std::mutex lock;
+    std::condition_variable ready;
+    std::deque<Job> queues[NUM_PRIORITIES];
+    QueueStats metrics[NUM_PRIORITIES];
+    // Mirrors queues[i].size() so that checkpoints can skip the lock
+    std::atomic<size_t> waiting[NUM_PRIORITIES];
+    bool stopping;
+    std::vector<std::thread> workers;
+};
+
+#endif /* _SCHEDULER_H_ */
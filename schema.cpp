@@ -0,0 +1,507 @@
+#include "schema.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <limits>
+#include <sstream>
+
+// The first byte of a sealed frame. Plain frames start with a serialized
+// bool, which is always 0 or 1.
+static const char SEALED = (char)0xA5;
+
+// Where a node was found: its parent's visit (or NO_PARENT) and its position
+// in the parent, for reporting paths
+struct Visit {
+    const Sexp *node;
+    size_t parent;
+    size_t position;
+    // How many variables are bound at this node
+    size_t bound;
+    // Inside a macro body, where command names must be literal
+    bool in_macro;
+};
+
+static const size_t NO_PARENT = std::numeric_limits<size_t>::max();
+
+std::ostream& operator<<(std::ostream& os, const Diagnostic &diagnostic) {
+    os << "command " << diagnostic.command;
+    for(size_t i = 0; i < diagnostic.path.size(); ++i) {
+        os << (i == 0 ? ", element " : ".") << diagnostic.path[i];
+    }
+    return os << ": " << diagnostic.message;
+}
+
+static std::string plural(size_t n, const char *word) {
+    return std::to_string(n) + " " + word + (n == 1 ? "" : "s");
+}
+
+static std::string number_str(double x) {
+    std::ostringstream out;
+    out << x;
+    return out.str();
+}
+
+// What is wrong with `text` as an argument described by `spec`, or "" if
+// nothing is
+static std::string check_arg(const ArgSchema &spec, const std::string &text) {
+    ArgView arg(text);
+    double value;
+    switch(spec.type) {
+    case ArgType::Integer:
+        if(!arg.is_integer) {
+            return "must be an integer";
+        }
+        value = (double)arg.integer;
+        break;
+
+    case ArgType::Number:
+        if(!arg.is_number) {
+            return "must be a number";
+        }
+        value = arg.number;
+        break;
+
+    case ArgType::Choice:
+        if(!std::binary_search(spec.choices.begin(), spec.choices.end(),
+                               text)) {
+            std::string message = "must be one of";
+            for(const std::string &choice : spec.choices) {
+                message += " " + choice;
+            }
+            return message;
+        }
+        return "";
+
+    default:
+        return "";
+    }
+    if(spec.has_range && (value < spec.min || value > spec.max)) {
+        return "must be between " + number_str(spec.min) + " and "
+            + number_str(spec.max);
+    }
+    return "";
+}
+
+// The number of single-character edits turning `a` into `b`
+static size_t edit_distance(const std::string &a, const std::string &b) {
+    std::vector<size_t> row(b.size() + 1);
+    for(size_t j = 0; j <= b.size(); ++j) {
+        row[j] = j;
+    }
+    for(size_t i = 1; i <= a.size(); ++i) {
+        size_t diagonal = row[0];
+        row[0] = i;
+        for(size_t j = 1; j <= b.size(); ++j) {
+            size_t above = row[j];
+            row[j] = std::min(std::min(row[j] + 1, row[j - 1] + 1),
+                              diagonal + (a[i - 1] == b[j - 1] ? 0 : 1));
+            diagonal = above;
+        }
+    }
+    return row[b.size()];
+}
+
+// Feed `size` bytes into an FNV-1a hash
+static void mix(uint64_t &hash, const void *data, size_t size) {
+    const unsigned char *bytes = (const unsigned char *)data;
+    for(size_t i = 0; i < size; ++i) {
+        hash = (hash ^ bytes[i]) * 1099511628211ULL;
+    }
+}
+
+// The fingerprint is compared across hosts, so every field is fed in a
+// fixed encoding rather than as its in-memory bytes
+static void mix(uint64_t &hash, uint64_t value) {
+    std::byte bytes[sizeof(value)];
+    portable::put_u64(bytes, value);
+    mix(hash, bytes, sizeof(bytes));
+}
+
+static void mix(uint64_t &hash, bool value) {
+    unsigned char byte = value ? 1 : 0;
+    mix(hash, &byte, 1);
+}
+
+static void mix(uint64_t &hash, double value) {
+    static_assert(std::numeric_limits<double>::is_iec559);
+    uint64_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    mix(hash, bits);
+}
+
+static void mix(uint64_t &hash, ArgType type) {
+    unsigned char tag = 0;
+    switch(type) {
+    case ArgType::Any: tag = 0; break;
+    case ArgType::Integer: tag = 1; break;
+    case ArgType::Number: tag = 2; break;
+    case ArgType::Choice: tag = 3; break;
+    }
+    mix(hash, &tag, 1);
+}
+
+static void mix(uint64_t &hash, const std::string &str) {
+    mix(hash, (uint64_t)str.size());
+    mix(hash, str.data(), str.size());
+}
+
+PlanChecker::PlanChecker(const CommandSet &commands)
+    : print(14695981039346656037ULL) {
+    // CommandSet is ordered, so the table comes out sorted by name
+    for(const auto &command : commands) {
+        Entry entry;
+        entry.name = command.first;
+        entry.has_schema = command.second.schema() != nullptr;
+        entry.min_args = 0;
+        entry.max_args = std::numeric_limits<size_t>::max();
+        if(entry.has_schema) {
+            entry.schema = *command.second.schema();
+            for(ArgSchema &arg : entry.schema.args) {
+                std::sort(arg.choices.begin(), arg.choices.end());
+            }
+            size_t n = entry.schema.args.size();
+            entry.min_args = entry.schema.variadic && n > 0 ? n - 1 : n;
+            if(!entry.schema.variadic) {
+                entry.max_args = n;
+            }
+        }
+
+        mix(print, entry.name);
+        mix(print, entry.has_schema);
+        mix(print, entry.schema.variadic);
+        mix(print, (uint64_t)entry.schema.args.size());
+        for(const ArgSchema &arg : entry.schema.args) {
+            mix(print, arg.type);
+            mix(print, arg.has_range);
+            mix(print, arg.min);
+            mix(print, arg.max);
+            mix(print, (uint64_t)arg.choices.size());
+            for(const std::string &choice : arg.choices) {
+                mix(print, choice);
+            }
+        }
+        table.push_back(entry);
+    }
+}
+
+const PlanChecker::Entry *
+PlanChecker::find(const std::string &name,
+                  const std::vector<Entry> &defined) const {
+    std::vector<Entry>::const_iterator it = std::lower_bound(
+        table.begin(), table.end(), name,
+        [](const Entry &entry, const std::string &name) {
+            return entry.name < name;
+        });
+    if(it != table.end() && it->name == name) {
+        return &*it;
+    }
+    for(const Entry &entry : defined) {
+        if(entry.name == name) {
+            return &entry;
+        }
+    }
+    return nullptr;
+}
+
+std::string PlanChecker::suggest(const std::string &name) const {
+    std::string best;
+    size_t best_distance = 3;
+    for(const Entry &entry : table) {
+        size_t distance = edit_distance(name, entry.name);
+        if(distance < best_distance) {
+            best = entry.name;
+            best_distance = distance;
+        }
+    }
+    return best;
+}
+
+void PlanChecker::check_into(const Sexp &s, size_t index,
+                             std::vector<Entry> &defined,
+                             std::vector<Diagnostic> &diagnostics) const {
+    std::vector<Visit> visits;
+    // Visits of lists still to check, next last
+    std::vector<size_t> todo;
+    // Variables bound by enclosing `let` forms
+    std::vector<std::string> vars;
+
+    auto report = [&](size_t visit, std::string message) {
+        Diagnostic diagnostic;
+        diagnostic.command = index;
+        for(size_t v = visit; visits[v].parent != NO_PARENT;
+            v = visits[v].parent) {
+            diagnostic.path.push_back(visits[v].position);
+        }
+        std::reverse(diagnostic.path.begin(), diagnostic.path.end());
+        diagnostic.message = message;
+        diagnostics.push_back(diagnostic);
+    };
+    auto add_visit = [&](const Sexp *node, size_t parent, size_t position,
+                         size_t bound) {
+        bool in_macro = parent != NO_PARENT && visits[parent].in_macro;
+        visits.push_back(Visit{node, parent, position, bound, in_macro});
+        return visits.size() - 1;
+    };
+    // Queue the lists among the elements of `parent` from `first` on, so
+    // that they are checked in order
+    auto queue_lists = [&](size_t parent, size_t first, size_t bound) {
+        const std::list<Sexp> &elements = visits[parent].node->elements;
+        size_t position = elements.size();
+        for(auto el = elements.rbegin(); el != elements.rend(); ++el) {
+            position--;
+            if(position >= first && !el->isAtom) {
+                todo.push_back(add_visit(&*el, parent, position, bound));
+            }
+        }
+    };
+    auto is_var = [&](const std::string &name) {
+        return std::find(vars.begin(), vars.end(), name) != vars.end();
+    };
+    // A command defined by this one, added once its body has been checked
+    // so that the body can't call it
+    bool defines = false;
+    Entry definition;
+
+    if(s.isAtom) {
+        return;
+    }
+    todo.push_back(add_visit(&s, NO_PARENT, 0, 0));
+    while(!todo.empty()) {
+        size_t v = todo.back();
+        todo.pop_back();
+        size_t bound = visits[v].bound;
+        vars.resize(bound);
+        const std::list<Sexp> &elements = visits[v].node->elements;
+        if(elements.empty()) {
+            report(v, "empty command");
+            continue;
+        }
+        const Sexp &head = elements.front();
+        // Macro bodies are compiled when they are defined, so their command
+        // names can't be computed or come from variables
+        if(visits[v].in_macro && (!head.isAtom || is_var(head.atom))) {
+            report(add_visit(&head, v, 0, bound),
+                   "command names in a macro body must be literal");
+            queue_lists(v, 1, bound);
+            continue;
+        }
+        if(!head.isAtom) {
+            // The command name is computed onboard
+            queue_lists(v, 0, bound);
+            continue;
+        }
+        const std::string &name = head.atom;
+        std::list<Sexp>::const_iterator second = std::next(elements.begin());
+
+        if(name == "let") {
+            if(elements.size() < 3 || second->isAtom) {
+                report(v, "let takes bindings and at least one command");
+                continue;
+            }
+            size_t bindings = add_visit(&*second, v, 1, bound);
+            size_t position = 0;
+            for(const Sexp &binding : second->elements) {
+                if(binding.isAtom || binding.elements.size() != 2
+                   || !binding.elements.front().isAtom) {
+                    report(add_visit(&binding, bindings, position, bound),
+                           "let bindings look like (name value)");
+                } else {
+                    vars.push_back(binding.elements.front().atom);
+                }
+                position++;
+            }
+            size_t inner = vars.size();
+            queue_lists(v, 2, inner);
+            // Check the values before the body
+            std::vector<size_t> values;
+            position = 0;
+            for(const Sexp &binding : second->elements) {
+                if(!binding.isAtom && binding.elements.size() == 2
+                   && !binding.elements.back().isAtom) {
+                    size_t b = add_visit(&binding, bindings, position, inner);
+                    values.push_back(add_visit(&binding.elements.back(), b, 1,
+                                               inner));
+                }
+                position++;
+            }
+            todo.insert(todo.end(), values.rbegin(), values.rend());
+        } else if(name == "set!") {
+            if(elements.size() != 3 || !second->isAtom) {
+                report(v, "set! takes a variable and a value");
+            } else if(!is_var(second->atom)) {
+                report(v, "set!: '" + second->atom + "' is not bound");
+            }
+            queue_lists(v, 2, bound);
+        } else if(name == "defmacro" || name == "alias") {
+            if(v != 0) {
+                report(v, name + " must be the whole command");
+                continue;
+            }
+            if(name == "defmacro"
+               ? elements.size() != 4 || !second->isAtom
+               : elements.size() != 3 || !second->isAtom) {
+                report(v, name == "defmacro"
+                       ? "defmacro takes a name, parameters and a body"
+                       : "alias takes a name and a command");
+                continue;
+            }
+            Entry entry;
+            entry.name = second->atom;
+            entry.has_schema = false;
+            entry.min_args = 0;
+            entry.max_args = std::numeric_limits<size_t>::max();
+            if(name == "defmacro") {
+                const Sexp &params = *std::next(second);
+                bool valid = !params.isAtom;
+                for(const Sexp &param : params.elements) {
+                    if(!param.isAtom || is_var(param.atom)) {
+                        valid = false;
+                        break;
+                    }
+                    vars.push_back(param.atom);
+                }
+                if(!valid) {
+                    report(add_visit(&params, v, 2, bound),
+                           "defmacro parameters are distinct names");
+                    continue;
+                }
+                // Macros take exactly their parameters, which are variables
+                // in the body
+                entry.min_args = vars.size();
+                entry.max_args = vars.size();
+                const Sexp &body = elements.back();
+                if(!body.isAtom) {
+                    size_t b = add_visit(&body, v, 3, vars.size());
+                    visits[b].in_macro = true;
+                    todo.push_back(b);
+                }
+            } else {
+                const Sexp &target = elements.back();
+                const Entry *aliased = target.isAtom
+                    ? find(target.atom, defined) : nullptr;
+                if(!aliased) {
+                    report(v, "alias: unknown command '"
+                           + (target.isAtom ? target.atom : "") + "'");
+                    continue;
+                }
+                entry = *aliased;
+                entry.name = second->atom;
+            }
+            defines = true;
+            definition = entry;
+        } else if(name == "at" && v == 0) {
+            // A time-tagged command: (at <time> <command>)
+            if(elements.size() != 3 || !second->isAtom
+               || !ArgView(second->atom).is_integer) {
+                report(v, "at takes an integer time and a command");
+                continue;
+            }
+            queue_lists(v, 2, bound);
+        } else {
+            const Entry *entry = find(name, defined);
+            size_t argc = elements.size() - 1;
+            if(!entry) {
+                if(!is_var(name)) {
+                    std::string message = "unknown command '" + name + "'";
+                    std::string close = suggest(name);
+                    if(close != "") {
+                        message += " (did you mean '" + close + "'?)";
+                    }
+                    report(add_visit(&head, v, 0, bound), message);
+                }
+            } else if(argc < entry->min_args) {
+                report(v, "'" + name + "' takes "
+                       + (entry->max_args == entry->min_args ? ""
+                          : "at least ")
+                       + plural(entry->min_args, "argument") + ", got "
+                       + std::to_string(argc));
+            } else if(argc > entry->max_args) {
+                report(v, "'" + name + "' takes "
+                       + (entry->max_args == entry->min_args ? ""
+                          : "at most ")
+                       + plural(entry->max_args, "argument") + ", got "
+                       + std::to_string(argc));
+            } else if(entry->has_schema) {
+                const std::vector<ArgSchema> &specs = entry->schema.args;
+                size_t position = 1;
+                for(std::list<Sexp>::const_iterator el = second;
+                    el != elements.end(); ++el, ++position) {
+                    if(!el->isAtom || is_var(el->atom)) {
+                        continue;
+                    }
+                    const ArgSchema &spec = specs[std::min(position,
+                                                           specs.size()) - 1];
+                    std::string problem = check_arg(spec, el->atom);
+                    if(problem != "") {
+                        report(add_visit(&*el, v, position, bound),
+                               "argument " + std::to_string(position)
+                               + " (" + spec.name + ") of '" + name + "' "
+                               + problem + ", got '" + el->atom + "'");
+                    }
+                }
+            }
+            queue_lists(v, 1, bound);
+        }
+    }
+    if(defines) {
+        defined.push_back(definition);
+    }
+}
+
+std::vector<Diagnostic> PlanChecker::check(const Sexp &s) const {
+    std::vector<Entry> defined;
+    std::vector<Diagnostic> diagnostics;
+    check_into(s, 0, defined, diagnostics);
+    return diagnostics;
+}
+
+std::vector<Diagnostic>
+PlanChecker::check_plan(const std::vector<Sexp> &plan) const {
+    std::vector<Entry> defined;
+    std::vector<Diagnostic> diagnostics;
+    for(size_t i = 0; i < plan.size(); ++i) {
+        check_into(plan[i], i, defined, diagnostics);
+    }
+    return diagnostics;
+}
+
+Optional<std::string>
+PlanChecker::seal(const Sexp &s, std::vector<Diagnostic> *diagnostics) const {
+    std::vector<Diagnostic> problems = check(s);
+    if(!problems.empty()) {
+        if(diagnostics) {
+            diagnostics->insert(diagnostics->end(), problems.begin(),
+                                problems.end());
+        }
+        return None<std::string>();
+    }
+    std::string frame(1 + sizeof(print), SEALED);
+    portable::put_u64((std::byte *)&frame[1], print);
+    return Just(frame + serialize(s));
+}
+
+Optional<Sexp> PlanChecker::admit(const std::string &frame,
+                                  std::vector<Diagnostic> *diagnostics) const {
+    Sexp s;
+    if(!frame.empty() && frame[0] == SEALED) {
+        if(frame.size() < 1 + sizeof(print)) {
+            throw cereal::Exception("Failed to read sealed frame header");
+        }
+        uint64_t sealed_with = portable::get_u64(frame.substr(1, sizeof(print)));
+        s = deserialize(frame.substr(1 + sizeof(print)));
+        if(sealed_with == print) {
+            return Just(s);
+        }
+    } else {
+        s = deserialize(frame);
+    }
+    std::vector<Diagnostic> problems = check(s);
+    if(!problems.empty()) {
+        if(diagnostics) {
+            diagnostics->insert(diagnostics->end(), problems.begin(),
+                                problems.end());
+        }
+        return None<Sexp>();
+    }
+    return Just(s);
+}
@@ -0,0 +1,95 @@
+#ifndef _SCHEMA_H_
+#define _SCHEMA_H_
+
+#include "interp.hpp"
+
+#include <cstdint>
+#include <iostream>
+#include <string>
+#include <vector>
+
+// A problem found in a plan before uplink
+struct Diagnostic {
+    // The command in the plan
+    size_t command;
+    // The element positions leading from the command to the offending node,
+    // e.g. {2, 1} for `x` in `(add 1 (sub x))`
+    std::vector<size_t> path;
+    std::string message;
+};
+
+// Print a diagnostic as "command 3, element 2.1: <message>"
+std::ostream& operator<<(std::ostream& os, const Diagnostic &diagnostic);
+
+// Checks plans against the argument schemas of a command set.
+//
+// The schemas are compiled into a sorted table when the checker is made, so
+// checking a plan is a single walk over each command with a binary search
+// per call. Every call is checked for a known command name and the
+// right number of arguments, and every literal argument for its type, range
+// or allowed values. Arguments computed by nested commands, and variables
+// bound by `let`, are only known onboard and are not checked.
+// Commands without a schema are only checked to exist.
+//
+// The ground tool runs `seal` on each command before uplink; the flight side
+// runs `admit` on each frame it receives, which checks unsealed frames and
+// trusts frames sealed against the same schemas.
+class PlanChecker {
+public:
+    explicit PlanChecker(const CommandSet &commands);
+
+    // Check one command
+    std::vector<Diagnostic> check(const Sexp &s) const;
+
+    // Check every command in a plan. Names defined by `defmacro` and
+    // `alias` in earlier commands are known to later ones.
+    std::vector<Diagnostic> check_plan(const std::vector<Sexp> &plan) const;
+
+    // Identifies the schemas this checker enforces
+    uint64_t fingerprint() const { return print; }
+
+    // Serialize `s` into a frame marked as validated, or give None if it has
+    // problems (which are added to `diagnostics`, if given)
+    Optional<std::string> seal(const Sexp &s,
+                               std::vector<Diagnostic> *diagnostics
+                               = nullptr) const;
+
+    // Decode a frame on the flight side. Frames sealed by a checker with the
+    // same fingerprint are not checked again; plain frames, and frames
+    // sealed against other schemas, are checked here. Gives None if the
+    // command has problems (which are added to `diagnostics`, if given).
+    // throws: cereal::Exception if the frame is malformed
+    Optional<Sexp> admit(const std::string &frame,
+                         std::vector<Diagnostic> *diagnostics
+                         = nullptr) const;
+
+    // A compiled command schema
+    struct Entry {
+        std::string name;
+        // Commands without a schema are only checked to exist
+        bool has_schema;
+        // With each Choice argument's choices sorted
+        Schema schema;
+        size_t min_args;
+        size_t max_args;
+    };
+
+private:
+    // Look a command up by name, in the table and then in `defined`
+    const Entry *find(const std::string &name,
+                      const std::vector<Entry> &defined) const;
+
+    // Check one command, appending to `diagnostics` and recording its
+    // definitions in `defined`
+    void check_into(const Sexp &s, size_t index, std::vector<Entry> &defined,
+                    std::vector<Diagnostic> &diagnostics) const;
+
+    // The closest known name to `name`, if any is close
+    std::string suggest(const std::string &name) const;
+
+    // Sorted by name
+    std::vector<Entry> table;
+    uint64_t print;
+};
+
+#endif /* _SCHEMA_H_ */
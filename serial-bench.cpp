@@ -0,0 +1,363 @@
+// Benchmarks every serialization format for commands on a synthetic corpus
+// and writes the results as JSON, for tracking over time:
+//
+//   ./serial-bench [--commands N] [--depth N] [--width N] [--atom N]
+//                  [--seed N] [--repeat N] [--out FILE]
+
+#include "interp.hpp"
+#include "compact.hpp"
+#include "compress.hpp"
+#include "packed.hpp"
+#include "sexp-json.hpp"
+#include "sexp-view.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <charconv>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <new>
+#include <random>
+#include <span>
+#include <sstream>
+#include <vector>
+
+// Found through -isystem, so that warnings in the bundled rapidjson and
+// rapidxml aren't reported as ours
+#include <cereal/archives/binary.hpp>
+#include <cereal/archives/json.hpp>
+#include <cereal/archives/portable_binary.hpp>
+#include <cereal/archives/xml.hpp>
+
+// Heap allocations made so far
+std::atomic<size_t> allocations(0);
+
+void *operator new(size_t size) {
+    allocations++;
+    void *p = malloc(size);
+    if(!p) {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void operator delete(void *p) noexcept {
+    free(p);
+}
+
+void operator delete(void *p, size_t) noexcept {
+    free(p);
+}
+
+typedef std::chrono::steady_clock Clock;
+
+static double to_ms(Clock::duration d) {
+    return std::chrono::duration<double, std::milli>(d).count();
+}
+
+// The shape of the generated commands
+struct CorpusOptions {
+    size_t commands = 20000;
+    // How deeply lists nest below the command itself
+    size_t depth = 2;
+    // The most elements in a list, including its command name
+    size_t width = 5;
+    // The longest atom, in bytes
+    size_t atom = 8;
+    unsigned seed = 1;
+};
+
+// Random commands: each list starts with a name and has up to
+// `options.width` elements, each either an atom or, above the deepest
+// level, a nested command
+std::vector<Sexp> generate_corpus(const CorpusOptions &options) {
+    std::mt19937 rng(options.seed);
+    const char alphabet[] = "abcdefghijklmnopqrstuvwxyz0123456789-";
+    auto atom = [&]() {
+        Sexp s;
+        s.isAtom = true;
+        size_t length = 1 + rng() % options.atom;
+        for(size_t i = 0; i < length; ++i) {
+            s.atom.push_back(alphabet[rng() % (sizeof(alphabet) - 1)]);
+        }
+        return s;
+    };
+
+    std::vector<Sexp> corpus;
+    for(size_t i = 0; i < options.commands; ++i) {
+        corpus.push_back(Sexp());
+        // Lists still to fill, with how many levels may nest below them
+        std::vector<std::pair<Sexp *, size_t>> open;
+        open.push_back(std::make_pair(&corpus.back(), options.depth));
+        while(!open.empty()) {
+            std::pair<Sexp *, size_t> top = open.back();
+            open.pop_back();
+            top.first->elements.push_back(atom());
+            size_t size = 1 + rng() % std::max<size_t>(options.width, 1);
+            for(size_t j = 1; j < size; ++j) {
+                if(top.second > 0 && rng() % 4 == 0) {
+                    top.first->elements.push_back(Sexp());
+                    open.push_back(std::make_pair(&top.first->elements.back(),
+                                                  top.second - 1));
+                } else {
+                    top.first->elements.push_back(atom());
+                }
+            }
+        }
+    }
+    return corpus;
+}
+
+// A format under test: how to encode a command into a frame, and how to
+// decode it again
+struct Format {
+    const char *name;
+    std::function<void(const Sexp &, std::string &)> encode;
+    std::function<void(const std::string &)> decode;
+};
+
+template<class Output>
+void cereal_encode(const Sexp &s, std::string &frame) {
+    std::ostringstream out;
+    {
+        Output archive(out);
+        archive(s);
+    }
+    frame = out.str();
+}
+
+template<class Input>
+void cereal_decode(const std::string &frame) {
+    std::istringstream in(frame);
+    Input archive(in);
+    Sexp s;
+    archive(s);
+}
+
+struct Result {
+    const char *name;
+    double bytes_per_command;
+    double encode_ms;
+    double decode_ms;
+    double encode_allocations;
+    double decode_allocations;
+};
+
+// Encode and decode the corpus `repeat` times, keeping the fastest run
+Result measure(const Format &format, const std::vector<Sexp> &corpus,
+               size_t repeat) {
+    Result result{format.name, 0, 1e300, 1e300, 0, 0};
+    std::vector<std::string> frames(corpus.size());
+    for(size_t r = 0; r < repeat; ++r) {
+        size_t before = allocations;
+        Clock::time_point start = Clock::now();
+        for(size_t i = 0; i < corpus.size(); ++i) {
+            format.encode(corpus[i], frames[i]);
+        }
+        result.encode_ms = std::min(result.encode_ms,
+                                    to_ms(Clock::now() - start));
+        result.encode_allocations = allocations - before;
+
+        before = allocations;
+        start = Clock::now();
+        for(const std::string &frame : frames) {
+            format.decode(frame);
+        }
+        result.decode_ms = std::min(result.decode_ms,
+                                    to_ms(Clock::now() - start));
+        result.decode_allocations = allocations - before;
+    }
+    size_t bytes = 0;
+    for(const std::string &frame : frames) {
+        bytes += frame.size();
+    }
+    result.bytes_per_command = (double)bytes / corpus.size();
+    result.encode_allocations /= corpus.size();
+    result.decode_allocations /= corpus.size();
+    return result;
+}
+
+void write_json(std::ostream &out, const CorpusOptions &options,
+                size_t repeat, const std::vector<Result> &results) {
+    out << "{\n  \"corpus\": {\"commands\": " << options.commands
+        << ", \"depth\": " << options.depth << ", \"width\": "
+        << options.width << ", \"atom\": " << options.atom
+        << ", \"seed\": " << options.seed << "},\n  \"repeat\": " << repeat
+        << ",\n  \"formats\": [";
+    for(size_t i = 0; i < results.size(); ++i) {
+        const Result &r = results[i];
+        double mb = r.bytes_per_command * options.commands / 1e6;
+        out << (i ? ",\n" : "\n") << "    {\"name\": \"" << r.name
+            << "\", \"bytes_per_command\": " << r.bytes_per_command
+            << ", \"encode_mb_per_s\": " << mb / r.encode_ms * 1000
+            << ", \"decode_mb_per_s\": " << mb / r.decode_ms * 1000
+            << ", \"encode_commands_per_s\": "
+            << options.commands / r.encode_ms * 1000
+            << ", \"decode_commands_per_s\": "
+            << options.commands / r.decode_ms * 1000
+            << ", \"encode_allocations_per_command\": "
+            << r.encode_allocations
+            << ", \"decode_allocations_per_command\": "
+            << r.decode_allocations << "}";
+    }
+    out << "\n  ]\n}\n";
+}
+
+// Read a whole non-negative number, giving false for anything else (such as
+// a negative number, which atol would turn into a huge size)
+static bool parse_count(const char *text, size_t &value) {
+    const char *end = text + strlen(text);
+    unsigned long long n;
+    std::from_chars_result r = std::from_chars(text, end, n);
+    if(r.ec != std::errc() || r.ptr != end) {
+        return false;
+    }
+    value = n;
+    return true;
+}
+
+int main(int argc, char *argv[]) {
+    CorpusOptions options;
+    size_t repeat = 3;
+    const char *out_path = nullptr;
+    for(int i = 1; i < argc; ++i) {
+        const char *value = i + 1 < argc ? argv[i + 1] : nullptr;
+        size_t n = 0;
+        bool valid = value && parse_count(value, n);
+        if(strcmp(argv[i], "--out") == 0 && value) {
+            out_path = value;
+        } else if(strcmp(argv[i], "--commands") == 0 && valid) {
+            options.commands = std::max<size_t>(n, 1);
+        } else if(strcmp(argv[i], "--depth") == 0 && valid) {
+            options.depth = n;
+        } else if(strcmp(argv[i], "--width") == 0 && valid) {
+            options.width = n;
+        } else if(strcmp(argv[i], "--atom") == 0 && valid) {
+            options.atom = std::max<size_t>(n, 1);
+        } else if(strcmp(argv[i], "--seed") == 0 && valid) {
+            options.seed = (unsigned)n;
+        } else if(strcmp(argv[i], "--repeat") == 0 && valid) {
+            repeat = std::max<size_t>(n, 1);
+        } else {
+            std::cerr << "usage: " << argv[0] << " [--commands N] [--depth N]"
+                      << " [--width N] [--atom N] [--seed N] [--repeat N]"
+                      << " [--out FILE]" << std::endl;
+            return 1;
+        }
+        i++;
+    }
+
+    std::vector<Sexp> corpus = generate_corpus(options);
+    // Train on a separate sample, as the dictionary would be in use
+    CorpusOptions training = options;
+    training.seed = options.seed + 1;
+    training.commands = std::min<size_t>(options.commands, 2000);
+    std::vector<std::string> samples;
+    for(const Sexp &s : generate_corpus(training)) {
+        samples.push_back(serialize_compact(s));
+    }
+    LzDictionary lz = LzDictionary::train(samples);
+    // Every command name in the corpus takes any number of arguments, so
+    // commands whose arguments are all atoms pack and the rest fall back
+    // to the compact format
+    CommandSet schemas;
+    for(const Sexp &s : corpus) {
+        schemas[s.elements.front().atom] = Command(
+            [](std::list<std::string>) { return std::string(); })
+            .with_schema(Schema{{ArgSchema::any("arg")}, true});
+    }
+    ArgPacker packer(schemas);
+    // Limits as tight as the corpus allows, so that every check is made
+    FrameLimits limits;
+    limits.max_frame = 0;
+    for(const Sexp &s : corpus) {
+        limits.max_frame = std::max(limits.max_frame, serialized_size(s));
+    }
+    limits.max_nodes = limits.max_frame;
+    limits.max_depth = options.depth + 1;
+    limits.max_atom = options.atom;
+
+    std::vector<Format> formats = {
+        {"serialize",
+         [](const Sexp &s, std::string &frame) { frame = serialize(s); },
+         [](const std::string &frame) { deserialize(frame); }},
+        // Into the frame left from the last run, reusing its memory
+        {"serialize_into",
+         [](const Sexp &s, std::string &frame) {
+             frame.resize(serialized_size(s));
+             serialize_into(s, std::as_writable_bytes(std::span<char>(frame)));
+         },
+         [](const std::string &frame) { deserialize(frame); }},
+        // Decoded as an untrusted uplink frame would be
+        {"serialize_bounded",
+         [](const Sexp &s, std::string &frame) { frame = serialize(s); },
+         [&](const std::string &frame) { deserialize_bounded(frame, limits); }},
+        {"portable",
+         [](const Sexp &s, std::string &frame) {
+             frame = serialize_portable(s);
+         },
+         [](const std::string &frame) { deserialize_portable(frame); }},
+        // As a big-endian host would, a byte at a time
+        {"portable_bytewise",
+         [](const Sexp &s, std::string &frame) {
+             frame.resize(serialized_portable_size(s));
+             portable::serialize_into<false>(
+                 s, std::as_writable_bytes(std::span<char>(frame)));
+         },
+         [](const std::string &frame) {
+             portable::deserialize<false>(frame);
+         }},
+        {"compact",
+         [](const Sexp &s, std::string &frame) {
+             frame = serialize_compact(s);
+         },
+         [](const std::string &frame) { deserialize_compact(frame); }},
+        // Decoding only checks the frame, as interp_view does before
+        // running it in place
+        {"compact_view",
+         [](const Sexp &s, std::string &frame) {
+             frame = serialize_compact(s);
+         },
+         [](const std::string &frame) { SexpView view(frame); }},
+        {"packed",
+         [&](const Sexp &s, std::string &frame) { frame = packer.pack(s); },
+         [&](const std::string &frame) { packer.unpack(frame); }},
+        {"compact_lz",
+         [&](const Sexp &s, std::string &frame) {
+             frame = compress(serialize_compact(s), lz);
+         },
+         [&](const std::string &frame) {
+             deserialize_compact(decompress(frame, lz));
+         }},
+        // As mission-planning tools exchange plans
+        {"json",
+         [](const Sexp &s, std::string &frame) { frame = to_json(s); },
+         [](const std::string &frame) { from_json(frame); }},
+        {"cereal_binary", cereal_encode<cereal::BinaryOutputArchive>,
+         cereal_decode<cereal::BinaryInputArchive>},
+        {"cereal_portable_binary",
+         cereal_encode<cereal::PortableBinaryOutputArchive>,
+         cereal_decode<cereal::PortableBinaryInputArchive>},
+        {"cereal_json", cereal_encode<cereal::JSONOutputArchive>,
+         cereal_decode<cereal::JSONInputArchive>},
+        {"cereal_xml", cereal_encode<cereal::XMLOutputArchive>,
+         cereal_decode<cereal::XMLInputArchive>},
+    };
+
+    std::vector<Result> results;
+    for(const Format &format : formats) {
+        results.push_back(measure(format, corpus, repeat));
+        std::cerr << format.name << " done" << std::endl;
+    }
+    if(out_path) {
+        std::ofstream out(out_path);
+        write_json(out, options, repeat, results);
+    } else {
+        write_json(std::cout, options, repeat, results);
+    }
+    return 0;
+}
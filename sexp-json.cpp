@@ -0,0 +1,254 @@
+#include "sexp-json.hpp"
+
+#include <list>
+#include <sstream>
+#include <utility>
+#include <vector>
+
+#include "cereal/external/rapidjson/error/en.h"
+#include "cereal/external/rapidjson/memorystream.h"
+#include "cereal/external/rapidjson/ostreamwrapper.h"
+#include "cereal/external/rapidjson/reader.h"
+#include "cereal/external/rapidjson/writer.h"
+
+typedef rapidjson::Writer<rapidjson::OStreamWrapper> JsonWriter;
+
+// Write `s` to `writer` from an explicit stack
+static void put_sexp(JsonWriter &writer, const Sexp &s) {
+    if(s.isAtom) {
+        writer.String(s.atom.data(), (rapidjson::SizeType)s.atom.size());
+        return;
+    }
+    typedef std::list<Sexp>::const_iterator Iter;
+    std::vector<std::pair<Iter, Iter>> open;
+    writer.StartArray();
+    open.push_back(std::make_pair(s.elements.cbegin(), s.elements.cend()));
+    while(!open.empty()) {
+        std::pair<Iter, Iter> &top = open.back();
+        if(top.first == top.second) {
+            writer.EndArray();
+            open.pop_back();
+            continue;
+        }
+        const Sexp &el = *top.first++;
+        if(el.isAtom) {
+            writer.String(el.atom.data(),
+                          (rapidjson::SizeType)el.atom.size());
+        } else {
+            writer.StartArray();
+            open.push_back(std::make_pair(el.elements.cbegin(),
+                                          el.elements.cend()));
+        }
+    }
+}
+
+void write_json(std::ostream &out, const Sexp &s) {
+    rapidjson::OStreamWrapper stream(out);
+    JsonWriter writer(stream);
+    put_sexp(writer, s);
+}
+
+std::string to_json(const Sexp &s) {
+    std::ostringstream out;
+    write_json(out, s);
+    return out.str();
+}
+
+struct JsonPlanWriter::Impl {
+    rapidjson::OStreamWrapper stream;
+    JsonWriter writer;
+    bool finished;
+
+    explicit Impl(std::ostream &out)
+        : stream(out), writer(stream), finished(false) {
+        writer.StartArray();
+    }
+};
+
+JsonPlanWriter::JsonPlanWriter(std::ostream &out) : impl(new Impl(out)) {}
+
+JsonPlanWriter::~JsonPlanWriter() {
+    finish();
+}
+
+void JsonPlanWriter::add(const Sexp &s) {
+    put_sexp(impl->writer, s);
+}
+
+void JsonPlanWriter::finish() {
+    if(!impl->finished) {
+        impl->writer.EndArray();
+        impl->finished = true;
+    }
+}
+
+// Builds commands from SAX events. Below `base` levels of arrays, each
+// value is a command, passed to `each` once it is complete.
+class SexpHandler
+    : public rapidjson::BaseReaderHandler<rapidjson::UTF8<>, SexpHandler> {
+public:
+    SexpHandler(size_t base, const std::function<void(Sexp &&)> &each)
+        : base(base), depth(0), count(0), each(each) {}
+
+    bool String(const char *str, rapidjson::SizeType length, bool) {
+        return atom(str, length);
+    }
+    bool RawNumber(const char *str, rapidjson::SizeType length, bool) {
+        return atom(str, length);
+    }
+    bool Bool(bool b) {
+        return b ? atom("true", 4) : atom("false", 5);
+    }
+
+    bool StartArray() {
+        if(depth++ < base) {
+            return true;
+        }
+        Sexp *list = open.empty() ? &current : add();
+        list->isAtom = false;
+        open.push_back(list);
+        return true;
+    }
+    bool EndArray(rapidjson::SizeType) {
+        if(depth-- <= base) {
+            return true;
+        }
+        open.pop_back();
+        if(open.empty()) {
+            done();
+        }
+        return true;
+    }
+
+    // Objects and nulls have no meaning as commands
+    bool Default() {
+        error = "objects and nulls can't be commands";
+        return false;
+    }
+
+    size_t commands() const { return count; }
+
+    std::string error;
+
+private:
+    bool atom(const char *str, size_t length) {
+        if(depth < base) {
+            error = "expected an array of commands";
+            return false;
+        }
+        Sexp *node = open.empty() ? &current : add();
+        node->isAtom = true;
+        node->atom.assign(str, length);
+        if(open.empty()) {
+            done();
+        }
+        return true;
+    }
+
+    // A new element at the end of the innermost open list
+    Sexp *add() {
+        open.back()->elements.push_back(Sexp());
+        return &open.back()->elements.back();
+    }
+
+    void done() {
+        count++;
+        each(std::move(current));
+        current = Sexp();
+    }
+
+    size_t base;
+    size_t depth;
+    size_t count;
+    Sexp current;
+    // The lists being filled, innermost last
+    std::vector<Sexp *> open;
+    const std::function<void(Sexp &&)> &each;
+};
+
+// Parse iteratively, so that deep nesting can't overflow the stack, and
+// keep numbers' text as it is
+static const unsigned PARSE_FLAGS = rapidjson::kParseIterativeFlag
+    | rapidjson::kParseNumbersAsStringsFlag
+    | rapidjson::kParseStopWhenDoneFlag;
+
+// throws: JsonError
+template<class Stream>
+static void parse(Stream &stream, SexpHandler &handler) {
+    rapidjson::Reader reader;
+    rapidjson::ParseResult result = reader.Parse<PARSE_FLAGS>(stream, handler);
+    if(result.IsError()) {
+        throw JsonError((handler.error.empty()
+                         ? std::string(rapidjson::GetParseError_En(
+                                           result.Code()))
+                         : handler.error)
+                        + " at offset " + std::to_string(result.Offset()));
+    }
+    rapidjson::SkipWhitespace(stream);
+    if(stream.Peek() != '\0') {
+        throw JsonError("trailing characters at offset "
+                        + std::to_string(stream.Tell()));
+    }
+}
+
+Sexp from_json(std::string_view json) {
+    Sexp s;
+    std::function<void(Sexp &&)> keep = [&s](Sexp &&command) {
+        s = std::move(command);
+    };
+    SexpHandler handler(0, keep);
+    rapidjson::MemoryStream stream(json.data(), json.size());
+    parse(stream, handler);
+    return s;
+}
+
+// A rapidjson input stream reading `in` a block at a time, which is much
+// faster than IStreamWrapper's character at a time
+class BlockStream {
+public:
+    typedef char Ch;
+
+    explicit BlockStream(std::istream &in)
+        : in(in), buffer(65536), pos(0), end(0), consumed(0) {
+        fill();
+    }
+
+    Ch Peek() const { return pos < end ? buffer[pos] : '\0'; }
+    Ch Take() {
+        Ch c = Peek();
+        if(pos < end && ++pos == end) {
+            fill();
+        }
+        return c;
+    }
+    size_t Tell() const { return consumed + pos; }
+
+    // Writing is never used
+    Ch *PutBegin() { return nullptr; }
+    void Put(Ch) {}
+    void Flush() {}
+    size_t PutEnd(Ch *) { return 0; }
+
+private:
+    void fill() {
+        consumed += end;
+        in.read(buffer.data(), buffer.size());
+        pos = 0;
+        end = in.gcount();
+    }
+
+    std::istream &in;
+    std::vector<char> buffer;
+    size_t pos;
+    size_t end;
+    // Characters in earlier blocks
+    size_t consumed;
+};
+
+size_t read_json_plan(std::istream &in,
+                      const std::function<void(Sexp &&)> &each) {
+    SexpHandler handler(1, each);
+    BlockStream stream(in);
+    parse(stream, handler);
+    return handler.commands();
+}
@@ -0,0 +1,62 @@
+#ifndef _SEXP_JSON_H_
+#define _SEXP_JSON_H_
+
+#include "interp.hpp"
+
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+
+// Commands as JSON, for exchanging plans with mission-planning tools.
+//
+// An atom is a JSON string and a list a JSON array, so `(hi (joe 1))` is
+// `["hi",["joe","1"]]`. A plan is an array of commands. When reading,
+// numbers and booleans are also taken as atoms, keeping their text.
+//
+// Conversion streams through rapidjson's SAX Writer and Reader without
+// building a document, and neither direction recurses, so memory use
+// depends only on the largest command and how deeply it nests.
+
+// Thrown when JSON doesn't hold a command or plan
+class JsonError : public std::runtime_error {
+public:
+    explicit JsonError(const std::string &what) : std::runtime_error(what) {}
+};
+
+// Write a command as JSON
+void write_json(std::ostream &out, const Sexp &s);
+
+std::string to_json(const Sexp &s);
+
+// Read one command from JSON
+// throws: JsonError if the JSON is malformed, has objects or nulls, or has
+// anything after the command
+Sexp from_json(std::string_view json);
+
+// Writes a plan as a JSON array, one command at a time
+class JsonPlanWriter {
+public:
+    // `out` must outlive the writer
+    explicit JsonPlanWriter(std::ostream &out);
+    ~JsonPlanWriter();
+
+    void add(const Sexp &s);
+
+    // Close the array. Done by the destructor if not called before.
+    void finish();
+
+private:
+    struct Impl;
+    std::unique_ptr<Impl> impl;
+};
+
+// Read a plan, a JSON array of commands, calling `each` with every command
+// as soon as it is complete. Returns the number of commands.
+// throws: JsonError as from_json, or if the plan isn't an array
+size_t read_json_plan(std::istream &in,
+                      const std::function<void(Sexp &&)> &each);
+
+#endif /* _SEXP_JSON_H_ */
@@ -0,0 +1,238 @@
+#include "sexp-view.hpp"
+
+#include <cstring>
+#include <list>
+#include <span>
+#include <utility>
+#include <vector>
+
+// Is `atom` the name of a special form?
+static bool is_form_name(std::string_view atom) {
+    return atom == "let" || atom == "set!" || atom == "defmacro"
+        || atom == "alias" || atom == "at";
+}
+
+// Read the node at the reader's position
+// throws: FrameError
+static NodeView read_node(CompactReader &in, const Dictionary *dictionary) {
+    NodeView node;
+    node.offset = in.offset();
+    uint64_t length;
+    unsigned char kind = in.tag(length);
+    node.isAtom = kind != compact::LIST;
+    node.size = 0;
+    if(kind == compact::ATOM) {
+        node.atom = std::string_view(in.take(length), length);
+    } else if(kind == compact::SYMBOL && dictionary) {
+        node.atom = dictionary->symbol(length);
+    } else if(kind == compact::LIST) {
+        node.size = length;
+    } else if(kind == compact::SYMBOL) {
+        throw FrameError("symbol code in a frame without a dictionary header");
+    } else {
+        throw FrameError("unknown node kind");
+    }
+    node.body = in.offset();
+    return node;
+}
+
+SexpView::SexpView(std::string_view frame, const Dictionary *dictionary)
+    : bytes(frame), dict(dictionary), start(0), count(0), forms(false) {
+    CompactReader in(frame);
+    if(dictionary && in.peek() == compact::HEADER) {
+        uint64_t version;
+        in.tag(version);
+        if(version != dictionary->version()) {
+            throw FrameError("frame uses dictionary version "
+                             + std::to_string(version) + ", not "
+                             + std::to_string(dictionary->version()));
+        }
+    } else {
+        // Without a header, symbol codes have no dictionary to refer to
+        dict = nullptr;
+        dictionary = nullptr;
+    }
+    start = in.offset();
+    // In pre-order, one counter of the nodes still expected is enough to
+    // check the structure: each node is one of them, and each list adds its
+    // elements
+    uint64_t pending = 1;
+    bool at_head = false;
+    while(pending > 0) {
+        NodeView node = read_node(in, dictionary);
+        pending--;
+        count++;
+        if(node.isAtom) {
+            forms = forms || (at_head && is_form_name(node.atom));
+        } else if(node.size > frame.size() - in.offset()) {
+            // Every element takes at least a byte
+            throw FrameError("list longer than frame");
+        } else {
+            pending += node.size;
+        }
+        at_head = !node.isAtom && node.size > 0;
+    }
+    if(!in.done()) {
+        throw FrameError("trailing bytes after command");
+    }
+}
+
+NodeView SexpView::node_at(size_t offset) const {
+    CompactReader in(bytes, offset);
+    return read_node(in, dict);
+}
+
+NodeView SexpView::next(const NodeView &node) const {
+    CompactReader in(bytes, node.body);
+    uint64_t pending = node.size;
+    while(pending > 0) {
+        pending += read_node(in, dict).size - 1;
+    }
+    return read_node(in, dict);
+}
+
+Sexp SexpView::to_sexp() const {
+    CompactReader in(bytes, start);
+    Sexp sexp;
+    // Lists being filled, innermost last, with their remaining element count
+    std::vector<std::pair<Sexp *, uint64_t>> open;
+    NodeView node = read_node(in, dict);
+    sexp.isAtom = node.isAtom;
+    sexp.atom = node.atom;
+    open.push_back(std::make_pair(&sexp, node.size));
+    while(!open.empty()) {
+        if(open.back().second == 0) {
+            open.pop_back();
+            continue;
+        }
+        open.back().second--;
+        Sexp *parent = open.back().first;
+        parent->elements.push_back(Sexp());
+        Sexp &el = parent->elements.back();
+        node = read_node(in, dict);
+        el.isAtom = node.isAtom;
+        el.atom = node.atom;
+        if(node.size > 0) {
+            open.push_back(std::make_pair(&el, node.size));
+        }
+    }
+    return sexp;
+}
+
+std::ostream& operator<<(std::ostream& os, const SexpView &view) {
+    return os << view.to_sexp();
+}
+
+// The buffers used by interp_view, kept per thread so that they are reused
+// from one evaluation to the next
+struct ViewEvalStacks {
+    // A list being evaluated: how many of its elements are still to come,
+    // and where its values start in `values`
+    struct Level {
+        uint64_t remaining;
+        size_t base;
+    };
+    std::vector<Level> open;
+    std::vector<std::string> values;
+    std::vector<ArgView> views;
+    // Is an evaluation using these buffers?
+    bool busy = false;
+};
+
+static thread_local ViewEvalStacks view_eval_stacks;
+
+// Call the command named by values[base] with the values after it, leaving
+// the result in values[base]
+// throws: DeadlineExceeded
+static void call_from_values(ViewEvalStacks &stacks,
+                             const CommandSet &commands, size_t base,
+                             const CancelToken &token) {
+    std::vector<std::string> &values = stacks.values;
+    const std::string &name = values[base];
+    std::string result;
+    CommandSet::const_iterator it = commands.find(name);
+    if(it == commands.end()) {
+        result = "Error: Command '" + name + "' undefined.";
+    } else {
+        try {
+            if(it->second.takes_views()) {
+                stacks.views.clear();
+                for(size_t i = base + 1; i < values.size(); ++i) {
+                    stacks.views.push_back(ArgView(values[i]));
+                }
+                result = it->second.call(
+                    std::span<const ArgView>(stacks.views), token);
+            } else {
+                std::list<std::string> args(values.begin() + base + 1,
+                                            values.end());
+                result = it->second.call(args, token);
+            }
+            // Abandon results of commands that overran their budget
+            token.check();
+        } catch(const std::invalid_argument &e) {
+            result = "Error: invalid argument: " + std::string(e.what());
+        } catch(const std::bad_function_call &e) {
+            result = "Error: Command '" + name + "' undefined.";
+        }
+    }
+    values.resize(base + 1);
+    values[base].swap(result);
+}
+
+Optional<std::string> interp_view(const SexpView &view,
+                                  const CommandSet &commands,
+                                  CancelToken token) {
+    if(view.has_forms()) {
+        return interp_with(view.to_sexp(), commands, token);
+    }
+    // Evaluations started by a command get buffers of their own
+    ViewEvalStacks nested;
+    ViewEvalStacks &stacks = view_eval_stacks.busy ? nested
+        : view_eval_stacks;
+    struct Busy {
+        ViewEvalStacks &stacks;
+        explicit Busy(ViewEvalStacks &stacks) : stacks(stacks) {
+            stacks.busy = true;
+            stacks.open.clear();
+            stacks.values.clear();
+        }
+        ~Busy() { stacks.busy = false; }
+    } busy(stacks);
+
+    // The frame was checked when the view was made, so reading it again
+    // cannot fail
+    CompactReader in(view.frame(), view.root().offset);
+    try {
+        while(true) {
+            token.check();
+            NodeView node = read_node(in, view.dictionary());
+            if(!node.isAtom) {
+                if(node.size == 0) {
+                    std::cout << "Error: element fails interp: ()"
+                              << std::endl;
+                    return None<std::string>();
+                }
+                stacks.open.push_back(ViewEvalStacks::Level{
+                        node.size, stacks.values.size()});
+                continue;
+            }
+            stacks.values.emplace_back(node.atom);
+
+            // Call every list this completes
+            while(true) {
+                if(stacks.open.empty()) {
+                    return Just(stacks.values.back());
+                }
+                ViewEvalStacks::Level &top = stacks.open.back();
+                if(--top.remaining > 0) {
+                    break;
+                }
+                size_t base = top.base;
+                stacks.open.pop_back();
+                call_from_values(stacks, commands, base, token);
+            }
+        }
+    } catch(const DeadlineExceeded &e) {
+        return Just(std::string("Error: deadline exceeded."));
+    }
+}
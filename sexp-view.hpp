@@ -0,0 +1,79 @@
+#ifndef _SEXP_VIEW_H_
+#define _SEXP_VIEW_H_
+
+#include "compact.hpp"
+#include "interp.hpp"
+
+#include <iostream>
+#include <string_view>
+
+// One node of a SexpView. Atoms point into the frame (or the dictionary).
+struct NodeView {
+    bool isAtom;
+    std::string_view atom;
+    // The number of elements, for lists
+    uint64_t size;
+    // Where the node's tag starts, and where its first element (or the next
+    // node, for atoms) starts
+    size_t offset;
+    size_t body;
+};
+
+// A read-only view of a command in the compact format (see compact.hpp),
+// decoded in place.
+//
+// The frame is checked in a single pass when the view is made, without
+// allocating; after that its nodes can be read, or the command interpreted
+// with `interp_view`, straight from the frame. The frame (and dictionary,
+// if any) must outlive the view.
+class SexpView {
+public:
+    // throws: FrameError if `frame` is not a whole, well-formed command, or
+    // was written with a different dictionary
+    explicit SexpView(std::string_view frame,
+                      const Dictionary *dictionary = nullptr);
+
+    NodeView root() const { return node_at(start); }
+
+    // The first element of a non-empty list
+    NodeView first(const NodeView &list) const { return node_at(list.body); }
+
+    // The node after `node` and everything inside it. Only valid if `node`
+    // is not the last element of its list. Takes time proportional to the
+    // size of `node`.
+    NodeView next(const NodeView &node) const;
+
+    // The number of nodes in the command
+    size_t nodes() const { return count; }
+
+    // Does the command use `let`, `set!`, `defmacro`, `alias` or `at`?
+    bool has_forms() const { return forms; }
+
+    std::string_view frame() const { return bytes; }
+    const Dictionary *dictionary() const { return dict; }
+
+    // Copy the command into a Sexp
+    Sexp to_sexp() const;
+
+private:
+    NodeView node_at(size_t offset) const;
+
+    std::string_view bytes;
+    const Dictionary *dict;
+    // Where the root node starts, after any header
+    size_t start;
+    size_t count;
+    bool forms;
+};
+
+// Interpret a command straight from its frame. Commands that read argument
+// views see the atoms in place. Commands using special forms are copied into
+// a Sexp and interpreted by interp_with instead.
+Optional<std::string> interp_view(const SexpView &view,
+                                  const CommandSet &commands,
+                                  CancelToken token = CancelToken::never());
+
+// Stringify a SexpView, as for a Sexp
+std::ostream& operator<<(std::ostream& os, const SexpView &view);
+
+#endif /* _SEXP_VIEW_H_ */
@@ -0,0 +1,138 @@
+#include "shared-interp.hpp"
+
+// The epoch advances every time a table is retired. Reader slots are shared
+// by all SharedInterpreters; a slot holds the epoch in which its thread
+// started evaluating, or 0 while the thread is not evaluating.
+static std::atomic<uint64_t> global_epoch(1);
+
+struct alignas(64) ReaderSlot {
+    std::atomic<uint64_t> epoch;
+    std::atomic<bool> claimed;
+};
+
+static ReaderSlot reader_slots[SharedInterpreter::MAX_READERS];
+
+// This thread's reader slot, claimed on first use and released when the
+// thread exits
+class ThreadSlot {
+public:
+    ThreadSlot() : index(-1), depth(0) {}
+
+    ~ThreadSlot() {
+        if(index >= 0) {
+            reader_slots[index].claimed.store(false);
+        }
+    }
+
+    ReaderSlot &get() {
+        if(index < 0) {
+            for(int i = 0; i < SharedInterpreter::MAX_READERS; ++i) {
+                bool expected = false;
+                if(reader_slots[i].claimed.compare_exchange_strong(expected,
+                                                                   true)) {
+                    index = i;
+                    break;
+                }
+            }
+            if(index < 0) {
+                throw std::runtime_error("too many interpreter threads");
+            }
+        }
+        return reader_slots[index];
+    }
+
+    int index;
+    // Nested evaluations (commands that evaluate) keep the outer epoch
+    int depth;
+};
+
+static thread_local ThreadSlot this_thread_slot;
+
+// Marks this thread as evaluating for the guard's lifetime
+class ReadGuard {
+public:
+    ReadGuard() : slot(this_thread_slot.get()) {
+        if(this_thread_slot.depth++ == 0) {
+            slot.epoch.store(global_epoch.load());
+        }
+    }
+
+    ~ReadGuard() {
+        if(--this_thread_slot.depth == 0) {
+            slot.epoch.store(0);
+        }
+    }
+
+private:
+    ReaderSlot &slot;
+};
+
+SharedInterpreter::SharedInterpreter(CommandSet commands)
+    : current(new CommandSet(commands)) {}
+
+SharedInterpreter::~SharedInterpreter() {
+    delete current.load();
+    for(auto &table : retired) {
+        delete table.first;
+    }
+}
+
+Optional<std::string> SharedInterpreter::interp(Sexp s, CancelToken token) {
+    ReadGuard guard;
+    Definer define = [this](std::string name, Command command) {
+        this->define(name, command);
+    };
+    return interp_with(s, *current.load(), token, Checkpoint(), define);
+}
+
+Interpreter SharedInterpreter::interpreter() {
+    return [this](Sexp s) {
+        return interp(s);
+    };
+}
+
+void SharedInterpreter::publish(CommandSet commands) {
+    const CommandSet *table = new CommandSet(commands);
+    std::lock_guard<std::mutex> guard(writer);
+    replace_locked(table);
+}
+
+void SharedInterpreter::define(std::string name, Command command) {
+    std::lock_guard<std::mutex> guard(writer);
+    CommandSet *table = new CommandSet(*current.load());
+    (*table)[name] = command;
+    replace_locked(table);
+}
+
+void SharedInterpreter::replace_locked(const CommandSet *table) {
+    const CommandSet *old = current.exchange(table);
+    retired.push_back(std::make_pair(old, global_epoch.fetch_add(1)));
+    reclaim_locked();
+}
+
+size_t SharedInterpreter::reclaim() {
+    std::lock_guard<std::mutex> guard(writer);
+    return reclaim_locked();
+}
+
+size_t SharedInterpreter::reclaim_locked() {
+    // A reader that announced an epoch after a table was retired loaded the
+    // table that replaced it
+    uint64_t oldest = UINT64_MAX;
+    for(int i = 0; i < MAX_READERS; ++i) {
+        uint64_t epoch = reader_slots[i].epoch.load();
+        if(epoch != 0 && epoch < oldest) {
+            oldest = epoch;
+        }
+    }
+    std::vector<std::pair<const CommandSet *, uint64_t>> keep;
+    for(auto &table : retired) {
+        if(table.second < oldest) {
+            delete table.first;
+        } else {
+            keep.push_back(table);
+        }
+    }
+    retired.swap(keep);
+    return retired.size();
+}
@@ -0,0 +1,65 @@
+#ifndef _SHARED_INTERP_H_
+#define _SHARED_INTERP_H_
+
+#include "interp.hpp"
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+// An interpreter handle that many threads can evaluate with at once, and
+// whose command table can be replaced while they do.
+//
+// Evaluations read the current command table without taking any lock. A
+// table published with `publish` is immutable; the table it replaces is
+// reclaimed once every evaluation that might still be using it has
+// finished, using epoch-based reclamation: each evaluating thread announces
+// the epoch in which it started, and a retired table is only freed once no
+// thread announces an epoch at or before the one it was retired in.
+class SharedInterpreter {
+public:
+    explicit SharedInterpreter(CommandSet commands);
+
+    // Must not be destroyed while evaluations are still running
+    ~SharedInterpreter();
+
+    // Interpret `s` with the current command table. Safe to call from any
+    // number of threads, including from within a command.
+    // Definitions (`defmacro`, `alias`) are published as a new table.
+    Optional<std::string> interp(Sexp s,
+                                 CancelToken token = CancelToken::never());
+
+    // An Interpreter function that evaluates through this handle
+    Interpreter interpreter();
+
+    // Atomically replace the command table. Evaluations already running
+    // finish with the table they started with.
+    void publish(CommandSet commands);
+
+    // Atomically add or replace a single command
+    void define(std::string name, Command command);
+
+    // Free retired tables that are no longer in use, returning how many are
+    // still waiting for readers to finish
+    size_t reclaim();
+
+    // Maximum number of threads that may evaluate at the same time
+    static const int MAX_READERS = 256;
+
+private:
+    SharedInterpreter(const SharedInterpreter &);
+    SharedInterpreter &operator=(const SharedInterpreter &);
+
+    void replace_locked(const CommandSet *table);
+    size_t reclaim_locked();
+
+    std::atomic<const CommandSet *> current;
+    // Serializes publishers and guards `retired`
+    std::mutex writer;
+    // Replaced tables and the epoch in which they were replaced
+    std::vector<std::pair<const CommandSet *, uint64_t>> retired;
+};
+
+#endif /* _SHARED_INTERP_H_ */
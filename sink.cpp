@@ -0,0 +1,64 @@
+#include "sink.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <unistd.h>
+
+void StreamWriter::write(const char *data, size_t size) {
+    os.write(data, size);
+    os.flush();
+}
+
+void FdWriter::write(const char *data, size_t size) {
+    while(size > 0) {
+        ssize_t written = ::write(fd, data, size);
+        if(written < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            throw std::runtime_error("write failed: "
+                                     + std::string(strerror(errno)));
+        }
+        data += written;
+        size -= written;
+    }
+}
+
+BufferWriter::BufferWriter(size_t frame_size, Send send)
+    : frame_size(frame_size), send(send) {
+    if(frame_size == 0) {
+        throw std::invalid_argument("frame size must be positive");
+    }
+    frame.reserve(frame_size);
+}
+
+BufferWriter::~BufferWriter() {
+    // Throwing here would terminate, especially while unwinding from an
+    // earlier failure
+    try {
+        flush();
+    } catch(...) {
+    }
+}
+
+void BufferWriter::write(const char *data, size_t size) {
+    while(size > 0) {
+        size_t n = std::min(size, frame_size - frame.size());
+        frame.append(data, n);
+        data += n;
+        size -= n;
+        if(frame.size() == frame_size) {
+            send(frame.data(), frame.size());
+            frame.clear();
+        }
+    }
+}
+
+void BufferWriter::flush() {
+    if(!frame.empty()) {
+        send(frame.data(), frame.size());
+        frame.clear();
+    }
+}
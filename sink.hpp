@@ -0,0 +1,62 @@
+#ifndef _SINK_H_
+#define _SINK_H_
+
+#include "interp.hpp"
+
+#include <functional>
+#include <iostream>
+#include <string>
+
+// Writes chunks to a std::ostream, flushing after each one so that output
+// appears as it is produced (e.g. std::cout in a REPL, or a std::ofstream)
+class StreamWriter : public ChunkWriter {
+public:
+    explicit StreamWriter(std::ostream &os) : os(os) {}
+
+    void write(const char *data, size_t size);
+    using ChunkWriter::write;
+
+private:
+    std::ostream &os;
+};
+
+// Writes chunks to a file descriptor, such as an open file or a connected
+// socket
+class FdWriter : public ChunkWriter {
+public:
+    explicit FdWriter(int fd) : fd(fd) {}
+
+    // throws: std::runtime_error if the descriptor cannot be written
+    void write(const char *data, size_t size);
+    using ChunkWriter::write;
+
+private:
+    int fd;
+};
+
+// Packs chunks into fixed-size downlink frames, handing each frame to `send`
+// as soon as it is full. The last, partial frame is sent by `flush` or on
+// destruction; call `flush` to find out if sending it fails, since the
+// destructor can't throw and drops the frame instead.
+class BufferWriter : public ChunkWriter {
+public:
+    typedef std::function<void(const char *, size_t)> Send;
+
+    // throws: std::invalid_argument if `frame_size` is 0
+    BufferWriter(size_t frame_size, Send send);
+    ~BufferWriter();
+
+    void write(const char *data, size_t size);
+    using ChunkWriter::write;
+
+    // Send whatever is buffered as a (short) frame
+    // throws: whatever `send` throws, keeping the frame buffered
+    void flush();
+
+private:
+    size_t frame_size;
+    Send send;
+    std::string frame;
+};
+
+#endif /* _SINK_H_ */
@@ -0,0 +1,267 @@
+#ifndef _STATIC_COMMANDS_H_
+#define _STATIC_COMMANDS_H_
+
+#include "interp.hpp"
+
+#include <algorithm>
+#include <array>
+#include <list>
+#include <span>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// A string literal usable as a template argument, as in Cmd<"add", &add>
+template<size_t N>
+struct FixedString {
+    char chars[N];
+
+    constexpr FixedString(const char (&s)[N]) {
+        std::copy(s, s + N, chars);
+    }
+
+    constexpr std::string_view view() const {
+        return std::string_view(chars, N - 1);
+    }
+};
+
+// A command named `Name` implemented by the function `Fn`, which may have
+// any of the command signatures in interp.hpp
+template<FixedString Name, auto Fn>
+struct Cmd {
+    static constexpr std::string_view name = Name.view();
+    static constexpr auto fn = Fn;
+
+    // Call the command with the evaluated `args`. View commands get views
+    // of them in `views`; the others get copies.
+    static std::string call(std::span<const std::string> args,
+                            std::vector<ArgView> &views,
+                            const CancelToken &token) {
+        typedef decltype(Fn) F;
+        if constexpr(std::is_invocable_r<std::string, F,
+                                         std::span<const ArgView>>::value) {
+            views.clear();
+            for(const std::string &arg : args) {
+                views.push_back(ArgView(arg));
+            }
+            return Fn(std::span<const ArgView>(views));
+        } else {
+            std::list<std::string> copies(args.begin(), args.end());
+            if constexpr(std::is_invocable_r<std::string, F,
+                                             std::list<std::string>,
+                                             const CancelToken &>::value) {
+                return Fn(copies, token);
+            } else if constexpr(std::is_invocable<F, std::list<std::string>,
+                                                  ChunkWriter &,
+                                                  const CancelToken &>::value) {
+                StringWriter out;
+                Fn(copies, out, token);
+                return out.str;
+            } else {
+                static_assert(std::is_invocable_r<std::string, F,
+                                                  std::list<std::string>
+                                                  >::value,
+                              "not a command signature");
+                return Fn(copies);
+            }
+        }
+    }
+};
+
+// A command name and the position of its command in a StaticCommandSet
+struct StaticCommandEntry {
+    std::string_view name;
+    size_t index;
+};
+
+// The names of `Cmds`, sorted for binary search
+template<class... Cmds>
+constexpr std::array<StaticCommandEntry, sizeof...(Cmds)>
+static_command_table() {
+    std::array<StaticCommandEntry, sizeof...(Cmds)> table{};
+    size_t i = 0;
+    ((table[i] = StaticCommandEntry{Cmds::name, i}, i++), ...);
+    std::sort(table.begin(), table.end(),
+              [](const StaticCommandEntry &a, const StaticCommandEntry &b) {
+                  return a.name < b.name;
+              });
+    return table;
+}
+
+// A command set fixed at compile time, e.g.
+//   StaticCommandSet<Cmd<"add", &add>, Cmd<"concat", &concat>> flight;
+// Names are looked up by binary search in a table sorted at compile time, and
+// commands are called directly rather than through std::function, so the
+// compiler can inline them. Nothing is built at startup.
+// Static sets cannot be extended at runtime, so they do not support `let`,
+// `set!`, `defmacro` or `alias`; use `to_command_set` where those are needed.
+template<class... Cmds>
+class StaticCommandSet {
+public:
+    static constexpr size_t size = sizeof...(Cmds);
+
+    static constexpr bool contains(std::string_view name) {
+        return find(name) != size;
+    }
+
+    // Call the command called `name` with the evaluated `args`, turning the
+    // errors commands may throw into error results
+    // throws: DeadlineExceeded
+    static std::string call(std::string_view name,
+                            std::span<const std::string> args,
+                            std::vector<ArgView> &views,
+                            const CancelToken &token) {
+        size_t i = find(name);
+        if(i == size) {
+            return "Error: Command '" + std::string(name) + "' undefined.";
+        }
+        try {
+            std::string result = dispatch(i, args, views, token,
+                                          std::index_sequence_for<Cmds...>());
+            // Abandon results of commands that overran their budget
+            token.check();
+            return result;
+        } catch(const std::invalid_argument &e) {
+            return "Error: invalid argument: " + std::string(e.what());
+        }
+    }
+
+    // The same commands as an ordinary CommandSet
+    static CommandSet to_command_set() {
+        CommandSet commands;
+        ((commands[std::string(Cmds::name)] = Command(Cmds::fn)), ...);
+        return commands;
+    }
+
+private:
+    static constexpr std::array<StaticCommandEntry, size> table =
+        static_command_table<Cmds...>();
+
+    static_assert(std::adjacent_find(
+                      table.begin(), table.end(),
+                      [](const StaticCommandEntry &a,
+                         const StaticCommandEntry &b) {
+                          return a.name == b.name;
+                      }) == table.end(),
+                  "command names must be unique");
+
+    // The position of the command called `name`, or `size` if there is none
+    static constexpr size_t find(std::string_view name) {
+        const StaticCommandEntry *entry = std::lower_bound(
+            table.begin(), table.end(), name,
+            [](const StaticCommandEntry &a, std::string_view b) {
+                return a.name < b;
+            });
+        if(entry == table.end() || entry->name != name) {
+            return size;
+        }
+        return entry->index;
+    }
+
+    template<size_t... I>
+    static std::string dispatch(size_t i, std::span<const std::string> args,
+                                std::vector<ArgView> &views,
+                                const CancelToken &token,
+                                std::index_sequence<I...>) {
+        std::string result;
+        ((i == I ? (result = Cmds::call(args, views, token), true) : false)
+         || ...);
+        return result;
+    }
+};
+
+// The buffers used to evaluate commands with a static command set, kept per
+// thread so that they are reused from one evaluation to the next
+struct StaticEvalStacks {
+    // A list being evaluated, and where its values start in `values`
+    struct Level {
+        std::list<Sexp>::const_iterator next;
+        std::list<Sexp>::const_iterator end;
+        size_t base;
+    };
+    std::vector<Level> open;
+    std::vector<std::string> values;
+    std::vector<ArgView> views;
+    // Is an evaluation using these buffers?
+    bool busy = false;
+};
+
+inline thread_local StaticEvalStacks static_eval_stacks;
+
+// Interpret the given command Sexp using a static command set, giving up
+// with the error "Error: deadline exceeded." once `token` expires
+template<class... Cmds>
+Optional<std::string> interp_with(const Sexp &s,
+                                  const StaticCommandSet<Cmds...> &commands,
+                                  CancelToken token = CancelToken::never()) {
+    // Evaluations started by a command get buffers of their own
+    StaticEvalStacks nested;
+    StaticEvalStacks &stacks = static_eval_stacks.busy ? nested
+        : static_eval_stacks;
+    struct Busy {
+        StaticEvalStacks &stacks;
+        explicit Busy(StaticEvalStacks &stacks) : stacks(stacks) {
+            stacks.busy = true;
+            stacks.open.clear();
+            stacks.values.clear();
+        }
+        ~Busy() { stacks.busy = false; }
+    } busy(stacks);
+    std::vector<StaticEvalStacks::Level> &open = stacks.open;
+    std::vector<std::string> &values = stacks.values;
+    // The node to evaluate next
+    const Sexp *node = &s;
+
+    try {
+        while(true) {
+            if(node) {
+                token.check();
+                if(node->isAtom) {
+                    values.push_back(node->atom);
+                } else if(node->elements.empty()) {
+                    std::cout << "Error: element fails interp: "
+                              << *node << std::endl;
+                    return None<std::string>();
+                } else {
+                    StaticEvalStacks::Level level;
+                    level.next = node->elements.begin();
+                    level.end = node->elements.end();
+                    level.base = values.size();
+                    open.push_back(level);
+                    node = &*open.back().next++;
+                    continue;
+                }
+            } else {
+                // Every element of the innermost list has been evaluated
+                size_t base = open.back().base;
+                open.pop_back();
+                std::span<const std::string> args(values.data() + base + 1,
+                                                  values.size() - base - 1);
+                std::string result = commands.call(values[base], args,
+                                                   stacks.views, token);
+                values.resize(base);
+                values.push_back(std::move(result));
+            }
+
+            if(open.empty()) {
+                return Just(values.back());
+            }
+            StaticEvalStacks::Level &parent = open.back();
+            node = parent.next == parent.end ? nullptr : &*parent.next++;
+        }
+    } catch(const DeadlineExceeded &e) {
+        return Just(std::string("Error: deadline exceeded."));
+    }
+}
+
+// Make an interpreter with a static command set "built-in"
+template<class... Cmds>
+Interpreter make_interpreter(StaticCommandSet<Cmds...> commands) {
+    return [commands](Sexp s) {
+        return interp_with(s, commands);
+    };
+}
+
+#endif /* _STATIC_COMMANDS_H_ */
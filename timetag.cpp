@@ -0,0 +1,254 @@
+#include "timetag.hpp"
+
+#include <cstdio>
+#include <map>
+
+#include "cereal/archives/binary.hpp"
+#include "cereal/types/string.hpp"
+
+TimingWheel::TimingWheel(OrbitTime now) : now(now) {
+    for(int level = 0; level < LEVELS; ++level) {
+        level_size[level] = 0;
+    }
+}
+
+void TimingWheel::insert(Id id, OrbitTime at, Sexp sexp) {
+    Entry entry;
+    entry.id = id;
+    entry.at = at;
+    entry.sexp = sexp;
+    place(entry);
+}
+
+// Put `entry` in the slot of the lowest level whose span still contains it,
+// relative to the current time
+void TimingWheel::place(Entry entry) {
+    Slot where;
+    if(entry.at <= now) {
+        where.level = -1;
+        where.slot = 0;
+        where.entry = overdue.insert(overdue.end(), entry);
+    } else {
+        OrbitTime diff = entry.at ^ now;
+        int level = 0;
+        // Anything beyond the top level's span goes in the top level, and
+        // cascades down as time reaches it
+        while(level < LEVELS - 1 && diff >> (SLOT_BITS * (level + 1)) != 0) {
+            level++;
+        }
+        where.level = level;
+        where.slot = (entry.at >> (SLOT_BITS * level)) & (SLOTS - 1);
+        std::list<Entry> &slot = slots[level][where.slot];
+        where.entry = slot.insert(slot.end(), entry);
+        level_size[level]++;
+    }
+    index[entry.id] = where;
+}
+
+bool TimingWheel::cancel(Id id) {
+    std::unordered_map<Id, Slot>::iterator it = index.find(id);
+    if(it == index.end()) {
+        return false;
+    }
+    Slot where = it->second;
+    if(where.level < 0) {
+        overdue.erase(where.entry);
+    } else {
+        slots[where.level][where.slot].erase(where.entry);
+        level_size[where.level]--;
+    }
+    index.erase(it);
+    return true;
+}
+
+// Re-place the entries in the current slot of `level` into lower levels
+void TimingWheel::cascade(int level) {
+    std::list<Entry> entries;
+    entries.swap(slots[level][(now >> (SLOT_BITS * level)) & (SLOTS - 1)]);
+    level_size[level] -= entries.size();
+    for(Entry &entry : entries) {
+        place(entry);
+    }
+}
+
+void TimingWheel::advance(OrbitTime to, std::vector<Entry> &due) {
+    while(true) {
+        // Entries land here in the order they were placed, not the order
+        // they were due
+        overdue.sort([](const Entry &a, const Entry &b) {
+            return a.at < b.at;
+        });
+        for(Entry &entry : overdue) {
+            index.erase(entry.id);
+            due.push_back(entry);
+        }
+        overdue.clear();
+
+        if(now >= to) {
+            return;
+        }
+        // Nothing can come due before the next cascade of the lowest
+        // non-empty level, so jump straight there
+        int lowest = 0;
+        while(lowest < LEVELS && level_size[lowest] == 0) {
+            lowest++;
+        }
+        if(lowest == LEVELS) {
+            now = to;
+            return;
+        }
+        OrbitTime span = (OrbitTime)1 << (SLOT_BITS * lowest);
+        OrbitTime next = (now | (span - 1)) + 1;
+        if(next > to || next == 0) {
+            now = to;
+            return;
+        }
+        now = next;
+
+        int top = 0;
+        while(top + 1 < LEVELS
+              && (now & (((OrbitTime)1 << (SLOT_BITS * (top + 1))) - 1)) == 0) {
+            top++;
+        }
+        for(int level = top; level > 0; --level) {
+            cascade(level);
+        }
+        // Everything in the current level 0 slot is due now
+        std::list<Entry> &slot = slots[0][now & (SLOTS - 1)];
+        level_size[0] -= slot.size();
+        for(Entry &entry : slot) {
+            index.erase(entry.id);
+            due.push_back(entry);
+        }
+        slot.clear();
+    }
+}
+
+TimeTaggedQueue::TimeTaggedQueue(Interpreter interp, OrbitClock clock,
+                                 std::string journal_path)
+    : interp(interp), clock(clock), wheel(clock()), next_id(1),
+      journal_path(journal_path) {
+    if(journal_path != "") {
+        replay();
+        journal.open(journal_path.c_str(),
+                     std::ios::binary | std::ios::app);
+    }
+}
+
+// Rebuild the queue from the journal, then compact the journal down to
+// the commands that are still pending and the highest id handed out
+void TimeTaggedQueue::replay() {
+    std::map<Id, std::pair<OrbitTime, std::string>> pending;
+    {
+        std::ifstream in(journal_path.c_str(), std::ios::binary);
+        while(in && in.peek() != EOF) {
+            uint8_t op;
+            Id id;
+            OrbitTime at;
+            std::string frame;
+            try {
+                cereal::BinaryInputArchive iarchive(in);
+                iarchive(op, id, at, frame);
+            } catch(const cereal::Exception &e) {
+                // Torn final record from a crash mid-write
+                break;
+            }
+            if(op == SCHEDULE) {
+                pending[id] = std::make_pair(at, frame);
+            } else if(op == REMOVE) {
+                pending.erase(id);
+            }
+            if(id >= next_id) {
+                next_id = id + 1;
+            }
+        }
+    }
+
+    std::string tmp_path = journal_path + ".tmp";
+    {
+        std::ofstream out(tmp_path.c_str(), std::ios::binary | std::ios::trunc);
+        cereal::BinaryOutputArchive oarchive(out);
+        // Ids of commands that already ran or were cancelled must not be
+        // handed out again
+        if(next_id > 1) {
+            uint8_t op = HIGHEST;
+            OrbitTime at = 0;
+            std::string frame;
+            oarchive(op, next_id - 1, at, frame);
+        }
+        for(auto &entry : pending) {
+            uint8_t op = SCHEDULE;
+            oarchive(op, entry.first, entry.second.first, entry.second.second);
+            wheel.insert(entry.first, entry.second.first,
+                         deserialize(entry.second.second));
+        }
+    }
+    std::rename(tmp_path.c_str(), journal_path.c_str());
+}
+
+void TimeTaggedQueue::record(JournalOp op, Id id, OrbitTime at,
+                             const Sexp *s) {
+    if(!journal.is_open()) {
+        return;
+    }
+    uint8_t op_byte = op;
+    std::string frame = s ? serialize(*s) : "";
+    {
+        cereal::BinaryOutputArchive oarchive(journal);
+        oarchive(op_byte, id, at, frame);
+    }
+    journal.flush();
+}
+
+Optional<TimeTaggedQueue::Id> TimeTaggedQueue::schedule(Sexp at_form) {
+    if(at_form.isAtom || at_form.elements.size() != 3) {
+        return None<Id>();
+    }
+    std::list<Sexp>::iterator it = at_form.elements.begin();
+    if(!it->isAtom || it->atom != "at") {
+        return None<Id>();
+    }
+    ++it;
+    if(!it->isAtom || it->atom == ""
+       || it->atom.find_first_not_of("0123456789") != std::string::npos) {
+        return None<Id>();
+    }
+    OrbitTime at;
+    try {
+        at = std::stoull(it->atom);
+    } catch(const std::out_of_range &e) {
+        return None<Id>();
+    }
+    ++it;
+    if(it->isAtom) {
+        return None<Id>();
+    }
+    return Just(schedule(at, *it));
+}
+
+TimeTaggedQueue::Id TimeTaggedQueue::schedule(OrbitTime at, Sexp s) {
+    Id id = next_id++;
+    record(SCHEDULE, id, at, &s);
+    wheel.insert(id, at, s);
+    return id;
+}
+
+bool TimeTaggedQueue::cancel(Id id) {
+    if(!wheel.cancel(id)) {
+        return false;
+    }
+    record(REMOVE, id, 0, nullptr);
+    return true;
+}
+
+std::vector<std::pair<TimeTaggedQueue::Id, Optional<std::string>>>
+TimeTaggedQueue::run_due() {
+    std::vector<TimingWheel::Entry> due;
+    wheel.advance(clock(), due);
+    std::vector<std::pair<Id, Optional<std::string>>> results;
+    for(TimingWheel::Entry &entry : due) {
+        record(REMOVE, entry.id, entry.at, nullptr);
+        results.push_back(std::make_pair(entry.id, interp(entry.sexp)));
+    }
+    return results;
+}
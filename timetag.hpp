@@ -0,0 +1,115 @@
+#ifndef _TIMETAG_H_
+#define _TIMETAG_H_
+
+#include "interp.hpp"
+
+#include <cstdint>
+#include <fstream>
+#include <list>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// Orbit time in milliseconds
+typedef uint64_t OrbitTime;
+
+// Source of the current orbit time. Tests inject a fake clock to simulate
+// long schedules quickly.
+typedef std::function<OrbitTime()> OrbitClock;
+
+// A hierarchical timing wheel of time-tagged commands.
+//
+// Level L has 64 slots, each covering 64^L ms, so insertion and
+// cancellation are O(1) and advancing only touches the slots that come due.
+// Entries due in the past fire on the next advance.
+class TimingWheel {
+public:
+    typedef uint64_t Id;
+
+    struct Entry {
+        Id id;
+        OrbitTime at;
+        Sexp sexp;
+    };
+
+    explicit TimingWheel(OrbitTime now);
+
+    void insert(Id id, OrbitTime at, Sexp sexp);
+
+    // Remove the entry with the given id; false if it is not scheduled
+    bool cancel(Id id);
+
+    // Advance to `now`, appending every entry that came due (in due order)
+    // to `due`
+    void advance(OrbitTime now, std::vector<Entry> &due);
+
+    size_t size() const { return index.size(); }
+
+    static const int LEVELS = 11;
+    static const int SLOT_BITS = 6;
+    static const int SLOTS = 1 << SLOT_BITS;
+
+private:
+    struct Slot {
+        int level;
+        int slot;
+        std::list<Entry>::iterator entry;
+    };
+
+    void place(Entry entry);
+    void cascade(int level);
+
+    OrbitTime now;
+    std::list<Entry> slots[LEVELS][SLOTS];
+    size_t level_size[LEVELS];
+    std::list<Entry> overdue;
+    std::unordered_map<Id, Slot> index;
+};
+
+// A queue of commands to run at given orbit times, written as
+//   (at <time> <sexp>)
+// Due commands are run through the given interpreter by `run_due`.
+//
+// If a journal path is given, every change to the queue is appended to the
+// journal so that pending commands survive a restart. Commands are marked
+// done in the journal *before* they run, so a restart never runs a command
+// twice.
+class TimeTaggedQueue {
+public:
+    typedef TimingWheel::Id Id;
+
+    TimeTaggedQueue(Interpreter interp, OrbitClock clock,
+                    std::string journal_path = "");
+
+    // Schedule an `(at <time> <sexp>)` form. None if it is malformed.
+    Optional<Id> schedule(Sexp at_form);
+
+    // Schedule `s` to run at `at`
+    Id schedule(OrbitTime at, Sexp s);
+
+    // Cancel a scheduled command; false if it is not pending
+    bool cancel(Id id);
+
+    // Run every command that is due by the clock's current time, in due
+    // order, returning each command's id and result
+    std::vector<std::pair<Id, Optional<std::string>>> run_due();
+
+    size_t size() const { return wheel.size(); }
+
+private:
+    // HIGHEST only carries the highest id handed out, across compactions
+    enum JournalOp { SCHEDULE = 0, REMOVE = 1, HIGHEST = 2 };
+
+    void replay();
+    void record(JournalOp op, Id id, OrbitTime at, const Sexp *s);
+
+    Interpreter interp;
+    OrbitClock clock;
+    TimingWheel wheel;
+    Id next_id;
+    std::string journal_path;
+    std::ofstream journal;
+};
+
+#endif /* _TIMETAG_H_ */